@@ -0,0 +1,87 @@
+#include "arena.h"
+
+#include <memory>
+
+using namespace std;
+
+namespace ast {
+
+namespace {
+
+thread_local Arena* current_arena = nullptr;
+
+}  // namespace
+
+ArenaStats& GetArenaStats() {
+    static ArenaStats stats;
+    return stats;
+}
+
+Arena::Scope::Scope()
+        : arena_{new Arena}, previous_{current_arena} {
+    current_arena = arena_;
+}
+
+Arena::Scope::~Scope() {
+    current_arena = previous_;
+    arena_->in_scope_ = false;
+    arena_->DeleteIfUnused();
+}
+
+Arena* Arena::Current() noexcept {
+    return current_arena;
+}
+
+pmr::memory_resource* Arena::CurrentResource() noexcept {
+    return current_arena != nullptr ? current_arena : pmr::get_default_resource();
+}
+
+void* Arena::do_allocate(size_t bytes, size_t alignment) {
+    void* result = nullptr;
+    if (bytes + alignment > BLOCK_SIZE / 4) {
+        // Крупный запрос получает собственный блок, чтобы не терять остаток текущего
+        size_t space = bytes + alignment;
+        result = NewBlock(space);
+        align(alignment, bytes, result, space);
+    } else {
+        result = next_;
+        if (next_ == nullptr || align(alignment, bytes, result, available_) == nullptr) {
+            result = NewBlock(BLOCK_SIZE);
+            available_ = BLOCK_SIZE;
+            align(alignment, bytes, result, available_);
+        }
+        next_ = static_cast<byte*>(result) + bytes;
+        available_ -= bytes;
+    }
+
+    ++live_allocations_;
+    auto& stats = GetArenaStats();
+    ++stats.allocations;
+    stats.allocated_bytes += bytes;
+    return result;
+}
+
+void Arena::do_deallocate([[maybe_unused]] void* p, [[maybe_unused]] size_t bytes,
+                          [[maybe_unused]] size_t alignment) {
+    --live_allocations_;
+    DeleteIfUnused();
+}
+
+bool Arena::do_is_equal(const pmr::memory_resource& other) const noexcept {
+    return this == &other;
+}
+
+byte* Arena::NewBlock(size_t size) {
+    // Содержимое блока не инициализируется: его перезапишут размещаемые объекты
+    blocks_.push_back(unique_ptr<byte[]>(new byte[size]));
+    ++GetArenaStats().blocks;
+    return blocks_.back().get();
+}
+
+void Arena::DeleteIfUnused() noexcept {
+    if (!in_scope_ && live_allocations_ == 0) {
+        delete this;
+    }
+}
+
+}  // namespace ast
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <memory_resource>
+#include <vector>
+
+namespace ast {
+
+// Статистика арен дерева разбора
+struct ArenaStats {
+    // Участки памяти, выделенные из арен, и их суммарный размер
+    std::uint64_t allocations = 0;
+    std::uint64_t allocated_bytes = 0;
+    // Крупные блоки, запрошенные аренами у системного распределителя
+    std::uint64_t blocks = 0;
+};
+
+// Возвращает накопленную статистику арен
+ArenaStats& GetArenaStats();
+
+// Арена, из которой размещаются узлы дерева разбора одной программы и их данные.
+// Память выделяется последовательно из крупных блоков и не переиспользуется: освобождение
+// отдельного участка лишь уменьшает счётчик выделенных участков. Арена удаляет себя вместе со
+// всеми блоками, когда освобождено всё выделенное из неё и завершена область Scope,
+// создавшая арену. Поэтому арена живёт ровно столько, сколько последний узел программы,
+// кому бы ни принадлежал этот узел (дереву разбора, классу или байткоду)
+class Arena : public std::pmr::memory_resource {
+public:
+    // Размер блока, запрашиваемого у системного распределителя
+    static constexpr std::size_t BLOCK_SIZE = 64 * 1024;
+
+    // Создаёт арену и делает её текущей для потока до завершения области
+    class Scope {
+    public:
+        Scope();
+        ~Scope();
+
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+
+        [[nodiscard]] Arena& GetArena() const {
+            return *arena_;
+        }
+
+    private:
+        Arena* arena_;
+        Arena* previous_;
+    };
+
+    // Возвращает текущую арену потока либо nullptr, если программа сейчас не разбирается
+    static Arena* Current() noexcept;
+
+    // Возвращает текущую арену потока либо распределитель памяти по умолчанию
+    static std::pmr::memory_resource* CurrentResource() noexcept;
+
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+
+private:
+    Arena() = default;
+    ~Arena() override = default;
+
+    void* do_allocate(std::size_t bytes, std::size_t alignment) override;
+    void do_deallocate(void* p, std::size_t bytes, std::size_t alignment) override;
+    [[nodiscard]] bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override;
+
+    // Выделяет у системного распределителя блок размера size
+    std::byte* NewBlock(std::size_t size);
+    // Удаляет арену, если она больше не нужна
+    void DeleteIfUnused() noexcept;
+
+    std::vector<std::unique_ptr<std::byte[]>> blocks_;
+    std::byte* next_ = nullptr;
+    std::size_t available_ = 0;
+    // Число выделенных и ещё не освобождённых участков памяти
+    std::size_t live_allocations_ = 0;
+    bool in_scope_ = true;
+};
+
+}  // namespace ast
@@ -0,0 +1,566 @@
+#include "flat_ast.h"
+
+#include <sstream>
+#include <unordered_map>
+
+using namespace std;
+
+namespace flat {
+
+using runtime::Closure;
+using runtime::Context;
+using runtime::ObjectHolder;
+using runtime::ObjectType;
+
+namespace {
+
+const runtime::Symbol ADD_METHOD{"__add__"sv};
+const runtime::Symbol INIT_METHOD{"__init__"sv};
+const string EMPTY_OBJECT = "None"s;
+
+// Тело метода класса, выполняемое над плоским деревом программы
+class FlatMethodBody : public runtime::Executable {
+public:
+    FlatMethodBody(Tree& tree, NodeId root)
+        : tree_{tree}, root_{root} {
+    }
+
+    ObjectHolder Execute(Closure& closure, Context& context) override;
+
+private:
+    Tree& tree_;
+    NodeId root_;
+};
+
+// Переводит узлы дерева разбора в плоское дерево. Дочерние узлы записываются раньше
+// родительского, поэтому корень программы получает наибольший номер
+class Flattener : public ast::Visitor {
+public:
+    explicit Flattener(Tree& tree)
+        : tree_{tree} {
+    }
+
+    NodeId Flatten(ast::Statement& node) {
+        node.Accept(*this);
+        return result_;
+    }
+
+    void Visit(ast::NumericConst& node) override {
+        result_ = Emit(NodeKind::Constant, AddConstant(node.GetHolder()));
+    }
+
+    void Visit(ast::StringConst& node) override {
+        result_ = Emit(NodeKind::Constant, AddConstant(node.GetHolder()));
+    }
+
+    void Visit(ast::BoolConst& node) override {
+        result_ = Emit(NodeKind::Constant, AddConstant(node.GetHolder()));
+    }
+
+    void Visit(ast::VariableValue& node) override {
+        const auto& fields = node.GetFieldNames();
+        const uint32_t extra = AddExtra({SlotIndex(node.GetSlot()),
+                                         static_cast<uint32_t>(fields.size())});
+        for (runtime::Symbol field : fields) {
+            tree_.extra.push_back(AddName(field));
+        }
+        result_ = Emit(NodeKind::Variable, AddName(node.GetName()), extra);
+    }
+
+    void Visit(ast::Assignment& node) override {
+        const NodeId value = Flatten(*node.Value());
+        result_ = Emit(NodeKind::Assignment, value,
+                       AddExtra({AddName(node.GetName()), SlotIndex(node.GetSlot())}));
+    }
+
+    void Visit(ast::FieldAssignment& node) override {
+        const NodeId object = Flatten(node.Object());
+        const NodeId value = Flatten(*node.Value());
+        result_ = Emit(NodeKind::FieldAssignment, object,
+                       AddExtra({AddName(node.GetFieldName()), value}));
+    }
+
+    void Visit([[maybe_unused]] ast::None& node) override {
+        result_ = Emit(NodeKind::None);
+    }
+
+    void Visit(ast::Print& node) override {
+        result_ = Emit(NodeKind::Print, AddList({}, node.Args()));
+    }
+
+    void Visit(ast::MethodCall& node) override {
+        const NodeId object = Flatten(*node.Object());
+        const auto site = static_cast<uint32_t>(tree_.call_sites.size());
+        tree_.call_sites.emplace_back();
+        result_ = Emit(NodeKind::MethodCall, object,
+                       AddList({AddName(node.GetMethodName()), site, node.IsTailCall() ? 1U : 0U},
+                               node.Args()));
+    }
+
+    void Visit(ast::NewInstance& node) override {
+        const auto cls = static_cast<uint32_t>(tree_.classes.size());
+        tree_.classes.push_back(&node.GetClass());
+        result_ = Emit(NodeKind::NewInstance, cls, AddList({}, node.Args()));
+    }
+
+    void Visit(ast::Stringify& node) override {
+        result_ = Emit(NodeKind::Stringify, Flatten(*node.Argument()));
+    }
+
+    void Visit(ast::Add& node) override {
+        VisitBinary(NodeKind::Add, node);
+    }
+
+    void Visit(ast::Sub& node) override {
+        VisitBinary(NodeKind::Sub, node);
+    }
+
+    void Visit(ast::Mult& node) override {
+        VisitBinary(NodeKind::Mult, node);
+    }
+
+    void Visit(ast::Div& node) override {
+        VisitBinary(NodeKind::Div, node);
+    }
+
+    void Visit(ast::Or& node) override {
+        VisitBinary(NodeKind::Or, node);
+    }
+
+    void Visit(ast::And& node) override {
+        VisitBinary(NodeKind::And, node);
+    }
+
+    void Visit(ast::Not& node) override {
+        result_ = Emit(NodeKind::Not, Flatten(*node.Argument()));
+    }
+
+    void Visit(ast::Compound& node) override {
+        result_ = Emit(NodeKind::Compound, AddList({}, node.Statements()));
+    }
+
+    void Visit(ast::MethodBody& node) override {
+        result_ = Emit(NodeKind::MethodBody, Flatten(*node.Body()));
+    }
+
+    void Visit(ast::Return& node) override {
+        result_ = Emit(NodeKind::Return, Flatten(*node.Value()));
+    }
+
+    void Visit(ast::ClassDefinition& node) override {
+        FlattenMethods(node.GetClass());
+        const uint32_t cls = AddConstant(node.GetClassHolder());
+        result_ = Emit(NodeKind::ClassDefinition, cls,
+                       AddExtra({AddName(node.GetClass().GetName()), SlotIndex(node.GetSlot())}));
+    }
+
+    void Visit(ast::IfElse& node) override {
+        const NodeId condition = Flatten(*node.Condition());
+        const NodeId if_body = Flatten(*node.IfBody());
+        const NodeId else_body = node.ElseBody() ? Flatten(*node.ElseBody()) : NO_INDEX;
+        result_ = Emit(NodeKind::IfElse, condition, AddExtra({if_body, else_body}));
+    }
+
+    void Visit(ast::Comparison& node) override {
+        const auto op = node.GetOp();
+        if (!op) {
+            throw runtime_error("Comparison with a custom comparator can't be flattened"s);
+        }
+        const NodeId lhs = Flatten(*node.Lhs());
+        const NodeId rhs = Flatten(*node.Rhs());
+        result_ = Emit(NodeKind::Compare, lhs, AddExtra({rhs, static_cast<uint32_t>(*op)}));
+    }
+
+private:
+    NodeId Emit(NodeKind kind, uint32_t a = 0, uint32_t b = 0) {
+        tree_.kinds.push_back(kind);
+        tree_.a.push_back(a);
+        tree_.b.push_back(b);
+        return static_cast<NodeId>(tree_.kinds.size() - 1);
+    }
+
+    // Дописывает операнды в extra и возвращает номер первого из них
+    uint32_t AddExtra(initializer_list<uint32_t> operands) {
+        const auto index = static_cast<uint32_t>(tree_.extra.size());
+        tree_.extra.insert(tree_.extra.end(), operands);
+        return index;
+    }
+
+    // Записывает узлы nodes и дописывает в extra операнды prefix, за которыми следует
+    // список узлов. Возвращает номер первого операнда
+    uint32_t AddList(initializer_list<uint32_t> prefix, vector<unique_ptr<ast::Statement>>& nodes) {
+        vector<NodeId> ids;
+        ids.reserve(nodes.size());
+        for (auto& node : nodes) {
+            ids.push_back(Flatten(*node));
+        }
+        const uint32_t index = AddExtra(prefix);
+        tree_.extra.push_back(static_cast<uint32_t>(ids.size()));
+        tree_.extra.insert(tree_.extra.end(), ids.begin(), ids.end());
+        return index;
+    }
+
+    uint32_t AddName(runtime::Symbol name) {
+        auto [it, inserted] = name_indices_.emplace(name, tree_.names.size());
+        if (inserted) {
+            tree_.names.push_back(name);
+        }
+        return it->second;
+    }
+
+    uint32_t AddConstant(const ObjectHolder& value) {
+        tree_.constants.push_back(value);
+        return static_cast<uint32_t>(tree_.constants.size() - 1);
+    }
+
+    static uint32_t SlotIndex(optional<size_t> slot) {
+        return slot ? static_cast<uint32_t>(*slot) : NO_INDEX;
+    }
+
+    void VisitBinary(NodeKind kind, ast::BinaryOperation& node) {
+        const NodeId lhs = Flatten(*node.Lhs());
+        const NodeId rhs = Flatten(*node.Rhs());
+        result_ = Emit(kind, lhs, rhs);
+    }
+
+    // Заменяет тела методов класса телами, выполняемыми над плоским деревом
+    void FlattenMethods(runtime::Class& cls) {
+        for (runtime::Method& method : cls.Methods()) {
+            auto body = dynamic_cast<ast::Statement*>(method.body.get());
+            if (body == nullptr) {
+                continue;
+            }
+            const NodeId root = Flatten(*body);
+            method.body = make_unique<FlatMethodBody>(tree_, root);
+        }
+    }
+
+    Tree& tree_;
+    unordered_map<runtime::Symbol, uint32_t> name_indices_;
+    NodeId result_ = NO_INDEX;
+};
+
+// Выполняет узлы плоского дерева над closure. Поведение узлов совпадает с поведением
+// соответствующих узлов дерева разбора
+class Evaluator {
+public:
+    Evaluator(Tree& tree, Closure& closure, Context& context)
+        : tree_{tree}, closure_{closure}, context_{context} {
+    }
+
+    ObjectHolder Evaluate(NodeId node) {
+        const uint32_t a = tree_.a[node];
+        const uint32_t b = tree_.b[node];
+
+        switch (tree_.kinds[node]) {
+            case NodeKind::Constant:
+                return tree_.constants[a];
+            case NodeKind::None:
+                return {};
+            case NodeKind::Variable:
+                return EvaluateVariable(a, b);
+            case NodeKind::Assignment: {
+                ObjectHolder value = Evaluate(a);
+                if (const uint32_t slot = tree_.extra[b + 1]; slot != NO_INDEX) {
+                    return context_.GetCallStack().Slot(slot).emplace(move(value));
+                }
+                return closure_[tree_.names[tree_.extra[b]]] = move(value);
+            }
+            case NodeKind::FieldAssignment: {
+                ObjectHolder holder = Evaluate(a);
+                auto obj = holder.TryAs<runtime::ClassInstance>();
+                if (obj == nullptr) {
+                    throw runtime_error("Object is not class"s);
+                }
+                ObjectHolder value = Evaluate(tree_.extra[b + 1]);
+                obj->SetField(tree_.names[tree_.extra[b]], value);
+                return value;
+            }
+            case NodeKind::Print:
+                return EvaluatePrint(a);
+            case NodeKind::MethodCall:
+                return EvaluateMethodCall(a, b);
+            case NodeKind::NewInstance:
+                return EvaluateNewInstance(a, b);
+            case NodeKind::Stringify:
+                return EvaluateStringify(a);
+            case NodeKind::Add:
+                return EvaluateAdd(a, b);
+            case NodeKind::Sub:
+                return ObjectHolder::Own(runtime::Number(
+                    Numbers(a, b, "Can sub only nums"sv, [](int x, int y) { return x - y; })));
+            case NodeKind::Mult:
+                return ObjectHolder::Own(runtime::Number(
+                    Numbers(a, b, "Can multiply only nums"sv, [](int x, int y) { return x * y; })));
+            case NodeKind::Div:
+                return EvaluateDiv(a, b);
+            case NodeKind::Or:
+                return ObjectHolder::Own(
+                    runtime::Bool(runtime::IsTrue(Evaluate(a)) || runtime::IsTrue(Evaluate(b))));
+            case NodeKind::And:
+                return ObjectHolder::Own(
+                    runtime::Bool(runtime::IsTrue(Evaluate(a)) && runtime::IsTrue(Evaluate(b))));
+            case NodeKind::Not:
+                return ObjectHolder::Own(runtime::Bool(!runtime::IsTrue(Evaluate(a))));
+            case NodeKind::Compare:
+                return EvaluateCompare(a, b);
+            case NodeKind::Compound: {
+                const uint32_t count = tree_.extra[a];
+                for (uint32_t i = 1; i <= count; ++i) {
+                    ObjectHolder result = Evaluate(tree_.extra[a + i]);
+                    if (context_.IsReturning()) {
+                        return result;
+                    }
+                }
+                return ObjectHolder::None();
+            }
+            case NodeKind::MethodBody: {
+                ObjectHolder result = Evaluate(a);
+                if (context_.IsReturning()) {
+                    context_.SetReturning(false);
+                    return result;
+                }
+                return ObjectHolder::None();
+            }
+            case NodeKind::Return: {
+                ObjectHolder result = Evaluate(a);
+                context_.SetReturning(true);
+                return result;
+            }
+            case NodeKind::ClassDefinition:
+                if (const uint32_t slot = tree_.extra[b + 1]; slot != NO_INDEX) {
+                    context_.GetCallStack().Slot(slot) = tree_.constants[a];
+                } else {
+                    closure_[tree_.names[tree_.extra[b]]] = tree_.constants[a];
+                }
+                return ObjectHolder::None();
+            case NodeKind::IfElse:
+                if (runtime::IsTrue(Evaluate(a))) {
+                    return Evaluate(tree_.extra[b]);
+                } else if (const NodeId else_body = tree_.extra[b + 1]; else_body != NO_INDEX) {
+                    return Evaluate(else_body);
+                }
+                return ObjectHolder::None();
+        }
+        return ObjectHolder::None();
+    }
+
+private:
+    ObjectHolder& Variable(runtime::Symbol name, uint32_t slot) {
+        if (slot != NO_INDEX) {
+            auto& value = context_.GetCallStack().Slot(slot);
+            if (!value) {
+                throw runtime_error("Var "s + name.GetName() + " not found"s);
+            }
+            return *value;
+        }
+
+        auto it = closure_.find(name);
+        if (it == closure_.end()) {
+            throw runtime_error("Var "s + name.GetName() + " not found"s);
+        }
+        return it->second;
+    }
+
+    ObjectHolder EvaluateVariable(uint32_t name_index, uint32_t extra) {
+        runtime::Symbol name = tree_.names[name_index];
+        ObjectHolder result = Variable(name, tree_.extra[extra]);
+
+        const uint32_t count = tree_.extra[extra + 1];
+        for (uint32_t i = 0; i < count; ++i) {
+            const runtime::Symbol field = tree_.names[tree_.extra[extra + 2 + i]];
+            auto obj = result.TryAs<runtime::ClassInstance>();
+            if (!obj) {
+                throw runtime_error("Var "s + name.GetName() + " is not class"s);
+            }
+            auto field_value = obj->GetField(field);
+            if (!field_value) {
+                throw runtime_error("Var "s + field.GetName() + " not found"s);
+            }
+            // Сначала копируется значение поля: result может быть последней ссылкой на объект
+            ObjectHolder value = *field_value;
+            result = move(value);
+            name = field;
+        }
+        return result;
+    }
+
+    ObjectHolder EvaluatePrint(uint32_t list) {
+        auto& out = context_.GetOutputStream();
+        const uint32_t count = tree_.extra[list];
+        for (uint32_t i = 1; i <= count; ++i) {
+            if (i != 1) {
+                out << ' ';
+            }
+            ObjectHolder obj = Evaluate(tree_.extra[list + i]);
+            if (obj) {
+                obj.Print(out, context_);
+            } else {
+                out << EMPTY_OBJECT;
+            }
+        }
+        out << endl;
+        return {};
+    }
+
+    ObjectHolder EvaluateStringify(NodeId argument) {
+        ObjectHolder obj = Evaluate(argument);
+        if (!obj) {
+            return ObjectHolder::Own(runtime::String(EMPTY_OBJECT));
+        }
+        ostringstream out;
+        obj.Print(out, context_);
+        return ObjectHolder::Own(runtime::String(out.str()));
+    }
+
+    // Вычисляет аргументы из списка extra[list..]
+    vector<ObjectHolder> EvaluateArguments(uint32_t list) {
+        const uint32_t count = tree_.extra[list];
+        vector<ObjectHolder> args;
+        args.reserve(count);
+        for (uint32_t i = 1; i <= count; ++i) {
+            args.push_back(Evaluate(tree_.extra[list + i]));
+        }
+        return args;
+    }
+
+    ObjectHolder EvaluateMethodCall(NodeId object, uint32_t extra) {
+        // holder удерживает объект на время вызова метода
+        ObjectHolder holder = Evaluate(object);
+        auto instance = holder.TryAs<runtime::ClassInstance>();
+        if (instance == nullptr) {
+            throw runtime_error("Obj is not class instance"s);
+        }
+
+        const runtime::Symbol name = tree_.names[tree_.extra[extra]];
+        vector<ObjectHolder> args = EvaluateArguments(extra + 3);
+        ast::MethodCache& cache = tree_.call_sites[tree_.extra[extra + 1]];
+        const runtime::Method* method = cache.FindMethod(instance->GetClass(), name, args.size());
+        if (method == nullptr) {
+            // Сообщение об ошибке формирует ClassInstance::Call
+            return instance->Call(name, args, context_);
+        }
+        if (tree_.extra[extra + 2] != 0 && context_.CanDeferTailCall()) {
+            // Вызов выполнит ClassInstance::Call метода, содержащего данную инструкцию return
+            context_.DeferTailCall({move(holder), method, move(args)});
+            return ObjectHolder::None();
+        }
+        return instance->Call(*method, args, context_);
+    }
+
+    ObjectHolder EvaluateNewInstance(uint32_t cls, uint32_t list) {
+        ObjectHolder holder = ObjectHolder::Own(runtime::ClassInstance(*tree_.classes[cls]));
+        auto& instance = holder.As<runtime::ClassInstance>();
+        if (instance.HasMethod(INIT_METHOD, tree_.extra[list])) {
+            instance.Call(INIT_METHOD, EvaluateArguments(list), context_);
+        }
+        return holder;
+    }
+
+    ObjectHolder EvaluateAdd(NodeId lhs, NodeId rhs) {
+        ObjectHolder lhs_h = Evaluate(lhs);
+        ObjectHolder rhs_h = Evaluate(rhs);
+        switch (runtime::CombineTypes(lhs_h.GetType(), rhs_h.GetType())) {
+            case runtime::CombineTypes(ObjectType::Number, ObjectType::Number):
+                return ObjectHolder::Own(runtime::Number(lhs_h.AsNumber() + rhs_h.AsNumber()));
+            case runtime::CombineTypes(ObjectType::String, ObjectType::String):
+                return runtime::ConcatenateStrings(lhs_h, rhs_h);
+            default:
+                break;
+        }
+        if (lhs_h.GetType() == ObjectType::ClassInstance) {
+            return lhs_h.As<runtime::ClassInstance>().Call(ADD_METHOD, {rhs_h}, context_);
+        }
+        throw runtime_error("Can only add nums, strings, class instances with "s
+                            + ADD_METHOD.GetName());
+    }
+
+    // Вычисляет операнды и применяет к ним операцию op, если оба операнда - числа.
+    // Иначе выбрасывает runtime_error с сообщением error
+    template <typename Op>
+    int Numbers(NodeId lhs, NodeId rhs, string_view error, Op op) {
+        ObjectHolder lhs_h = Evaluate(lhs);
+        ObjectHolder rhs_h = Evaluate(rhs);
+        if (lhs_h.GetType() != ObjectType::Number || rhs_h.GetType() != ObjectType::Number) {
+            throw runtime_error(string(error));
+        }
+        return op(lhs_h.AsNumber(), rhs_h.AsNumber());
+    }
+
+    ObjectHolder EvaluateDiv(NodeId lhs, NodeId rhs) {
+        ObjectHolder lhs_h = Evaluate(lhs);
+        ObjectHolder rhs_h = Evaluate(rhs);
+        if (rhs_h.GetType() == ObjectType::Number && rhs_h.AsNumber() == 0) {
+            throw runtime_error("Division by zero"s);
+        }
+        if (lhs_h.GetType() != ObjectType::Number || rhs_h.GetType() != ObjectType::Number) {
+            throw runtime_error("Can divide only nums"s);
+        }
+        return ObjectHolder::Own(runtime::Number(lhs_h.AsNumber() / rhs_h.AsNumber()));
+    }
+
+    ObjectHolder EvaluateCompare(NodeId lhs, uint32_t extra) {
+        ObjectHolder lhs_h = Evaluate(lhs);
+        ObjectHolder rhs_h = Evaluate(tree_.extra[extra]);
+        const auto op = static_cast<runtime::CompareOp>(tree_.extra[extra + 1]);
+        if (lhs_h.GetType() == ObjectType::Number && rhs_h.GetType() == ObjectType::Number) {
+            return ObjectHolder::Own(
+                runtime::Bool(runtime::ApplyCompareOp(op, lhs_h.AsNumber(), rhs_h.AsNumber())));
+        }
+        return ObjectHolder::Own(runtime::Bool(runtime::Compare(op, lhs_h, rhs_h, context_)));
+    }
+
+    Tree& tree_;
+    Closure& closure_;
+    Context& context_;
+};
+
+ObjectHolder FlatMethodBody::Execute(Closure& closure, Context& context) {
+    return Evaluator(tree_, closure, context).Evaluate(root_);
+}
+
+template <typename T>
+size_t CapacityBytes(const vector<T>& v) {
+    return v.capacity() * sizeof(T);
+}
+
+}  // namespace
+
+FlattenStats& GetFlattenStats() {
+    static FlattenStats stats;
+    return stats;
+}
+
+size_t Tree::GetMemoryUsage() const {
+    return CapacityBytes(kinds) + CapacityBytes(a) + CapacityBytes(b) + CapacityBytes(extra)
+           + CapacityBytes(constants) + CapacityBytes(names) + CapacityBytes(classes)
+           + CapacityBytes(call_sites);
+}
+
+ObjectHolder Program::Execute(Closure& closure, Context& context) {
+    return Evaluator(*tree_, closure, context).Evaluate(root_);
+}
+
+unique_ptr<Program> Flatten(unique_ptr<ast::Statement> program) {
+    auto result = unique_ptr<Program>(new Program());
+    Tree& tree = *result->tree_;
+    result->root_ = Flattener(tree).Flatten(*program);
+    // Классы программы удерживаются константами плоского дерева, тела их методов уже заменены
+    program.reset();
+
+    tree.kinds.shrink_to_fit();
+    tree.a.shrink_to_fit();
+    tree.b.shrink_to_fit();
+    tree.extra.shrink_to_fit();
+    tree.constants.shrink_to_fit();
+    tree.names.shrink_to_fit();
+    tree.classes.shrink_to_fit();
+    tree.call_sites.shrink_to_fit();
+
+    auto& stats = GetFlattenStats();
+    stats.nodes += tree.GetNodeCount();
+    stats.bytes += tree.GetMemoryUsage();
+    return result;
+}
+
+}  // namespace flat
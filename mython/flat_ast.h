@@ -0,0 +1,106 @@
+#pragma once
+
+#include "runtime.h"
+#include "statement.h"
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+namespace flat {
+
+// Номер узла плоского дерева
+using NodeId = std::uint32_t;
+
+// Отсутствующий узел, слот или элемент таблицы
+constexpr std::uint32_t NO_INDEX = UINT32_MAX;
+
+// Вид узла плоского дерева. В комментариях a и b - операнды узла, extra[x] - элемент общего
+// массива дополнительных операндов, списки в extra начинаются с числа элементов.
+// Имена, константы и классы задаются номерами в таблицах names, constants и classes
+enum class NodeKind : std::uint8_t {
+    Constant,         // значение constants[a]
+    None,             // значение None
+    Variable,         // переменная names[a], extra[b] = слот либо NO_INDEX, extra[b + 1..] -
+                      // список имён полей цепочки a.x.y
+    Assignment,       // names[extra[b]] = a; extra[b + 1] - слот либо NO_INDEX
+    FieldAssignment,  // a.names[extra[b]] = extra[b + 1]; a - узел Variable
+    Print,            // print со списком аргументов extra[a..]
+    MethodCall,       // a.names[extra[b]](список extra[b + 3..]), extra[b + 1] - номер места
+                      // вызова, extra[b + 2] - признак хвостового вызова
+    NewInstance,      // новый экземпляр classes[a] с аргументами конструктора extra[b..]
+    Stringify,        // str(a)
+    Add,              // a + b
+    Sub,              // a - b
+    Mult,             // a * b
+    Div,              // a / b
+    Or,               // a or b
+    And,              // a and b
+    Not,              // not a
+    Compare,          // a op extra[b], op = CompareOp(extra[b + 1])
+    Compound,         // последовательность инструкций extra[a..]
+    MethodBody,       // тело метода a
+    Return,           // return a
+    ClassDefinition,  // объявление класса constants[a] с именем names[extra[b]],
+                      // extra[b + 1] - слот либо NO_INDEX
+    IfElse,           // if a: extra[b] else: extra[b + 1] (NO_INDEX, если ветки else нет)
+};
+
+// Дерево разбора программы в плоском представлении (структура массивов).
+// Узел задаётся номером: его вид и операнды хранятся в элементах с этим номером
+// параллельных массивов kinds, a и b, поэтому узел занимает 9 байт вместо отдельного
+// полиморфного объекта, а дочерние узлы и списки располагаются в памяти рядом
+struct Tree {
+    std::vector<NodeKind> kinds;
+    std::vector<std::uint32_t> a;
+    std::vector<std::uint32_t> b;
+    std::vector<std::uint32_t> extra;
+
+    std::vector<runtime::ObjectHolder> constants;
+    std::vector<runtime::Symbol> names;
+    std::vector<const runtime::Class*> classes;
+    // Инлайн-кэши заполняются во время выполнения
+    std::vector<ast::MethodCache> call_sites;
+
+    [[nodiscard]] size_t GetNodeCount() const {
+        return kinds.size();
+    }
+
+    // Возвращает объём памяти, занимаемой массивами дерева, в байтах
+    [[nodiscard]] size_t GetMemoryUsage() const;
+};
+
+// Статистика преобразования программ в плоское представление
+struct FlattenStats {
+    // Узлы плоских деревьев и память, занимаемая их массивами
+    std::uint64_t nodes = 0;
+    std::uint64_t bytes = 0;
+};
+
+// Возвращает накопленную статистику преобразования программ в плоское представление
+FlattenStats& GetFlattenStats();
+
+// Программа в плоском представлении, выполняемая обходом массивов дерева
+class Program : public runtime::Executable {
+public:
+    runtime::ObjectHolder Execute(runtime::Closure& closure, runtime::Context& context) override;
+
+    [[nodiscard]] const Tree& GetTree() const {
+        return *tree_;
+    }
+
+private:
+    friend std::unique_ptr<Program> Flatten(std::unique_ptr<ast::Statement> program);
+
+    // Константы дерева владеют классами программы, тела методов которых ссылаются на дерево
+    std::unique_ptr<Tree> tree_ = std::make_unique<Tree>();
+    NodeId root_ = NO_INDEX;
+};
+
+// Преобразует в плоское представление программу, полученную от ParseProgram, и тела методов
+// объявленных в ней классов. Тела методов классов заменяются на тела, выполняемые над плоским
+// деревом, исходное дерево разбора удаляется.
+// Сравнения с произвольной функцией Comparator не поддерживаются: выбрасывается runtime_error
+std::unique_ptr<Program> Flatten(std::unique_ptr<ast::Statement> program);
+
+}  // namespace flat
@@ -0,0 +1,174 @@
+#include "arena.h"
+#include "flat_ast.h"
+#include "program_test_utils.h"
+#include "test_runner.h"
+
+using namespace std;
+
+namespace flat {
+
+namespace {
+
+unique_ptr<Program> FlattenFromString(const string& program) {
+    return Flatten(ParseFromString(program));
+}
+
+// Выполняет программу обходом дерева разбора и обходом плоского дерева,
+// проверяет, что вывод совпадает, и возвращает его
+string RunOnBothEncodings(const string& program) {
+    return RunAndCompareWithTree(program, FlattenFromString);
+}
+
+void TestExtraOperands() {
+    // Списки аргументов, цепочки полей, операции сравнения и ветки if хранятся в общем массиве
+    // extra. Цепочки полей разной длины и if без else проверяют границы этих записей
+    const string program = R"(
+class Node:
+  def __init__(value):
+    self.value = value
+    self.next = None
+
+class List:
+  def __init__():
+    self.head = Node(0)
+
+  def link(a, b, c, d):
+    self.head.next = Node(a)
+    self.head.next.next = Node(b)
+    self.head.next.next.next = Node(c)
+    self.head.next.next.next.next = Node(d)
+    return self.head.next.next.next.next.value
+
+  def pick(x):
+    if x > 2:
+      x = x * 10
+    return x
+
+l = List()
+print l.link(1, 2, 3, 4), l.head.next.next.value, l.head.next.next.next.next.value
+print l.pick(1), l.pick(3), 1 < 2, 2 <= 1, 3 >= 3, 1 != 1, "b" > "a", 1 == 1
+print
+print str(l.head.next.value) + str(l.head.next.next.next.value), l.head.next.next.next.next.next
+)"s;
+
+    ASSERT_EQUAL(RunOnBothEncodings(program),
+                 "4 2 4\n1 30 True False True False True True\n\n13 None\n"s);
+}
+
+void TestClasses() {
+    const string program = R"(
+class Shape:
+  def __str__():
+    return "Shape"
+
+  def area():
+    return 0
+
+class Rect(Shape):
+  def __init__(w, h):
+    self.w = w
+    self.h = h
+
+  def area():
+    return self.w * self.h
+
+  def __str__():
+    return "Rect(" + str(self.w) + 'x' + str(self.h) + ')'
+
+  def __eq__(other):
+    return self.area() == other.area()
+
+  def __add__(other):
+    return self.area() + other.area()
+
+class Counter:
+  def __init__():
+    self.value = 0
+
+  def add(n):
+    self.value = self.value + n
+    return self.value
+
+  def sum(n, acc):
+    if n == 0:
+      return acc
+    return self.sum(n - 1, acc + n)
+
+shapes = Shape()
+r = Rect(2, 3)
+q = Rect(3, 2)
+c = Counter()
+print shapes, r, shapes.area(), r.area(), r + q, r == q
+print c.add(1), c.add(2), c.value, c.sum(10000, 0)
+r.w = Counter()
+r.w.value = 7
+print r.w.value, r.w.add(3)
+)"s;
+
+    ASSERT_EQUAL(RunOnBothEncodings(program),
+                 "Shape Rect(2x3) 0 6 12 True\n1 3 3 50005000\n7 10\n"s);
+}
+
+void TestErrors() {
+    const vector<string> programs = {
+        "print x\n"s,
+        "x = 1\nprint x.y\n"s,
+        "x = 1\nx.y = 2\n"s,
+        "print 1 + None\n"s,
+        "print 1 / 0\n"s,
+        "print \"a\" - 1\n"s,
+        "x = 1\nx.f()\n"s,
+        "class A:\n  def f():\n    return 1\na = A()\na.g()\n"s,
+    };
+    for (const string& program : programs) {
+        runtime::DummyContext context;
+        runtime::Closure closure;
+        auto flattened = FlattenFromString(program);
+        ASSERT_THROWS(flattened->Execute(closure, context), runtime_error);
+    }
+}
+
+void TestMemoryUsage() {
+    // Программа из множества однотипных классов и методов
+    string program;
+    for (int i = 0; i < 200; ++i) {
+        const string index = to_string(i);
+        program += "class C"s + index + ":\n"s
+                   + "  def __init__(a, b):\n    self.a = a\n    self.b = b\n"s
+                   + "  def f(x, y):\n    z = x * 3 + y - self.a / 2\n"s
+                   + "    if z > 10 and not x == y:\n      return self.b + z * (x - 1)\n"s
+                   + "    else:\n      return str(z) + \"s\" + str(self.a)\n"s;
+        program += "c"s + index + " = C"s + index + "(1, 2)\nprint c"s + index + ".f(4, 5)\n"s;
+    }
+
+    const ast::ArenaStats before = ast::GetArenaStats();
+    auto tree = ParseFromString(program);
+    const uint64_t tree_bytes = ast::GetArenaStats().allocated_bytes - before.allocated_bytes;
+
+    runtime::DummyContext tree_context;
+    runtime::Closure tree_closure;
+    tree->Execute(tree_closure, tree_context);
+    tree_closure.clear();
+
+    auto flattened = Flatten(move(tree));
+    const size_t flat_bytes = flattened->GetTree().GetMemoryUsage();
+    // Плоское дерево занимает не больше половины памяти узлов дерева разбора в арене,
+    // даже без учёта векторов дочерних узлов, размещаемых в куче
+    ASSERT(flat_bytes * 2 <= tree_bytes);
+
+    runtime::DummyContext flat_context;
+    runtime::Closure flat_closure;
+    flattened->Execute(flat_closure, flat_context);
+    ASSERT_EQUAL(flat_context.output.str(), tree_context.output.str());
+}
+
+}  // namespace
+
+void RunUnitTests(TestRunner& tr) {
+    RUN_TEST(tr, flat::TestExtraOperands);
+    RUN_TEST(tr, flat::TestClasses);
+    RUN_TEST(tr, flat::TestErrors);
+    RUN_TEST(tr, flat::TestMemoryUsage);
+}
+
+}  // namespace flat
@@ -0,0 +1,232 @@
+#include "gc.h"
+
+#include <chrono>
+
+using namespace std;
+
+namespace runtime {
+
+namespace {
+
+// Цвет объекта в Object::gc_state_. Чёрный объект достижим, серый обходится пробным удалением,
+// белый считается мусором
+constexpr uint8_t COLOR_MASK = 0b11;
+constexpr uint8_t BLACK = 0;
+constexpr uint8_t GRAY = 1;
+constexpr uint8_t WHITE = 2;
+// Объект находится в списке кандидатов
+constexpr uint8_t BUFFERED = 1 << 2;
+// Счётчик ссылок объекта-кандидата достиг нуля, объект ждёт удаления при сборке
+constexpr uint8_t DEAD = 1 << 3;
+// Объект удаляется текущей сборкой
+constexpr uint8_t GARBAGE = 1 << 4;
+
+// Сборщик текущего потока. Указатель тривиально разрушаем, поэтому остаётся доступным
+// при уничтожении любых локальных для потока и статических переменных
+thread_local CycleCollector* thread_collector = nullptr;
+
+}  // namespace
+
+// Удаляет сборщик при завершении потока, предварительно удалив накопленный им мусор.
+// Объекты, освобождаемые позже, получают новый сборщик, который уже не удаляется
+struct CycleCollector::ThreadExit {
+    ~ThreadExit() {
+        CycleCollector* collector = thread_collector;
+        while (!collector->candidates_.empty()) {
+            collector->Collect();
+        }
+        thread_collector = nullptr;
+        delete collector;
+    }
+};
+
+CycleCollector& CycleCollector::Instance() {
+    if (thread_collector == nullptr) {
+        thread_collector = new CycleCollector;
+        thread_local ThreadExit thread_exit;
+    }
+    return *thread_collector;
+}
+
+void CycleCollector::AddCandidate(Object* object) {
+    object->gc_state_.flags |= BUFFERED;
+    candidates_.push_back(object);
+}
+
+void CycleCollector::Destroy(Object* object) noexcept {
+    auto& flags = object->gc_state_.flags;
+    if ((flags & BUFFERED) == 0) {
+        // Объект удаляется сборкой, которая уже исключила его из кандидатов
+        delete object;
+        return;
+    }
+    // Список кандидатов ссылается на объект, поэтому удаляются только его поля
+    flags |= DEAD;
+    static_cast<ClassInstance*>(object)->ClearFields();
+}
+
+template <typename F>
+void CycleCollector::ForEachChild(Object* object, F&& f) {
+    if (object->GetType() != ObjectType::ClassInstance) {
+        return;
+    }
+    static_cast<ClassInstance*>(object)->ForEachField([&f](const ObjectHolder& value) {
+        // Ссылки без владения не входят в счётчик ссылок и не могут удерживать цикл
+        if (value.kind_ == ObjectHolder::Kind::Heap
+            && value.value_.object->GetType() == ObjectType::ClassInstance) {
+            f(value.value_.object);
+        }
+    });
+}
+
+void CycleCollector::MarkGray(Object* root) {
+    if ((root->gc_state_.flags & COLOR_MASK) == GRAY) {
+        return;
+    }
+    root->gc_state_.flags = (root->gc_state_.flags & ~COLOR_MASK) | GRAY;
+    stack_.push_back(root);
+    while (!stack_.empty()) {
+        Object* object = stack_.back();
+        stack_.pop_back();
+        ForEachChild(object, [this](Object* child) {
+            --child->ref_count_.value;
+            auto& flags = child->gc_state_.flags;
+            if ((flags & COLOR_MASK) != GRAY) {
+                flags = (flags & ~COLOR_MASK) | GRAY;
+                stack_.push_back(child);
+            }
+        });
+    }
+}
+
+void CycleCollector::Scan(Object* root) {
+    if ((root->gc_state_.flags & COLOR_MASK) != GRAY) {
+        return;
+    }
+    stack_.push_back(root);
+    while (!stack_.empty()) {
+        Object* object = stack_.back();
+        stack_.pop_back();
+        auto& flags = object->gc_state_.flags;
+        if ((flags & COLOR_MASK) != GRAY) {
+            continue;
+        }
+        if (object->ref_count_.value > 0) {
+            ScanBlack(object);
+            continue;
+        }
+        flags = (flags & ~COLOR_MASK) | WHITE;
+        ForEachChild(object, [this](Object* child) {
+            if ((child->gc_state_.flags & COLOR_MASK) == GRAY) {
+                stack_.push_back(child);
+            }
+        });
+    }
+}
+
+void CycleCollector::ScanBlack(Object* root) {
+    // Scan может вызвать ScanBlack посреди своего обхода, поэтому здесь используется свой стек
+    vector<Object*> stack{root};
+    root->gc_state_.flags &= ~COLOR_MASK;
+    while (!stack.empty()) {
+        Object* object = stack.back();
+        stack.pop_back();
+        ForEachChild(object, [&stack](Object* child) {
+            ++child->ref_count_.value;
+            auto& flags = child->gc_state_.flags;
+            if ((flags & COLOR_MASK) != BLACK) {
+                flags &= ~COLOR_MASK;
+                stack.push_back(child);
+            }
+        });
+    }
+}
+
+void CycleCollector::CollectWhite(Object* root, vector<Object*>& garbage) {
+    stack_.push_back(root);
+    while (!stack_.empty()) {
+        Object* object = stack_.back();
+        stack_.pop_back();
+        auto& flags = object->gc_state_.flags;
+        if ((flags & COLOR_MASK) != WHITE || (flags & GARBAGE) != 0) {
+            continue;
+        }
+        flags = (flags & ~COLOR_MASK) | GARBAGE;
+        garbage.push_back(object);
+        ForEachChild(object, [this](Object* child) {
+            stack_.push_back(child);
+        });
+    }
+}
+
+uint64_t CycleCollector::Collect() {
+    if (collecting_) {
+        // Сборку запустил деструктор класса, удаляемого текущей сборкой
+        return 0;
+    }
+    collecting_ = true;
+    const auto start = chrono::steady_clock::now();
+
+    // Удалённые кандидаты больше не нужны, остальные становятся корнями пробного удаления
+    vector<Object*> roots = move(candidates_);
+    candidates_.clear();
+    size_t root_count = 0;
+    for (Object* object : roots) {
+        object->gc_state_.flags &= ~BUFFERED;
+        if ((object->gc_state_.flags & DEAD) != 0) {
+            delete object;
+        } else {
+            roots[root_count++] = object;
+        }
+    }
+    roots.resize(root_count);
+
+    for (Object* root : roots) {
+        MarkGray(root);
+    }
+    for (Object* root : roots) {
+        Scan(root);
+    }
+    vector<Object*> garbage;
+    for (Object* root : roots) {
+        CollectWhite(root, garbage);
+    }
+
+    // Корни, оставшиеся достижимыми, перестают быть кандидатами
+    for (Object* root : roots) {
+        if ((root->gc_state_.flags & GARBAGE) == 0) {
+            root->gc_state_.flags = 0;
+        }
+    }
+
+    // Пробное удаление вычло из счётчиков мусора ссылки между его объектами. Счётчики
+    // восстанавливаются, и каждый объект удерживается сборкой, пока очищаются поля остальных
+    for (Object* object : garbage) {
+        ForEachChild(object, [](Object* child) {
+            ++child->ref_count_.value;
+        });
+    }
+    for (Object* object : garbage) {
+        ++object->ref_count_.value;
+    }
+    for (Object* object : garbage) {
+        static_cast<ClassInstance*>(object)->ClearFields();
+    }
+    for (Object* object : garbage) {
+        if (--object->ref_count_.value == 0) {
+            ObjectHolder::Destroy(object);
+        }
+    }
+
+    const auto pause = static_cast<uint64_t>(
+        chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start).count());
+    ++stats_.collections;
+    stats_.freed_objects += garbage.size();
+    stats_.total_pause_us += pause;
+    stats_.max_pause_us = max(stats_.max_pause_us, pause);
+    allocations_ = 0;
+    collecting_ = false;
+    return garbage.size();
+}
+
+}  // namespace runtime
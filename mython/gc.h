@@ -0,0 +1,103 @@
+#pragma once
+
+#include "runtime.h"
+
+#include <cstdint>
+#include <vector>
+
+namespace runtime {
+
+// Статистика сборщика циклов
+struct CycleCollectorStats {
+    // Выполненные сборки и удалённые ими объекты
+    std::uint64_t collections = 0;
+    std::uint64_t freed_objects = 0;
+    // Суммарная и наибольшая длительность пауз на сборку, микросекунды
+    std::uint64_t total_pause_us = 0;
+    std::uint64_t max_pause_us = 0;
+};
+
+/*
+ * Сборщик циклических ссылок между экземплярами классов (пробное удаление, Bacon-Rajan).
+ *
+ * Экземпляр, счётчик ссылок которого уменьшился, но не достиг нуля, становится кандидатом:
+ * он мог остаться частью недостижимого цикла. Сборка вычитает из счётчиков объектов,
+ * достижимых из кандидатов через поля, ссылки изнутри этого подграфа. Объекты, счётчик
+ * которых остался положительным, достижимы извне - из глобальных переменных, кадров методов,
+ * ObjectHolder на стеке C++ или кэшей - и восстанавливаются вместе со всем, что достижимо
+ * из них. Остальные объекты образуют мусор: их поля очищаются, и объекты удаляются.
+ * Поэтому сборщику не нужно перечислять корни, и сборка корректна в любой момент, когда
+ * счётчики ссылок согласованы.
+ *
+ * Сборка запускается при создании объекта в куче, если с предыдущей сборки создано
+ * не меньше порога объектов и есть кандидаты.
+ *
+ * У каждого потока свой сборщик, который обходит только кандидатов, освобождённых в этом
+ * потоке, поэтому объекты не должны разделяться между потоками. В сборке
+ * с MYTHON_ATOMIC_REFCOUNT, где это допустимо, кандидаты сборщику не передаются
+ * (см. COLLECT_CYCLES)
+ */
+class CycleCollector {
+public:
+    static constexpr std::uint64_t DEFAULT_THRESHOLD = 10'000;
+
+    // Возвращает сборщик текущего потока. Сборщик удаляется при завершении потока, но объекты
+    // могут освобождаться и позже, при уничтожении статических и локальных для потока переменных
+    static CycleCollector& Instance();
+
+    // Задаёт число созданных объектов, после которого запускается сборка.
+    // Ноль отключает автоматическую сборку
+    void SetThreshold(std::uint64_t threshold) {
+        threshold_ = threshold;
+    }
+
+    // Выполняет сборку. Возвращает число удалённых объектов.
+    // Вызов во время выполняющейся сборки ничего не делает
+    std::uint64_t Collect();
+
+    [[nodiscard]] const CycleCollectorStats& GetStats() const {
+        return stats_;
+    }
+
+    // Возвращает число кандидатов, ожидающих сборки
+    [[nodiscard]] size_t GetCandidateCount() const {
+        return candidates_.size();
+    }
+
+private:
+    friend class ObjectHolder;
+    struct ThreadExit;
+
+    CycleCollector() = default;
+
+    // Вызывается перед созданием объекта в куче
+    void OnAllocation() {
+        if (++allocations_ >= threshold_ && threshold_ != 0 && !candidates_.empty()) {
+            Collect();
+        }
+    }
+    // Добавляет экземпляр класса в кандидаты
+    void AddCandidate(Object* object);
+    // Удаляет объект, счётчик ссылок которого достиг нуля. Объект-кандидат остаётся
+    // в памяти без полей до ближайшей сборки
+    void Destroy(Object* object) noexcept;
+
+    // Вызывает f для каждого экземпляра класса, которым владеют поля object
+    template <typename F>
+    static void ForEachChild(Object* object, F&& f);
+
+    void MarkGray(Object* root);
+    void Scan(Object* root);
+    void ScanBlack(Object* root);
+    void CollectWhite(Object* root, std::vector<Object*>& garbage);
+
+    std::vector<Object*> candidates_;
+    // Стек обхода, сохраняемый между сборками
+    std::vector<Object*> stack_;
+    std::uint64_t allocations_ = 0;
+    std::uint64_t threshold_ = DEFAULT_THRESHOLD;
+    bool collecting_ = false;
+    CycleCollectorStats stats_;
+};
+
+}  // namespace runtime
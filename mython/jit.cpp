@@ -0,0 +1,598 @@
+#include "jit.h"
+
+#include "vm.h"
+
+#include <cstring>
+#include <limits>
+#include <utility>
+#include <vector>
+
+#if defined(__x86_64__) && defined(__unix__)
+#include <sys/mman.h>
+#include <unistd.h>
+#define MYTHON_JIT_X86_64
+#endif
+
+using namespace std;
+
+namespace vm {
+
+using runtime::ObjectHolder;
+
+JitStats& GetJitStats() {
+    static JitStats stats;
+    return stats;
+}
+
+namespace {
+
+// Регистры x86-64, используемые шаблонами. В rbx хранится адрес регистров кадра
+enum Register : uint8_t {
+    RAX = 0,
+    RCX = 1,
+    RDX = 2,
+    RBX = 3,
+};
+
+// Коды условий инструкций jcc и setcc для сравнения знаковых чисел
+enum Condition : uint8_t {
+    EQUAL = 0x4,
+    NOT_EQUAL = 0x5,
+    LESS = 0xC,
+    GREATER_OR_EQUAL = 0xD,
+    LESS_OR_EQUAL = 0xE,
+    GREATER = 0xF,
+};
+
+Condition Invert(Condition condition) {
+    return static_cast<Condition>(condition ^ 1U);
+}
+
+Condition ToCondition(runtime::CompareOp op) {
+    switch (op) {
+        case runtime::CompareOp::Equal:
+            return EQUAL;
+        case runtime::CompareOp::NotEqual:
+            return NOT_EQUAL;
+        case runtime::CompareOp::Less:
+            return LESS;
+        case runtime::CompareOp::Greater:
+            return GREATER;
+        case runtime::CompareOp::LessOrEqual:
+            return LESS_OR_EQUAL;
+        case runtime::CompareOp::GreaterOrEqual:
+            return GREATER_OR_EQUAL;
+    }
+    return EQUAL;
+}
+
+// Кодирует инструкции x86-64. Операнды в памяти адресуются относительно rbx
+class Assembler {
+public:
+    [[nodiscard]] size_t Size() const {
+        return bytes_.size();
+    }
+
+    vector<uint8_t>& Bytes() {
+        return bytes_;
+    }
+
+    void Byte(uint8_t value) {
+        bytes_.push_back(value);
+    }
+
+    void Dword(uint32_t value) {
+        for (int i = 0; i < 4; ++i) {
+            Byte(static_cast<uint8_t>(value >> (8 * i)));
+        }
+    }
+
+    void Qword(uint64_t value) {
+        Dword(static_cast<uint32_t>(value));
+        Dword(static_cast<uint32_t>(value >> 32U));
+    }
+
+    // cmp byte [rbx + disp], value
+    void CompareByte(uint32_t disp, uint8_t value) {
+        Byte(0x80);
+        Memory(7, disp);
+        Byte(value);
+    }
+
+    // mov reg, dword [rbx + disp]
+    void LoadDword(Register reg, uint32_t disp) {
+        Byte(0x8B);
+        Memory(reg, disp);
+    }
+
+    // mov dword [rbx + disp], reg
+    void StoreDword(uint32_t disp, Register reg) {
+        Byte(0x89);
+        Memory(reg, disp);
+    }
+
+    // movzx reg, byte [rbx + disp]
+    void LoadByte(Register reg, uint32_t disp) {
+        Byte(0x0F);
+        Byte(0xB6);
+        Memory(reg, disp);
+    }
+
+    // mov byte [rbx + disp], reg
+    void StoreByte(uint32_t disp, Register reg) {
+        Byte(0x88);
+        Memory(reg, disp);
+    }
+
+    // mov reg, value
+    void MoveImmediate(Register reg, uint32_t value) {
+        Byte(0xB8 + reg);
+        Dword(value);
+    }
+
+    // mov reg, value (64 бита)
+    void MoveImmediate64(Register reg, uint64_t value) {
+        Byte(0x48);
+        Byte(0xB8 + reg);
+        Qword(value);
+    }
+
+    // Копирует qword [rcx + offset] в qword [rbx + disp], используя rdx.
+    // Смещение offset кодируется знаковым байтом
+    void CopyQword(uint32_t disp, int8_t offset) {
+        Byte(0x48);
+        Byte(0x8B);
+        Byte(0x51);
+        Byte(static_cast<uint8_t>(offset));
+        Byte(0x48);
+        Byte(0x89);
+        Memory(RDX, disp);
+    }
+
+    void Add(Register dst, Register src) {
+        Arithmetic(0x01, dst, src);
+    }
+
+    void Sub(Register dst, Register src) {
+        Arithmetic(0x29, dst, src);
+    }
+
+    void Compare(Register lhs, Register rhs) {
+        Arithmetic(0x39, lhs, rhs);
+    }
+
+    void Test(Register lhs, Register rhs) {
+        Arithmetic(0x85, lhs, rhs);
+    }
+
+    void Multiply(Register dst, Register src) {
+        Byte(0x0F);
+        Byte(0xAF);
+        Byte(0xC0 | (dst << 3U) | src);
+    }
+
+    // cmp reg, value
+    void CompareImmediate(Register reg, uint32_t value) {
+        Byte(0x81);
+        Byte(0xF8 | reg);
+        Dword(value);
+    }
+
+    // cdq; idiv divisor
+    void Divide(Register divisor) {
+        Byte(0x99);
+        Byte(0xF7);
+        Byte(0xF8 | divisor);
+    }
+
+    // setcc reg (младший байт)
+    void Set(Condition condition, Register reg) {
+        Byte(0x0F);
+        Byte(0x90 | condition);
+        Byte(0xC0 | reg);
+    }
+
+    // Условный и безусловный переходы. Возвращают положение смещения перехода для Patch
+    size_t Jump(Condition condition) {
+        Byte(0x0F);
+        Byte(0x80 | condition);
+        return Displacement();
+    }
+
+    size_t Jump() {
+        Byte(0xE9);
+        return Displacement();
+    }
+
+    // Направляет переход, смещение которого находится в at, на target
+    void Patch(size_t at, size_t target) {
+        const auto displacement = static_cast<int32_t>(static_cast<int64_t>(target)
+                                                       - static_cast<int64_t>(at + 4));
+        memcpy(bytes_.data() + at, &displacement, sizeof(displacement));
+    }
+
+    // Возвращает из машинного кода номер инструкции index
+    void Exit(uint32_t index) {
+        MoveImmediate(RAX, index);
+        Byte(0x5B);  // pop rbx
+        Byte(0xC3);  // ret
+    }
+
+private:
+    void Memory(uint8_t reg, uint32_t disp) {
+        Byte(0x80 | (reg << 3U) | RBX);
+        Dword(disp);
+    }
+
+    void Arithmetic(uint8_t opcode, Register dst, Register src) {
+        Byte(opcode);
+        Byte(0xC0 | (src << 3U) | dst);
+    }
+
+    size_t Displacement() {
+        const size_t at = Size();
+        Dword(0);
+        return at;
+    }
+
+    vector<uint8_t> bytes_;
+};
+
+// Значения, которые копируются в пустой регистр перед записью в него числа
+// либо логического значения
+const ObjectHolder& NumberTemplate() {
+    static const ObjectHolder value = ObjectHolder::Own(runtime::Number(0));
+    return value;
+}
+
+const ObjectHolder& BoolTemplate() {
+    static const ObjectHolder value = ObjectHolder::Own(runtime::Bool(false));
+    return value;
+}
+
+// Создаёт машинный код по байткоду метода. Код начинается с пролога, выполняющего переход
+// к инструкции с номером entry по таблице адресов, расположенной в конце кода
+class Generator {
+public:
+    explicit Generator(const Code& code)
+        : code_{code},
+          layout_{ObjectHolder::GetLayout()},
+          labels_(code.instructions.size()),
+          exits_(code.instructions.size()) {
+    }
+
+    // Возвращает машинный код и смещение таблицы адресов в нём. Таблица содержит смещения
+    // инструкций, к которым нужно прибавить адрес кода
+    pair<vector<uint8_t>, size_t> Generate() {
+        asm_.Byte(0x53);  // push rbx
+        asm_.Byte(0x48);  // mov rbx, rdi
+        asm_.Byte(0x89);
+        asm_.Byte(0xFB);
+        asm_.Byte(0x89);  // mov eax, esi
+        asm_.Byte(0xF0);
+        asm_.Byte(0x48);  // lea rcx, [rip + table]
+        asm_.Byte(0x8D);
+        asm_.Byte(0x0D);
+        const size_t table_displacement = asm_.Size();
+        asm_.Dword(0);
+        asm_.Byte(0xFF);  // jmp qword [rcx + rax * 8]
+        asm_.Byte(0x24);
+        asm_.Byte(0xC1);
+
+        for (uint32_t i = 0; i < code_.instructions.size(); ++i) {
+            labels_[i] = asm_.Size();
+            index_ = i;
+            if (EmitInstruction(code_.instructions[i])) {
+                ++native_instructions_;
+            } else {
+                asm_.Exit(i);
+            }
+        }
+
+        for (uint32_t i = 0; i < exits_.size(); ++i) {
+            if (exits_[i].empty()) {
+                continue;
+            }
+            for (size_t at : exits_[i]) {
+                asm_.Patch(at, asm_.Size());
+            }
+            asm_.Exit(i);
+        }
+        for (auto [at, target] : jumps_) {
+            asm_.Patch(at, labels_[target]);
+        }
+
+        while (asm_.Size() % sizeof(uint64_t) != 0) {
+            asm_.Byte(0xCC);  // int3
+        }
+        const size_t table = asm_.Size();
+        asm_.Patch(table_displacement, table);
+        for (size_t label : labels_) {
+            asm_.Qword(label);
+        }
+        return {move(asm_.Bytes()), table};
+    }
+
+    // Число инструкций, получивших машинный код
+    [[nodiscard]] size_t GetNativeInstructions() const {
+        return native_instructions_;
+    }
+
+private:
+    // Создаёт машинный код инструкции. Возвращает false, если инструкция целиком
+    // выполняется интерпретатором
+    bool EmitInstruction(const Instruction& ins) {
+        switch (ins.op) {
+            case OpCode::LoadConst: {
+                const ObjectHolder& value = code_.constants[ins.b];
+                if (value.GetType() != runtime::ObjectType::Number) {
+                    return false;
+                }
+                asm_.MoveImmediate(RAX, NumberValue(value));
+                StoreNumber(ins.a);
+                return true;
+            }
+
+            case OpCode::Move:
+                LoadNumber(RAX, ins.b);
+                StoreNumber(ins.a);
+                return true;
+
+            case OpCode::CheckBound:
+                // Значение, не присвоенное переменной, хранится как невладеющая ссылка
+                asm_.CompareByte(Kind(ins.a), layout_.shared_kind);
+                ExitIf(EQUAL);
+                return true;
+
+            case OpCode::Add:
+            case OpCode::Sub:
+            case OpCode::Mult:
+            case OpCode::Div:
+                if (!IsNumberOperand(ins.b) || !IsNumberOperand(ins.c)) {
+                    return false;
+                }
+                LoadNumber(RAX, ins.b);
+                LoadNumber(RCX, ins.c);
+                EmitArithmetic(ins.op);
+                StoreNumber(ins.a);
+                return true;
+
+            case OpCode::Compare:
+                if (!IsNumberOperand(ins.b) || !IsNumberOperand(ins.c)) {
+                    return false;
+                }
+                LoadNumber(RAX, ins.b);
+                LoadNumber(RCX, ins.c);
+                asm_.Compare(RAX, RCX);
+                asm_.Set(ToCondition(static_cast<runtime::CompareOp>(ins.d)), RAX);
+                StoreBool(ins.a);
+                return true;
+
+            case OpCode::CompareJump:
+                if (!IsNumberOperand(ins.b) || !IsNumberOperand(ins.c)) {
+                    return false;
+                }
+                LoadNumber(RAX, ins.b);
+                LoadNumber(RCX, ins.c);
+                asm_.Compare(RAX, RCX);
+                JumpTo(asm_.Jump(Invert(ToCondition(static_cast<runtime::CompareOp>(ins.a)))),
+                       ins.d);
+                return true;
+
+            case OpCode::Truth:
+            case OpCode::Not:
+                LoadTruth(ins.b);
+                asm_.Set(ins.op == OpCode::Truth ? NOT_EQUAL : EQUAL, RAX);
+                StoreBool(ins.a);
+                return true;
+
+            case OpCode::Jump:
+                JumpTo(asm_.Jump(), ins.a);
+                return true;
+
+            case OpCode::JumpIfFalse:
+            case OpCode::JumpIfTrue:
+                LoadTruth(ins.a);
+                JumpTo(asm_.Jump(ins.op == OpCode::JumpIfFalse ? EQUAL : NOT_EQUAL), ins.b);
+                return true;
+
+            default:
+                return false;
+        }
+    }
+
+    // Вычисляет eax = eax op ecx
+    void EmitArithmetic(OpCode op) {
+        switch (op) {
+            case OpCode::Add:
+                asm_.Add(RAX, RCX);
+                break;
+            case OpCode::Sub:
+                asm_.Sub(RAX, RCX);
+                break;
+            case OpCode::Mult:
+                asm_.Multiply(RAX, RCX);
+                break;
+            default: {
+                // Деление на ноль и переполнение при делении обрабатывает интерпретатор
+                asm_.Test(RCX, RCX);
+                ExitIf(EQUAL);
+                asm_.CompareImmediate(RCX, static_cast<uint32_t>(-1));
+                const size_t divisor_checked = asm_.Jump(NOT_EQUAL);
+                asm_.CompareImmediate(RAX, static_cast<uint32_t>(numeric_limits<int>::min()));
+                ExitIf(EQUAL);
+                asm_.Patch(divisor_checked, asm_.Size());
+                asm_.Divide(RCX);
+                break;
+            }
+        }
+    }
+
+    // Загружает в reg значение числа из операнда rk. Если регистр хранит не число,
+    // инструкция выполняется интерпретатором
+    void LoadNumber(Register reg, uint32_t operand) {
+        if (operand & CONSTANT_OPERAND) {
+            asm_.MoveImmediate(reg, NumberValue(code_.constants[operand ^ CONSTANT_OPERAND]));
+            return;
+        }
+        asm_.CompareByte(Kind(operand), layout_.number_kind);
+        ExitIf(NOT_EQUAL);
+        asm_.LoadDword(reg, Value(operand, layout_.number_offset));
+    }
+
+    // Загружает в eax значение логического значения либо числа из регистра index
+    // и сравнивает его с нулём
+    void LoadTruth(uint32_t index) {
+        asm_.CompareByte(Kind(index), layout_.bool_kind);
+        const size_t not_bool = asm_.Jump(NOT_EQUAL);
+        asm_.LoadByte(RAX, Value(index, layout_.bool_offset));
+        const size_t loaded = asm_.Jump();
+        asm_.Patch(not_bool, asm_.Size());
+        asm_.CompareByte(Kind(index), layout_.number_kind);
+        ExitIf(NOT_EQUAL);
+        asm_.LoadDword(RAX, Value(index, layout_.number_offset));
+        asm_.Patch(loaded, asm_.Size());
+        asm_.Test(RAX, RAX);
+    }
+
+    // Записывает число из eax в регистр index
+    void StoreNumber(uint32_t index) {
+        PrepareValue(index, layout_.number_kind, NumberTemplate());
+        asm_.StoreDword(Value(index, layout_.number_offset), RAX);
+    }
+
+    // Записывает логическое значение из al в регистр index
+    void StoreBool(uint32_t index) {
+        PrepareValue(index, layout_.bool_kind, BoolTemplate());
+        asm_.StoreByte(Value(index, layout_.bool_offset), RAX);
+    }
+
+    // Делает регистр index хранящим значение, совпадающее по типу с value. Значение
+    // непосредственно хранимого типа либо None заменяется копией value без освобождения.
+    // Регистр, ссылающийся на объект, обрабатывает интерпретатор
+    void PrepareValue(uint32_t index, uint8_t kind, const ObjectHolder& value) {
+        asm_.CompareByte(Kind(index), kind);
+        const size_t prepared = asm_.Jump(EQUAL);
+        asm_.CompareByte(Kind(index), layout_.heap_kind);
+        ExitIf(EQUAL);
+        asm_.CompareByte(Kind(index), layout_.shared_kind);
+        ExitIf(EQUAL);
+        asm_.MoveImmediate64(RCX, reinterpret_cast<uint64_t>(&value));
+        for (size_t offset = 0; offset < layout_.size; offset += sizeof(uint64_t)) {
+            asm_.CopyQword(Value(index, offset), static_cast<int8_t>(offset));
+        }
+        asm_.Patch(prepared, asm_.Size());
+    }
+
+    [[nodiscard]] bool IsNumberOperand(uint32_t operand) const {
+        return !(operand & CONSTANT_OPERAND)
+               || code_.constants[operand ^ CONSTANT_OPERAND].GetType()
+                      == runtime::ObjectType::Number;
+    }
+
+    static uint32_t NumberValue(const ObjectHolder& value) {
+        return static_cast<uint32_t>(value.AsNumber());
+    }
+
+    [[nodiscard]] uint32_t Value(uint32_t index, size_t offset) const {
+        return static_cast<uint32_t>(index * layout_.size + offset);
+    }
+
+    [[nodiscard]] uint32_t Kind(uint32_t index) const {
+        return Value(index, layout_.kind_offset);
+    }
+
+    // При выполнении условия передаёт текущую инструкцию интерпретатору
+    void ExitIf(Condition condition) {
+        exits_[index_].push_back(asm_.Jump(condition));
+    }
+
+    void JumpTo(size_t at, uint32_t target) {
+        jumps_.emplace_back(at, target);
+    }
+
+    const Code& code_;
+    const ObjectHolder::Layout layout_;
+    Assembler asm_;
+    // Смещения машинного кода инструкций
+    vector<size_t> labels_;
+    // Переходы к выходу в интерпретатор для каждой инструкции и переходы между инструкциями
+    vector<vector<size_t>> exits_;
+    vector<pair<size_t, uint32_t>> jumps_;
+    uint32_t index_ = 0;
+    size_t native_instructions_ = 0;
+};
+
+}  // namespace
+
+NativeCode::NativeCode(void* memory, size_t size, Function function)
+    : memory_{memory}, size_{size}, function_{function} {
+}
+
+bool NativeCode::IsSupported() {
+#ifdef MYTHON_JIT_X86_64
+    // Смещение последнего qword значения при копировании должно помещаться в знаковый байт
+    const auto layout = ObjectHolder::GetLayout();
+    return layout.size % sizeof(uint64_t) == 0
+           && layout.size - sizeof(uint64_t) <= static_cast<size_t>(numeric_limits<int8_t>::max());
+#else
+    return false;
+#endif
+}
+
+#ifdef MYTHON_JIT_X86_64
+
+unique_ptr<NativeCode> NativeCode::Compile(const Code& code) {
+    if (!IsSupported()
+        || code.register_count
+               > numeric_limits<int32_t>::max() / ObjectHolder::GetLayout().size) {
+        return nullptr;
+    }
+
+    Generator generator(code);
+    auto [bytes, table] = generator.Generate();
+    const auto page_size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    const size_t size = (bytes.size() + page_size - 1) / page_size * page_size;
+
+    void* memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) {
+        return nullptr;
+    }
+
+    auto* start = static_cast<uint8_t*>(memory);
+    memcpy(start, bytes.data(), bytes.size());
+    for (size_t at = table; at < bytes.size(); at += sizeof(uint64_t)) {
+        uint64_t address = 0;
+        memcpy(&address, start + at, sizeof(address));
+        address += reinterpret_cast<uint64_t>(start);
+        memcpy(start + at, &address, sizeof(address));
+    }
+
+    if (mprotect(memory, size, PROT_READ | PROT_EXEC) != 0) {
+        munmap(memory, size);
+        return nullptr;
+    }
+
+    auto& stats = GetJitStats();
+    ++stats.compiled_methods;
+    stats.instructions += code.instructions.size();
+    stats.native_instructions += generator.GetNativeInstructions();
+    return unique_ptr<NativeCode>(
+        new NativeCode(memory, size, reinterpret_cast<Function>(memory)));
+}
+
+NativeCode::~NativeCode() {
+    munmap(memory_, size_);
+}
+
+#else
+
+unique_ptr<NativeCode> NativeCode::Compile([[maybe_unused]] const Code& code) {
+    return nullptr;
+}
+
+NativeCode::~NativeCode() = default;
+
+#endif
+
+}  // namespace vm
@@ -0,0 +1,58 @@
+#pragma once
+
+#include "runtime.h"
+
+#include <cstdint>
+#include <memory>
+
+namespace vm {
+
+struct Code;
+
+// Статистика JIT-компиляции
+struct JitStats {
+    // Методы, для которых создан машинный код
+    std::uint64_t compiled_methods = 0;
+    // Инструкции байткода скомпилированных методов и инструкции, получившие машинный код.
+    // Остальные инструкции выполняются интерпретатором
+    std::uint64_t instructions = 0;
+    std::uint64_t native_instructions = 0;
+};
+
+// Возвращает накопленную статистику JIT-компиляции
+JitStats& GetJitStats();
+
+// Машинный код x86-64, созданный по байткоду метода из шаблонов для отдельных инструкций.
+// Шаблоны выполняют операции над числами и логическими значениями, проверяя типы операндов.
+// Остальные инструкции (вызовы, возврат из метода, операции над строками и экземплярами
+// классов), а также инструкции, операнды которых не прошли проверку, машинный код передаёт
+// интерпретатору. Поэтому машинный код не вызывает функций и через него не проходят исключения
+class NativeCode {
+public:
+    // Компилирует байткод code. Возвращает nullptr, если платформа не поддерживается
+    // или не удалось выделить исполняемую память
+    static std::unique_ptr<NativeCode> Compile(const Code& code);
+    // Возвращает true, если машинный код может создаваться на данной платформе
+    static bool IsSupported();
+
+    NativeCode(const NativeCode&) = delete;
+    NativeCode& operator=(const NativeCode&) = delete;
+    ~NativeCode();
+
+    // Выполняет машинный код, начиная с инструкции entry, над регистрами кадра registers.
+    // Возвращает номер инструкции, которую должен выполнить интерпретатор
+    std::uint32_t Run(runtime::ObjectHolder* registers, std::uint32_t entry) const {
+        return function_(registers, entry);
+    }
+
+private:
+    using Function = std::uint32_t (*)(runtime::ObjectHolder* registers, std::uint32_t entry);
+
+    NativeCode(void* memory, std::size_t size, Function function);
+
+    void* memory_;
+    std::size_t size_;
+    Function function_;
+};
+
+}  // namespace vm
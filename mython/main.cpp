@@ -1,38 +1,197 @@
+#include "arena.h"
+#include "flat_ast.h"
+#include "gc.h"
 #include "lexer.h"
+#include "memoization.h"
+#include "optimizer.h"
 #include "parse.h"
 #include "runtime.h"
 #include "statement.h"
+#include "type_inference.h"
+#include "vm.h"
 
 #include <filesystem>
 #include <fstream>
 #include <iostream>
+#include <optional>
+#include <string_view>
 
 using namespace std;
 
 namespace {
 
-void RunMythonProgram(istream& input, ostream& output) {
+// Параметры командной строки интерпретатора
+struct Options {
+    std::filesystem::path in_path;
+    std::filesystem::path out_path;
+    // Вывести в cerr статистику исполнения после завершения программы
+    bool print_stats = false;
+    // Исполнить программу на виртуальной машине вместо обхода дерева разбора
+    bool use_vm = false;
+    // Исполнить программу обходом плоского представления дерева разбора
+    bool use_flat = false;
+    // Компилировать часто вызываемые методы в машинный код. Включает виртуальную машину
+    bool use_jit = false;
+    // Вывести типы перед обходом дерева разбора и исполнить операции над значениями
+    // доказанных типов без проверок
+    bool infer_types = false;
+    // Вывести в cerr выведенные типы. Включает вывод типов
+    bool dump_types = false;
+};
+
+optional<Options> ParseOptions(int argc, const char** argv) {
+    Options options;
+    vector<string_view> files;
+
+    for (int i = 1; i < argc; ++i) {
+        string_view arg = argv[i];
+        if (arg == "--stats"sv) {
+            options.print_stats = true;
+        } else if (arg == "--backend=tree"sv) {
+            options.use_vm = false;
+            options.use_flat = false;
+        } else if (arg == "--backend=vm"sv) {
+            options.use_vm = true;
+            options.use_flat = false;
+        } else if (arg == "--backend=flat"sv) {
+            options.use_vm = false;
+            options.use_flat = true;
+        } else if (arg == "--jit"sv) {
+            options.use_jit = true;
+        } else if (arg == "--infer-types"sv) {
+            options.infer_types = true;
+        } else if (arg == "--dump-types"sv) {
+            options.dump_types = true;
+        } else if (arg.substr(0, 2) == "--"sv) {
+            return nullopt;
+        } else {
+            files.push_back(arg);
+        }
+    }
+
+    if (files.size() != 2) {
+        return nullopt;
+    }
+    options.use_vm = options.use_vm || options.use_jit;
+    options.use_flat = options.use_flat && !options.use_vm;
+    options.infer_types = options.infer_types || options.dump_types;
+    options.in_path = files[0];
+    options.out_path = files[1];
+    return options;
+}
+
+void PrintStats(ostream& out, const ast::OptimizationStats& optimization) {
+    out << "Optimizer: removed "sv << optimization.removed_nodes << " nodes, temporary values "sv
+        << optimization.temporary_values << endl;
+
+    const auto& arena = ast::GetArenaStats();
+    out << "Arena: allocations "sv << arena.allocations << ", bytes "sv << arena.allocated_bytes
+        << ", blocks "sv << arena.blocks << endl;
+
+    const auto& flattened = flat::GetFlattenStats();
+    out << "Flat AST: nodes "sv << flattened.nodes << ", bytes "sv << flattened.bytes << endl;
+
+    const auto& allocations = runtime::GetAllocationStats();
+    out << "Allocations: heap objects "sv << allocations.heap_objects << ", avoided "sv
+        << allocations.avoided_objects << endl;
+
+    // Имена типов в порядке значений runtime::ObjectType
+    const string_view type_names[] = {"None"sv,   "Other"sv, "Number"sv,       "String"sv,
+                                      "Bool"sv,   "Class"sv, "ClassInstance"sv};
+    static_assert(size(type_names) == runtime::OBJECT_TYPE_COUNT);
+    out << "Heap objects by type:"sv;
+    for (size_t type = 0; type < runtime::OBJECT_TYPE_COUNT; ++type) {
+        if (allocations.peak_objects[type] != 0) {
+            out << ' ' << type_names[type] << " live "sv << allocations.live_objects[type]
+                << " peak "sv << allocations.peak_objects[type] << ';';
+        }
+    }
+    out << endl;
+
+    const auto& strings = runtime::GetStringStats();
+    out << "Strings: ropes "sv << strings.ropes << ", flattened "sv << strings.flattened_ropes
+        << endl;
+
+    const auto& constants = runtime::GetConstantPoolStats();
+    out << "Constant pool: strings "sv << constants.strings << ", reused "sv << constants.reused
+        << endl;
+
+    const auto& pool = runtime::GetObjectPoolStats();
+    out << "Object pool: slabs "sv << pool.slabs << ", pooled "sv << pool.pooled_allocations
+        << ", large "sv << pool.large_allocations << endl;
+
+    const auto& collector = runtime::CycleCollector::Instance().GetStats();
+    out << "Cycle collector: collections "sv << collector.collections << ", freed "sv
+        << collector.freed_objects << ", pause total "sv << collector.total_pause_us
+        << " us, max "sv << collector.max_pause_us << " us"sv << endl;
+
+    const auto& calls = ast::GetMethodCacheStats();
+    out << "Method call cache: hits "sv << calls.hits << ", misses "sv << calls.misses
+        << ", megamorphic "sv << calls.megamorphic << endl;
+
+    const auto& quickening = ast::GetQuickeningStats();
+    out << "Quickening: specialized "sv << quickening.specializations << ", deoptimized "sv
+        << quickening.deoptimizations << endl;
+
+    const auto& memoization = ast::GetMemoizationStats();
+    const uint64_t memoized_calls = memoization.hits + memoization.misses;
+    out << "Memoization: pure methods "sv << memoization.pure_methods << ", hits "sv
+        << memoization.hits << ", misses "sv << memoization.misses << ", hit rate "sv
+        << (memoized_calls == 0 ? 0 : memoization.hits * 100 / memoized_calls) << '%' << endl;
+
+    const auto& jit = vm::GetJitStats();
+    out << "JIT: compiled "sv << jit.compiled_methods << " methods, native instructions "sv
+        << jit.native_instructions << " of "sv << jit.instructions << endl;
+}
+
+ast::OptimizationStats RunMythonProgram(istream& input, ostream& output,
+                                        const Options& options) {
     parse::Lexer lexer(input);
 
-    auto program = ParseProgram(lexer);
+    auto tree = ParseProgram(lexer);
+    const auto optimization = ast::Optimize(tree);
+    if (options.infer_types) {
+        const auto types = ast::InferTypes(*tree);
+        if (options.dump_types) {
+            cerr << types.description;
+        }
+    }
+    unique_ptr<runtime::Executable> program;
+    if (options.use_vm) {
+        auto compiled = vm::Compile(move(tree));
+        if (options.use_jit) {
+            compiled->EnableJit();
+        }
+        program = move(compiled);
+    } else if (options.use_flat) {
+        program = flat::Flatten(move(tree));
+    } else {
+        ast::MemoizePureMethods(*tree);
+        program = move(tree);
+    }
 
     runtime::SimpleContext context{output};
     runtime::Closure closure;
     program->Execute(closure, context);
+    return optimization;
 }
 
 }
 
 int main(int argc, const char** argv) {
-    if (argc != 3) {
+    auto options = ParseOptions(argc, argv);
+    if (!options) {
             cerr << "Mython interpreter!"sv << endl;
             std::filesystem::path interpreter = argv[0];
-            cerr << "Usage: "sv << interpreter.filename() << " <in_file> <out_file>"sv << endl;
+            cerr << "Usage: "sv << interpreter.filename()
+                 << " [--stats] [--backend=tree|vm|flat] [--jit] [--infer-types] [--dump-types]"sv
+                    " <in_file> <out_file>"sv
+                 << endl;
             return 1;
     }
 
-    std::filesystem::path in_path = argv[1];
-    std::filesystem::path out_path = argv[2];
+    const auto& in_path = options->in_path;
+    const auto& out_path = options->out_path;
 
     ifstream ifile(in_path);
     if (!ifile.is_open()) {
@@ -43,11 +202,16 @@ int main(int argc, const char** argv) {
         std::cerr << "Can't open file "s << out_path << endl;
     }
 
+    ast::OptimizationStats optimization;
     try {
-        RunMythonProgram(ifile, ofile);
+        optimization = RunMythonProgram(ifile, ofile, *options);
     } catch (const std::exception& e) {
         std::cerr << e.what() << std::endl;
         return 1;
     }
+
+    if (options->print_stats) {
+        PrintStats(cerr, optimization);
+    }
     return 0;
 }
@@ -0,0 +1,395 @@
+#include "memoization.h"
+
+#include <vector>
+
+using namespace std;
+
+namespace ast {
+
+using runtime::ObjectHolder;
+using runtime::ObjectType;
+
+MemoizationStats& GetMemoizationStats() {
+    static MemoizationStats stats;
+    return stats;
+}
+
+namespace {
+
+const runtime::Symbol SELF{"self"sv};
+
+// Собирает классы, объявленные в программе и в телах методов её классов
+class ClassCollector : public Visitor {
+public:
+    vector<runtime::Class*> Collect(Statement& program) {
+        program.Accept(*this);
+        return move(classes_);
+    }
+
+    void Visit([[maybe_unused]] NumericConst& node) override {
+    }
+    void Visit([[maybe_unused]] StringConst& node) override {
+    }
+    void Visit([[maybe_unused]] BoolConst& node) override {
+    }
+    void Visit([[maybe_unused]] VariableValue& node) override {
+    }
+    void Visit([[maybe_unused]] Assignment& node) override {
+    }
+    void Visit([[maybe_unused]] FieldAssignment& node) override {
+    }
+    void Visit([[maybe_unused]] None& node) override {
+    }
+    void Visit([[maybe_unused]] Print& node) override {
+    }
+    void Visit([[maybe_unused]] MethodCall& node) override {
+    }
+    void Visit([[maybe_unused]] NewInstance& node) override {
+    }
+    void Visit([[maybe_unused]] Stringify& node) override {
+    }
+    void Visit([[maybe_unused]] Add& node) override {
+    }
+    void Visit([[maybe_unused]] Sub& node) override {
+    }
+    void Visit([[maybe_unused]] Mult& node) override {
+    }
+    void Visit([[maybe_unused]] Div& node) override {
+    }
+    void Visit([[maybe_unused]] Or& node) override {
+    }
+    void Visit([[maybe_unused]] And& node) override {
+    }
+    void Visit([[maybe_unused]] Not& node) override {
+    }
+    void Visit([[maybe_unused]] Comparison& node) override {
+    }
+    void Visit([[maybe_unused]] Return& node) override {
+    }
+
+    // Объявления классов - инструкции, поэтому встречаются только в составных инструкциях,
+    // ветках if и телах методов
+    void Visit(Compound& node) override {
+        for (auto& statement : node.Statements()) {
+            statement->Accept(*this);
+        }
+    }
+    void Visit(MethodBody& node) override {
+        node.Body()->Accept(*this);
+    }
+    void Visit(IfElse& node) override {
+        node.IfBody()->Accept(*this);
+        if (node.ElseBody()) {
+            node.ElseBody()->Accept(*this);
+        }
+    }
+    void Visit(ClassDefinition& node) override {
+        runtime::Class& cls = node.GetClass();
+        classes_.push_back(&cls);
+        for (runtime::Method& method : cls.Methods()) {
+            if (auto body = dynamic_cast<Statement*>(method.body.get())) {
+                body->Accept(*this);
+            }
+        }
+    }
+
+private:
+    vector<runtime::Class*> classes_;
+};
+
+// Проверяет тело метода на отсутствие побочных эффектов и собирает вызовы методов self,
+// от чистоты которых зависит чистота метода
+class PurityChecker : public Visitor {
+public:
+    struct SelfCall {
+        runtime::Symbol name;
+        size_t argument_count;
+    };
+
+    // Возвращает true, если тело метода может быть чистым
+    bool Check(Statement& body) {
+        Visit(body);
+        return pure_;
+    }
+
+    [[nodiscard]] const vector<SelfCall>& GetSelfCalls() const {
+        return self_calls_;
+    }
+
+    void Visit([[maybe_unused]] NumericConst& node) override {
+    }
+    void Visit([[maybe_unused]] StringConst& node) override {
+    }
+    void Visit([[maybe_unused]] BoolConst& node) override {
+    }
+    void Visit(VariableValue& node) override {
+        // Поля объектов могут изменяться, а результат, зависящий от self, нельзя разделять
+        // между экземплярами класса
+        if (!node.GetFieldNames().empty() || node.GetName() == SELF) {
+            pure_ = false;
+        }
+    }
+    void Visit(Assignment& node) override {
+        Visit(node.Value());
+    }
+    void Visit([[maybe_unused]] FieldAssignment& node) override {
+        pure_ = false;
+    }
+    void Visit([[maybe_unused]] None& node) override {
+    }
+    void Visit([[maybe_unused]] Print& node) override {
+        pure_ = false;
+    }
+    void Visit(MethodCall& node) override {
+        auto object = dynamic_cast<VariableValue*>(node.Object().get());
+        if (object == nullptr || object->GetName() != SELF || !object->GetFieldNames().empty()) {
+            pure_ = false;
+            return;
+        }
+        self_calls_.push_back({node.GetMethodName(), node.Args().size()});
+        for (auto& arg : node.Args()) {
+            Visit(arg);
+        }
+    }
+    void Visit([[maybe_unused]] NewInstance& node) override {
+        pure_ = false;
+    }
+    void Visit(Stringify& node) override {
+        Visit(node.Argument());
+    }
+    void Visit(Add& node) override {
+        VisitBinary(node);
+    }
+    void Visit(Sub& node) override {
+        VisitBinary(node);
+    }
+    void Visit(Mult& node) override {
+        VisitBinary(node);
+    }
+    void Visit(Div& node) override {
+        VisitBinary(node);
+    }
+    void Visit(Or& node) override {
+        VisitBinary(node);
+    }
+    void Visit(And& node) override {
+        VisitBinary(node);
+    }
+    void Visit(Not& node) override {
+        Visit(node.Argument());
+    }
+    void Visit(Compound& node) override {
+        for (auto& statement : node.Statements()) {
+            Visit(statement);
+        }
+    }
+    void Visit(MethodBody& node) override {
+        Visit(node.Body());
+    }
+    void Visit(Return& node) override {
+        Visit(node.Value());
+    }
+    void Visit([[maybe_unused]] ClassDefinition& node) override {
+        pure_ = false;
+    }
+    void Visit(IfElse& node) override {
+        Visit(node.Condition());
+        Visit(node.IfBody());
+        Visit(node.ElseBody());
+    }
+    void Visit(Comparison& node) override {
+        // Произвольная функция сравнения может иметь побочные эффекты
+        if (!node.GetOp()) {
+            pure_ = false;
+            return;
+        }
+        VisitBinary(node);
+    }
+
+private:
+    void Visit(Statement& node) {
+        if (pure_) {
+            node.Accept(*this);
+        }
+    }
+
+    void Visit(unique_ptr<Statement>& node) {
+        if (node) {
+            Visit(*node);
+        }
+    }
+
+    void VisitBinary(BinaryOperation& node) {
+        Visit(node.Lhs());
+        Visit(node.Rhs());
+    }
+
+    bool pure_ = true;
+    vector<SelfCall> self_calls_;
+};
+
+void AppendBytes(string& key, const void* data, size_t size) {
+    key.append(static_cast<const char*>(data), size);
+}
+
+// Дописывает к ключу значение value. Возвращает false для значений, не являющихся числом,
+// строкой, логическим значением или None, и для несобранных строк-конкатенаций
+bool AppendValue(string& key, const ObjectHolder& value) {
+    const ObjectType type = value.GetType();
+    key.push_back(static_cast<char>(type));
+
+    switch (type) {
+        case ObjectType::None:
+            return true;
+        case ObjectType::Number: {
+            const int number = value.AsNumber();
+            AppendBytes(key, &number, sizeof(number));
+            return true;
+        }
+        case ObjectType::Bool:
+            key.push_back(value.AsBool() ? '1' : '0');
+            return true;
+        case ObjectType::String: {
+            // Ради ключа конкатенация не собирается: строка, накапливаемая в рекурсии,
+            // собиралась бы заново при каждом вызове
+            if (!value.As<runtime::String>().IsFlat()) {
+                return false;
+            }
+            const string& str = value.As<runtime::String>().GetValue();
+            const size_t size = str.size();
+            AppendBytes(key, &size, sizeof(size));
+            key += str;
+            return true;
+        }
+        default:
+            return false;
+    }
+}
+
+}  // namespace
+
+MemoizedMethod::MemoizedMethod(const runtime::Method& method, unique_ptr<runtime::Executable> body,
+    unordered_set<const runtime::Class*> pure_classes)
+        : method_{method}, body_{move(body)}, pure_classes_{move(pure_classes)} {
+}
+
+bool MemoizedMethod::MakeKey(runtime::Closure& closure, runtime::Context& context,
+                             string& key) const {
+    auto argument = [&](size_t index) -> const ObjectHolder& {
+        if (method_.frame_size != 0) {
+            return *context.GetCallStack().Slot(index);
+        }
+        return closure.at(index == 0 ? SELF : method_.formal_params[index - 1]);
+    };
+
+    auto self = argument(0).TryAs<runtime::ClassInstance>();
+    if (self == nullptr || pure_classes_.count(&self->GetClass()) == 0) {
+        return false;
+    }
+    const runtime::Class* cls = &self->GetClass();
+    AppendBytes(key, &cls, sizeof(cls));
+
+    for (size_t i = 1; i <= method_.formal_params.size(); ++i) {
+        if (!AppendValue(key, argument(i))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+ObjectHolder MemoizedMethod::Execute(runtime::Closure& closure, runtime::Context& context) {
+    string key;
+    if (!MakeKey(closure, context, key)) {
+        return body_->Execute(closure, context);
+    }
+
+    auto& stats = GetMemoizationStats();
+    if (auto it = cache_.find(key); it != cache_.end()) {
+        ++stats.hits;
+        return it->second;
+    }
+
+    ++stats.misses;
+    ObjectHolder result = body_->Execute(closure, context);
+    // Результат вызова в хвостовой позиции станет известен после выхода из метода
+    if (!context.HasTailCall()) {
+        if (cache_.size() == CACHE_CAPACITY) {
+            cache_.clear();
+        }
+        cache_.emplace(move(key), result);
+    }
+    return result;
+}
+
+size_t MemoizePureMethods(Statement& program) {
+    const vector<runtime::Class*> classes = ClassCollector().Collect(program);
+
+    struct Candidate {
+        const runtime::Class* cls;
+        runtime::Method* method;
+        vector<PurityChecker::SelfCall> self_calls;
+    };
+
+    // Пары (класс, метод), для которых метод может быть чистым. Пара исключается,
+    // если метод вызывает у self метод, не являющийся чистым в этом классе
+    vector<Candidate> candidates;
+    for (runtime::Class* owner : classes) {
+        for (runtime::Method& method : owner->Methods()) {
+            auto body = dynamic_cast<Statement*>(method.body.get());
+            PurityChecker checker;
+            if (body == nullptr || !checker.Check(*body)) {
+                continue;
+            }
+            for (const runtime::Class* cls : classes) {
+                if (cls->GetMethod(method.name) == &method) {
+                    candidates.push_back({cls, &method, checker.GetSelfCalls()});
+                }
+            }
+        }
+    }
+
+    auto is_candidate = [&candidates](const runtime::Class* cls, const runtime::Method* method) {
+        for (const Candidate& candidate : candidates) {
+            if (candidate.cls == cls && candidate.method == method) {
+                return true;
+            }
+        }
+        return false;
+    };
+
+    for (bool changed = true; changed;) {
+        changed = false;
+        for (size_t i = 0; i < candidates.size();) {
+            const Candidate& candidate = candidates[i];
+            bool pure = true;
+            for (const auto& call : candidate.self_calls) {
+                const runtime::Method* callee = candidate.cls->GetMethod(call.name,
+                                                                         call.argument_count);
+                if (callee == nullptr || !is_candidate(candidate.cls, callee)) {
+                    pure = false;
+                    break;
+                }
+            }
+            if (pure) {
+                ++i;
+            } else {
+                candidates.erase(candidates.begin() + static_cast<ptrdiff_t>(i));
+                changed = true;
+            }
+        }
+    }
+
+    unordered_map<runtime::Method*, unordered_set<const runtime::Class*>> pure_classes;
+    for (const Candidate& candidate : candidates) {
+        pure_classes[candidate.method].insert(candidate.cls);
+    }
+    for (auto& [method, classes_of_method] : pure_classes) {
+        method->body = make_unique<MemoizedMethod>(*method, move(method->body),
+                                                   move(classes_of_method));
+    }
+
+    GetMemoizationStats().pure_methods += pure_classes.size();
+    return pure_classes.size();
+}
+
+}  // namespace ast
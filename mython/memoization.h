@@ -0,0 +1,59 @@
+#pragma once
+
+#include "runtime.h"
+#include "statement.h"
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+
+namespace ast {
+
+// Статистика запоминания результатов чистых методов
+struct MemoizationStats {
+    // Методы, тела которых заменены на MemoizedMethod
+    std::uint64_t pure_methods = 0;
+    // Вызовы, результат которых найден среди запомненных, и вызовы, выполнившие тело метода
+    std::uint64_t hits = 0;
+    std::uint64_t misses = 0;
+};
+
+// Возвращает накопленную статистику запоминания результатов
+MemoizationStats& GetMemoizationStats();
+
+// Тело чистого метода, запоминающее результаты вызовов. Ключ результата - класс объекта self
+// и значения аргументов. Результат запоминается, только если класс self входит в pure_classes,
+// а все аргументы - числа, строки, логические значения или None
+class MemoizedMethod : public runtime::Executable {
+public:
+    // Наибольшее число результатов, запоминаемых для метода. При заполнении кэш очищается
+    static constexpr size_t CACHE_CAPACITY = 4096;
+
+    MemoizedMethod(const runtime::Method& method, std::unique_ptr<runtime::Executable> body,
+                   std::unordered_set<const runtime::Class*> pure_classes);
+
+    runtime::ObjectHolder Execute(runtime::Closure& closure, runtime::Context& context) override;
+
+private:
+    // Строит ключ вызова. Возвращает false, если результат вызова не может быть запомнен
+    bool MakeKey(runtime::Closure& closure, runtime::Context& context, std::string& key) const;
+
+    const runtime::Method& method_;
+    std::unique_ptr<runtime::Executable> body_;
+    std::unordered_set<const runtime::Class*> pure_classes_;
+    std::unordered_map<std::string, runtime::ObjectHolder> cache_;
+};
+
+// Находит чистые методы классов, объявленных в программе, и заменяет их тела на MemoizedMethod.
+// Метод чист для класса, если в его теле нет print, присваивания полям, чтения полей, создания
+// объектов и классов, сравнения произвольной функцией, а self используется только для вызова
+// методов, которые в этом классе тоже чисты. Вызовы методов других объектов делают метод
+// нечистым. Аргументы-значения гарантируют, что все значения внутри такого метода - числа,
+// строки, логические значения и None, поэтому его результат зависит только от аргументов.
+// Возвращает число найденных чистых методов.
+// Применяется к программе, выполняемой обходом дерева разбора
+size_t MemoizePureMethods(Statement& program);
+
+}  // namespace ast
@@ -0,0 +1,118 @@
+#include "memoization.h"
+#include "program_test_utils.h"
+#include "test_runner.h"
+
+using namespace std;
+
+namespace ast {
+
+namespace {
+
+void TestPureMethodsAreMemoized() {
+    const string program = R"(
+class Math:
+  def fib(n):
+    if n < 2:
+      return n
+    return self.fib(n - 1) + self.fib(n - 2)
+
+  def twice(s):
+    return s + s
+
+  def fib_twice(n):
+    return self.twice(str(self.fib(n)))
+
+m = Math()
+print m.fib(25), m.fib_twice(10), m.fib(25)
+)"s;
+
+    auto tree = ParseFromString(program);
+    ASSERT_EQUAL(MemoizePureMethods(*tree), 3U);
+
+    const MemoizationStats before = GetMemoizationStats();
+    ASSERT_EQUAL(Run(*tree), "75025 5555 75025\n"s);
+
+    // Без запоминания fib(25) выполнил бы тело метода сотни тысяч раз
+    const MemoizationStats& after = GetMemoizationStats();
+    ASSERT(after.misses - before.misses < 40U);
+    ASSERT(after.hits - before.hits > 20U);
+}
+
+void TestImpureMethodsAreNotMemoized() {
+    const string program = R"(
+class Counter:
+  def __init__():
+    self.value = 0
+
+  def add(n):
+    self.value = self.value + n
+    return self.value
+
+  def get():
+    return self.value
+
+  def log(n):
+    print n
+    return n
+
+  def me():
+    return self
+
+  def logged(n):
+    return self.log(n) + 1
+
+  def other(counter):
+    return counter.get()
+
+class Quiet(Counter):
+  def log(n):
+    return n
+
+c = Counter()
+q = Quiet()
+print c.add(1), c.add(1), c.logged(5), c.logged(5), q.logged(5), c.other(c), c.add(1), c.other(c)
+)"s;
+
+    auto tree = ParseFromString(program);
+    // Чисты только Quiet.log и вызывающий его в классе Quiet метод logged
+    ASSERT_EQUAL(MemoizePureMethods(*tree), 2U);
+    ASSERT_EQUAL(Run(*tree), "1 2 5\n6 5\n6 6 2 3 3\n"s);
+}
+
+void TestNonValueArgumentsAreNotMemoized() {
+    const string program = R"(
+class Box:
+  def __init__(v):
+    self.v = v
+
+  def __str__():
+    return str(self.v)
+
+class Printer:
+  def show(x):
+    return str(x)
+
+b = Box(1)
+p = Printer()
+s1 = p.show(b)
+b.v = 2
+print s1, p.show(b), p.show(3), p.show(3)
+)"s;
+
+    auto tree = ParseFromString(program);
+    ASSERT_EQUAL(MemoizePureMethods(*tree), 1U);
+
+    const MemoizationStats before = GetMemoizationStats();
+    ASSERT_EQUAL(Run(*tree), "1 2 3 3\n"s);
+    ASSERT_EQUAL(GetMemoizationStats().hits - before.hits, 1U);
+}
+
+}  // namespace
+
+void RunMemoizationTests(TestRunner& tr) {
+    RUN_TEST(tr, ast::TestPureMethodsAreMemoized);
+    RUN_TEST(tr, ast::TestImpureMethodsAreNotMemoized);
+    RUN_TEST(tr, ast::TestNonValueArgumentsAreNotMemoized);
+}
+
+}  // namespace ast
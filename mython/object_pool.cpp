@@ -0,0 +1,108 @@
+#include "object_pool.h"
+
+#include <new>
+
+#if defined(__SANITIZE_ADDRESS__)
+#define MYTHON_NO_OBJECT_POOL
+#elif defined(__has_feature)
+#if __has_feature(address_sanitizer)
+#define MYTHON_NO_OBJECT_POOL
+#endif
+#endif
+
+using namespace std;
+
+namespace runtime {
+
+ObjectPoolStats& GetObjectPoolStats() {
+    static ObjectPoolStats stats;
+    return stats;
+}
+
+#ifndef MYTHON_NO_OBJECT_POOL
+
+namespace {
+
+constexpr size_t SIZE_CLASS_COUNT = ObjectPool::MAX_POOLED_SIZE / ObjectPool::GRANULE;
+
+struct FreeCell {
+    FreeCell* next;
+};
+
+// Пул потока. Тривиально разрушаем: объекты, освобождаемые после завершения потока
+// (например, при уничтожении статических переменных), по-прежнему могут вернуть в него ячейки
+struct ThreadPool {
+    FreeCell* free_cells[SIZE_CLASS_COUNT];
+    // Ещё не нарезанная часть последнего блока
+    byte* next;
+    size_t available;
+    // Блоки потока, связанные через свои первые байты
+    void* slabs;
+};
+
+thread_local ThreadPool pool;
+
+size_t SizeClassOf(size_t size) {
+    return (size - 1) / ObjectPool::GRANULE;
+}
+
+void NewSlab() {
+    auto slab = static_cast<byte*>(::operator new(ObjectPool::SLAB_SIZE));
+    *reinterpret_cast<void**>(slab) = pool.slabs;
+    pool.slabs = slab;
+    // Начало блока занято ссылкой на предыдущий блок, ячейки выровнены по GRANULE
+    pool.next = slab + ObjectPool::GRANULE;
+    pool.available = ObjectPool::SLAB_SIZE - ObjectPool::GRANULE;
+    ++GetObjectPoolStats().slabs;
+}
+
+}  // namespace
+
+void* ObjectPool::Allocate(size_t size) {
+    if (size == 0 || size > MAX_POOLED_SIZE) {
+        ++GetObjectPoolStats().large_allocations;
+        return ::operator new(size);
+    }
+    ++GetObjectPoolStats().pooled_allocations;
+
+    const size_t size_class = SizeClassOf(size);
+    if (FreeCell* cell = pool.free_cells[size_class]) {
+        pool.free_cells[size_class] = cell->next;
+        return cell;
+    }
+
+    const size_t cell_size = (size_class + 1) * GRANULE;
+    if (pool.available < cell_size) {
+        NewSlab();
+    }
+    void* result = pool.next;
+    pool.next += cell_size;
+    pool.available -= cell_size;
+    return result;
+}
+
+void ObjectPool::Deallocate(void* ptr, size_t size) noexcept {
+    if (size == 0 || size > MAX_POOLED_SIZE) {
+        ::operator delete(ptr);
+        return;
+    }
+    const size_t size_class = SizeClassOf(size);
+    auto cell = static_cast<FreeCell*>(ptr);
+    cell->next = pool.free_cells[size_class];
+    pool.free_cells[size_class] = cell;
+}
+
+#else
+
+void* ObjectPool::Allocate(size_t size) {
+    ++GetObjectPoolStats().large_allocations;
+    return ::operator new(size);
+}
+
+void ObjectPool::Deallocate(void* ptr, [[maybe_unused]] size_t size) noexcept {
+    ::operator delete(ptr);
+}
+
+#endif
+
+}  // namespace runtime
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace runtime {
+
+// Статистика пула объектов
+struct ObjectPoolStats {
+    // Блоки, полученные пулом у системного распределителя
+    std::uint64_t slabs = 0;
+    // Объекты, размещённые в пуле, и объекты, размещённые системным распределителем
+    // (слишком крупные для пула либо при отключённом пуле)
+    std::uint64_t pooled_allocations = 0;
+    std::uint64_t large_allocations = 0;
+};
+
+// Возвращает накопленную статистику пула объектов
+ObjectPoolStats& GetObjectPoolStats();
+
+// Пул памяти для объектов Mython. Объекты размером до MAX_POOLED_SIZE байт размещаются
+// в ячейках размерных классов с шагом GRANULE байт. Ячейки нарезаются из блоков по SLAB_SIZE
+// байт, освобождённые ячейки попадают в список свободных ячеек своего класса в потоке,
+// освободившем объект, и повторно используются без обращения к системному распределителю.
+// Блоки не возвращаются системе, поэтому объект может пережить поток, в котором создан.
+// При сборке с AddressSanitizer пул отключается, чтобы не скрывать ошибки работы с памятью
+class ObjectPool {
+public:
+    static constexpr std::size_t GRANULE = 16;
+    static constexpr std::size_t MAX_POOLED_SIZE = 256;
+    static constexpr std::size_t SLAB_SIZE = 64 * 1024;
+
+    static void* Allocate(std::size_t size);
+    // size должен совпадать с размером, переданным в Allocate
+    static void Deallocate(void* ptr, std::size_t size) noexcept;
+};
+
+}  // namespace runtime
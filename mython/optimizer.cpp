@@ -0,0 +1,411 @@
+#include "optimizer.h"
+
+#include <stdexcept>
+
+using namespace std;
+
+namespace ast {
+
+namespace {
+
+// Подсчитывает узлы поддерева и проверяет, объявляются ли в нём классы
+class NodeCounter : public Visitor {
+public:
+    size_t Count(Statement* node) {
+        if (node != nullptr) {
+            ++count_;
+            node->Accept(*this);
+        }
+        return count_;
+    }
+
+    [[nodiscard]] bool HasClassDefinition() const {
+        return has_class_definition_;
+    }
+
+    void Visit([[maybe_unused]] NumericConst& node) override {
+    }
+    void Visit([[maybe_unused]] StringConst& node) override {
+    }
+    void Visit([[maybe_unused]] BoolConst& node) override {
+    }
+    void Visit([[maybe_unused]] VariableValue& node) override {
+    }
+    void Visit(Assignment& node) override {
+        Count(node.Value().get());
+    }
+    void Visit(FieldAssignment& node) override {
+        Count(&node.Object());
+        Count(node.Value().get());
+    }
+    void Visit([[maybe_unused]] None& node) override {
+    }
+    void Visit(Print& node) override {
+        CountAll(node.Args());
+    }
+    void Visit(MethodCall& node) override {
+        Count(node.Object().get());
+        CountAll(node.Args());
+    }
+    void Visit(NewInstance& node) override {
+        CountAll(node.Args());
+    }
+    void Visit(Stringify& node) override {
+        VisitUnary(node);
+    }
+    void Visit(Add& node) override {
+        VisitBinary(node);
+    }
+    void Visit(Sub& node) override {
+        VisitBinary(node);
+    }
+    void Visit(Mult& node) override {
+        VisitBinary(node);
+    }
+    void Visit(Div& node) override {
+        VisitBinary(node);
+    }
+    void Visit(Or& node) override {
+        VisitBinary(node);
+    }
+    void Visit(And& node) override {
+        VisitBinary(node);
+    }
+    void Visit(Not& node) override {
+        VisitUnary(node);
+    }
+    void Visit(Compound& node) override {
+        CountAll(node.Statements());
+    }
+    void Visit(MethodBody& node) override {
+        Count(node.Body().get());
+    }
+    void Visit(Return& node) override {
+        Count(node.Value().get());
+    }
+    // Тела методов принадлежат классу, а не узлу дерева, и не подсчитываются
+    void Visit([[maybe_unused]] ClassDefinition& node) override {
+        has_class_definition_ = true;
+    }
+    void Visit(IfElse& node) override {
+        Count(node.Condition().get());
+        Count(node.IfBody().get());
+        Count(node.ElseBody().get());
+    }
+    void Visit(Comparison& node) override {
+        VisitBinary(node);
+    }
+
+private:
+    void VisitUnary(UnaryOperation& node) {
+        Count(node.Argument().get());
+    }
+
+    void VisitBinary(BinaryOperation& node) {
+        Count(node.Lhs().get());
+        Count(node.Rhs().get());
+    }
+
+    void CountAll(vector<unique_ptr<Statement>>& nodes) {
+        for (auto& node : nodes) {
+            Count(node.get());
+        }
+    }
+
+    size_t count_ = 0;
+    bool has_class_definition_ = false;
+};
+
+size_t CountNodes(Statement& node) {
+    return NodeCounter().Count(&node);
+}
+
+// Удаление поддерева, объявляющего класс, оставило бы висячие ссылки на класс
+// в узлах NewInstance и в его классах-наследниках
+bool CanRemove(Statement& node) {
+    NodeCounter counter;
+    counter.Count(&node);
+    return !counter.HasClassDefinition();
+}
+
+bool IsConstant(const Statement& node) {
+    return dynamic_cast<const NumericConst*>(&node) != nullptr
+           || dynamic_cast<const StringConst*>(&node) != nullptr
+           || dynamic_cast<const BoolConst*>(&node) != nullptr
+           || dynamic_cast<const None*>(&node) != nullptr;
+}
+
+// Создаёт узел-константу со значением value либо возвращает nullptr,
+// если значение такого типа не может быть константой
+unique_ptr<Statement> MakeConstant(const runtime::ObjectHolder& value) {
+    switch (value.GetType()) {
+        case runtime::ObjectType::None:
+            return make_unique<None>();
+        case runtime::ObjectType::Number:
+            return make_unique<NumericConst>(runtime::Number(value.AsNumber()));
+        case runtime::ObjectType::String:
+            return make_unique<StringConst>(value.As<runtime::String>());
+        case runtime::ObjectType::Bool:
+            return make_unique<BoolConst>(runtime::Bool(value.AsBool()));
+        default:
+            return nullptr;
+    }
+}
+
+class Optimizer : public Visitor {
+public:
+    // Оптимизирует поддерево node, при необходимости заменяя его корень
+    void Optimize(unique_ptr<Statement>& node) {
+        if (!node) {
+            return;
+        }
+        node->Accept(*this);
+        if (replacement_) {
+            node = move(replacement_);
+        }
+    }
+
+    [[nodiscard]] size_t GetRemovedNodes() const {
+        return removed_nodes_;
+    }
+
+    [[nodiscard]] size_t GetTemporaryValues() const {
+        return temporary_values_;
+    }
+
+    void Visit([[maybe_unused]] NumericConst& node) override {
+    }
+    void Visit([[maybe_unused]] StringConst& node) override {
+    }
+    void Visit([[maybe_unused]] BoolConst& node) override {
+    }
+    void Visit([[maybe_unused]] VariableValue& node) override {
+    }
+    void Visit(Assignment& node) override {
+        Optimize(node.Value());
+    }
+    void Visit(FieldAssignment& node) override {
+        Optimize(node.Value());
+    }
+    void Visit([[maybe_unused]] None& node) override {
+    }
+    void Visit(Print& node) override {
+        OptimizeAll(node.Args());
+    }
+    void Visit(MethodCall& node) override {
+        Optimize(node.Object());
+        OptimizeAll(node.Args());
+    }
+    void Visit(NewInstance& node) override {
+        OptimizeAll(node.Args());
+    }
+    void Visit(Stringify& node) override {
+        VisitUnary(node);
+    }
+    void Visit(Add& node) override {
+        VisitBinary(node);
+        // Результат левого сложения получает только данный узел. Строка не передаётся
+        // в пользовательский код (__add__ вызывается лишь для экземпляров классов), поэтому
+        // строка-слагаемое может не размещаться в куче
+        if (!replacement_ && dynamic_cast<Add*>(node.Lhs().get()) != nullptr) {
+            node.SetTemporaryLhs();
+            ++temporary_values_;
+        }
+    }
+    void Visit(Sub& node) override {
+        VisitBinary(node);
+    }
+    void Visit(Mult& node) override {
+        VisitBinary(node);
+    }
+    void Visit(Div& node) override {
+        VisitBinary(node);
+    }
+
+    void Visit(Or& node) override {
+        VisitLogical(node, true);
+    }
+
+    void Visit(And& node) override {
+        VisitLogical(node, false);
+    }
+
+    void Visit(Not& node) override {
+        VisitUnary(node);
+    }
+
+    void Visit(Compound& node) override {
+        vector<unique_ptr<Statement>> statements;
+        bool reachable = true;
+
+        for (auto& statement : node.Statements()) {
+            if (!reachable) {
+                if (CanRemove(*statement)) {
+                    removed_nodes_ += CountNodes(*statement);
+                } else {
+                    statements.push_back(move(statement));
+                }
+                continue;
+            }
+
+            Optimize(statement);
+            reachable = !AlwaysReturns(*statement);
+
+            // Вложенная составная инструкция (например, тело выбранной ветки if)
+            // заменяется своим содержимым
+            if (auto nested = dynamic_cast<Compound*>(statement.get())) {
+                for (auto& nested_statement : nested->Statements()) {
+                    statements.push_back(move(nested_statement));
+                }
+                ++removed_nodes_;
+            } else {
+                statements.push_back(move(statement));
+            }
+        }
+
+        node.Statements() = move(statements);
+    }
+
+    void Visit(MethodBody& node) override {
+        Optimize(node.Body());
+    }
+
+    void Visit(Return& node) override {
+        Optimize(node.Value());
+    }
+
+    void Visit(ClassDefinition& node) override {
+        for (runtime::Method& method : node.GetClass().Methods()) {
+            if (auto body = dynamic_cast<Statement*>(method.body.get())) {
+                body->Accept(*this);
+            }
+        }
+    }
+
+    void Visit(IfElse& node) override {
+        Optimize(node.Condition());
+        Optimize(node.IfBody());
+        Optimize(node.ElseBody());
+
+        if (!IsConstant(*node.Condition())) {
+            return;
+        }
+
+        auto [taken, skipped] = Evaluate(*node.Condition()) ? tie(node.IfBody(), node.ElseBody())
+                                                            : tie(node.ElseBody(), node.IfBody());
+        if (skipped && !CanRemove(*skipped)) {
+            return;
+        }
+
+        const size_t count = CountNodes(node);
+        auto replacement = taken ? move(taken) : make_unique<Compound>();
+        Replace(count, move(replacement));
+    }
+
+    void Visit(Comparison& node) override {
+        // Результат сравнения, заданного произвольной функцией, не вычисляется заранее
+        Optimize(node.Lhs());
+        Optimize(node.Rhs());
+        if (node.GetOp() && IsConstant(*node.Lhs()) && IsConstant(*node.Rhs())) {
+            Fold(node);
+        }
+    }
+
+private:
+    void OptimizeAll(vector<unique_ptr<Statement>>& nodes) {
+        for (auto& node : nodes) {
+            Optimize(node);
+        }
+    }
+
+    void VisitUnary(UnaryOperation& node) {
+        Optimize(node.Argument());
+        if (IsConstant(*node.Argument())) {
+            Fold(node);
+        }
+    }
+
+    void VisitBinary(BinaryOperation& node) {
+        Optimize(node.Lhs());
+        Optimize(node.Rhs());
+        if (IsConstant(*node.Lhs()) && IsConstant(*node.Rhs())) {
+            Fold(node);
+        }
+    }
+
+    // Операция or (is_or = true) либо and, левый операнд которой - константа, вычисляется
+    // заранее, если её результат не зависит от правого операнда
+    void VisitLogical(BinaryOperation& node, bool is_or) {
+        Optimize(node.Lhs());
+        Optimize(node.Rhs());
+        if (!IsConstant(*node.Lhs())) {
+            return;
+        }
+        if (IsConstant(*node.Rhs()) || Evaluate(*node.Lhs()) == is_or) {
+            Fold(node);
+        }
+    }
+
+    // Заменяет узел node значением, вычисленным во время оптимизации.
+    // Если вычисление завершается ошибкой, ошибка должна возникнуть при выполнении программы,
+    // и узел не изменяется
+    void Fold(Statement& node) {
+        runtime::Closure closure;
+        runtime::DummyContext context;
+        runtime::ObjectHolder value;
+        try {
+            value = node.Execute(closure, context);
+        } catch (const runtime_error&) {
+            return;
+        }
+
+        if (auto constant = MakeConstant(value)) {
+            Replace(CountNodes(node), move(constant));
+        }
+    }
+
+    // Возвращает логическое значение выражения-константы
+    static bool Evaluate(Statement& constant) {
+        runtime::Closure closure;
+        runtime::DummyContext context;
+        return runtime::IsTrue(constant.Execute(closure, context));
+    }
+
+    // Заменяет текущий узел, состоявший из count узлов, на replacement
+    void Replace(size_t count, unique_ptr<Statement> replacement) {
+        removed_nodes_ += count - CountNodes(*replacement);
+        replacement_ = move(replacement);
+    }
+
+    unique_ptr<Statement> replacement_;
+    size_t removed_nodes_ = 0;
+    size_t temporary_values_ = 0;
+};
+
+}  // namespace
+
+bool AlwaysReturns(Statement& node) {
+    if (dynamic_cast<Return*>(&node) != nullptr) {
+        return true;
+    }
+    if (auto body = dynamic_cast<MethodBody*>(&node)) {
+        return AlwaysReturns(*body->Body());
+    }
+    if (auto compound = dynamic_cast<Compound*>(&node)) {
+        const auto& statements = compound->Statements();
+        return !statements.empty() && AlwaysReturns(*statements.back());
+    }
+    if (auto if_else = dynamic_cast<IfElse*>(&node)) {
+        return if_else->ElseBody() && AlwaysReturns(*if_else->IfBody())
+               && AlwaysReturns(*if_else->ElseBody());
+    }
+    return false;
+}
+
+OptimizationStats Optimize(unique_ptr<Statement>& program) {
+    Optimizer optimizer;
+    optimizer.Optimize(program);
+    return {optimizer.GetRemovedNodes(), optimizer.GetTemporaryValues()};
+}
+
+}  // namespace ast
@@ -0,0 +1,28 @@
+#pragma once
+
+#include "statement.h"
+
+#include <memory>
+
+namespace ast {
+
+// Результат оптимизации дерева разбора
+struct OptimizationStats {
+    // Число узлов, удалённых из дерева
+    size_t removed_nodes = 0;
+    // Число промежуточных результатов сложения, не покидающих выражение
+    size_t temporary_values = 0;
+};
+
+// Оптимизирует дерево разбора, полученное от ParseProgram, и тела методов объявленных в нём
+// классов: вычисляет выражения над константами, удаляет инструкции, следующие за return,
+// и заменяет if с константным условием выполняемой веткой. Сложения, левый операнд которых -
+// другое сложение, отмечаются для сборки строки в одном буфере.
+// Поведение программы, включая ошибки времени выполнения, не изменяется
+OptimizationStats Optimize(std::unique_ptr<Statement>& program);
+
+// Возвращает true, если выполнение инструкции (в том числе тела метода) всегда завершается
+// инструкцией return. Используется оптимизатором и выводом типов
+bool AlwaysReturns(Statement& node);
+
+}  // namespace ast
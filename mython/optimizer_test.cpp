@@ -0,0 +1,133 @@
+#include "optimizer.h"
+#include "program_test_utils.h"
+#include "test_runner.h"
+
+using namespace std;
+
+namespace ast {
+
+namespace {
+
+void TestConstantFolding() {
+    const string program = R"(
+x = 2 * 3 + 1
+y = "a" + "b"
+z = -5
+w = x * -1
+print x, y, z, w, not False, True and 0, False or "s", str(12) + str(None), 1 < 2
+)"s;
+
+    auto tree = ParseFromString(program);
+    const string expected = Run(*tree);
+
+    const auto stats = Optimize(tree);
+    ASSERT_EQUAL(Run(*tree), expected);
+    ASSERT(stats.removed_nodes > 0);
+
+    auto& statements = static_cast<Compound&>(*tree).Statements();
+    auto& x = static_cast<Assignment&>(*statements[0]);
+    auto* x_value = dynamic_cast<NumericConst*>(x.Value().get());
+    ASSERT(x_value != nullptr);
+    ASSERT_EQUAL(x_value->GetValue().GetValue(), 7);
+
+    auto& y = static_cast<Assignment&>(*statements[1]);
+    ASSERT(dynamic_cast<StringConst*>(y.Value().get()) != nullptr);
+
+    // Выражение с переменной вычисляется во время выполнения
+    auto& w = static_cast<Assignment&>(*statements[3]);
+    ASSERT(dynamic_cast<Mult*>(w.Value().get()) != nullptr);
+}
+
+void TestErrorsAreNotFolded() {
+    const string program = R"(
+print 1 / 0
+)"s;
+
+    auto tree = ParseFromString(program);
+    ASSERT_EQUAL(Optimize(tree).removed_nodes, 0U);
+    ASSERT_THROWS(Run(*tree), runtime_error);
+}
+
+void TestDeadCodeElimination() {
+    const string program = R"(
+class A:
+  def f():
+    return 1
+    print "dead"
+
+a = A()
+if False:
+  print "no"
+else:
+  print "yes"
+print a.f()
+)"s;
+
+    auto tree = ParseFromString(program);
+    const auto stats = Optimize(tree);
+
+    // print "dead" (2 узла) и if вместе с условием и веткой print "no" (6 узлов)
+    ASSERT_EQUAL(stats.removed_nodes, 8U);
+    ASSERT_EQUAL(Run(*tree), "yes\n1\n"s);
+
+    auto& statements = static_cast<Compound&>(*tree).Statements();
+    ASSERT_EQUAL(statements.size(), 4U);
+    ASSERT(dynamic_cast<Print*>(statements[2].get()) != nullptr);
+}
+
+void TestClassDefinitionsAreKept() {
+    const string program = R"(
+if False:
+  class A:
+    def f():
+      return 1
+a = A()
+print a.f()
+)"s;
+
+    // Узел NewInstance ссылается на класс A, которым владеет объявление класса в ветке if
+    auto tree = ParseFromString(program);
+    ASSERT_EQUAL(Optimize(tree).removed_nodes, 0U);
+    ASSERT_EQUAL(Run(*tree), "1\n"s);
+}
+
+void TestTemporaryStringsAreNotAllocated() {
+    const string program = R"(
+class Money:
+  def __init__(amount):
+    self.amount = amount
+
+  def __add__(other):
+    return self.amount + other
+
+x = 5
+s = "x = " + str(x) + ", y = " + str(x + 1) + "!"
+m = Money(1)
+print s, m + 2 + 3
+print "a" + "b" + x
+)"s;
+
+    auto tree = ParseFromString(program);
+    const auto stats = Optimize(tree);
+    ASSERT_EQUAL(stats.temporary_values, 4U);
+
+    runtime::DummyContext context;
+    runtime::Closure closure;
+    const runtime::AllocationStats before = runtime::GetAllocationStats();
+    ASSERT_THROWS(tree->Execute(closure, context), runtime_error);
+    // Три промежуточные строки при вычислении s не размещаются в куче
+    ASSERT_EQUAL(runtime::GetAllocationStats().avoided_objects - before.avoided_objects, 3U);
+    ASSERT_EQUAL(context.output.str(), "x = 5, y = 6! 6\n"s);
+}
+
+}  // namespace
+
+void RunOptimizerTests(TestRunner& tr) {
+    RUN_TEST(tr, ast::TestConstantFolding);
+    RUN_TEST(tr, ast::TestErrorsAreNotFolded);
+    RUN_TEST(tr, ast::TestDeadCodeElimination);
+    RUN_TEST(tr, ast::TestClassDefinitionsAreKept);
+    RUN_TEST(tr, ast::TestTemporaryStringsAreNotAllocated);
+}
+
+}  // namespace ast
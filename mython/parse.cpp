@@ -3,6 +3,9 @@
 #include "lexer.h"
 #include "statement.h"
 
+#include <unordered_map>
+#include <utility>
+
 using namespace std;
 
 namespace TokenType = parse::token_type;
@@ -76,7 +79,11 @@ private:
             lexer_.ExpectNext<TokenType::Char>(':');
             lexer_.NextToken();
 
+            MethodScope scope(m.formal_params);
+            MethodScope* outer_scope = std::exchange(scope_, &scope);
             m.body = std::make_unique<ast::MethodBody>(ParseSuite());  // NOLINT
+            scope_ = outer_scope;
+            m.frame_size = scope.GetFrameSize();
 
             result.push_back(std::move(m));
         }
@@ -100,7 +107,7 @@ private:
             if (it == declared_classes_.end()) {
                 throw ParseError("Base class "s + name + " not found for class "s + class_name);
             }
-            base_class = static_cast<const runtime::Class*>(it->second.Get());  // NOLINT
+            base_class = static_cast<const runtime::Class*>(it->second.GetHeapObject());  // NOLINT
         }
 
         lexer_.Expect<TokenType::Char>(':');
@@ -121,14 +128,17 @@ private:
             throw ParseError("Class "s + class_name + " already exists"s);
         }
 
+        if (scope_ != nullptr) {
+            return make_unique<ast::ClassDefinition>(it->second, scope_->Resolve(class_name));
+        }
         return make_unique<ast::ClassDefinition>(it->second);
     }
 
-    vector<string> ParseDottedIds() {
-        vector<string> result(1, lexer_.Expect<TokenType::Id>().value);
+    vector<runtime::Symbol> ParseDottedIds() {
+        vector<runtime::Symbol> result(1, lexer_.Expect<TokenType::Id>().value);
 
         while (lexer_.NextToken() == '.') {
-            result.push_back(lexer_.ExpectNext<TokenType::Id>().value);
+            result.emplace_back(lexer_.ExpectNext<TokenType::Id>().value);
         }
 
         return result;
@@ -139,24 +149,29 @@ private:
     unique_ptr<ast::Statement> ParseAssignmentOrCall() {
         lexer_.Expect<TokenType::Id>();
 
-        vector<string> id_list = ParseDottedIds();
-        string last_name = id_list.back();
+        vector<runtime::Symbol> id_list = ParseDottedIds();
+        runtime::Symbol last_name = id_list.back();
         id_list.pop_back();
 
         if (lexer_.CurrentToken() == '=') {
             lexer_.NextToken();
 
             if (id_list.empty()) {
-                return make_unique<ast::Assignment>(std::move(last_name), ParseTest());
+                if (scope_ != nullptr) {
+                    size_t slot = scope_->Resolve(last_name);
+                    return make_unique<ast::Assignment>(last_name, slot, ParseTest());
+                }
+                return make_unique<ast::Assignment>(last_name, ParseTest());
             }
-            return make_unique<ast::FieldAssignment>(ast::VariableValue{std::move(id_list)},
-                                                     std::move(last_name), ParseTest());
+            return make_unique<ast::FieldAssignment>(MakeVariableValue(std::move(id_list)),
+                                                     last_name, ParseTest());
         }
         lexer_.Expect<TokenType::Char>('(');
         lexer_.NextToken();
 
         if (id_list.empty()) {
-            throw ParseError("Mython doesn't support functions, only methods: "s + last_name);
+            throw ParseError("Mython doesn't support functions, only methods: "s
+                             + last_name.GetName());
         }
 
         vector<unique_ptr<ast::Statement>> args;
@@ -166,8 +181,9 @@ private:
         lexer_.Expect<TokenType::Char>(')');
         lexer_.NextToken();
 
-        return make_unique<ast::MethodCall>(make_unique<ast::VariableValue>(std::move(id_list)),
-                                            std::move(last_name), std::move(args));
+        return make_unique<ast::MethodCall>(
+            make_unique<ast::VariableValue>(MakeVariableValue(std::move(id_list))), last_name,
+            std::move(args));
     }
 
     // Expr -> Adder ['+'/'-' Adder]*
@@ -253,7 +269,7 @@ private:
     }
 
     std::unique_ptr<ast::Statement> ParseDottedIdsInMultExpr() {
-        vector<string> names = ParseDottedIds();
+        vector<runtime::Symbol> names = ParseDottedIds();
 
         if (lexer_.CurrentToken() == '(') {
             // various calls
@@ -269,22 +285,31 @@ private:
 
             if (!names.empty()) {
                 return make_unique<ast::MethodCall>(
-                    make_unique<ast::VariableValue>(std::move(names)), std::move(method_name),
-                    std::move(args));
+                    make_unique<ast::VariableValue>(MakeVariableValue(std::move(names))),
+                    method_name, std::move(args));
             }
             if (auto it = declared_classes_.find(method_name); it != declared_classes_.end()) {
                 return make_unique<ast::NewInstance>(
                     static_cast<const runtime::Class&>(*it->second), std::move(args));  // NOLINT
             }
-            if (method_name == "str"sv) {
+            if (method_name.GetName() == "str"sv) {
                 if (args.size() != 1) {
                     throw ParseError("Function str takes exactly one argument"s);
                 }
                 return make_unique<ast::Stringify>(std::move(args.front()));
             }
-            throw ParseError("Unknown call to "s + method_name + "()"s);
+            throw ParseError("Unknown call to "s + method_name.GetName() + "()"s);
+        }
+        return make_unique<ast::VariableValue>(MakeVariableValue(std::move(names)));
+    }
+
+    // Создаёт VariableValue. Внутри метода переменной назначается слот в кадре метода
+    ast::VariableValue MakeVariableValue(vector<runtime::Symbol> dotted_ids) {
+        if (scope_ != nullptr) {
+            size_t slot = scope_->Resolve(dotted_ids.front());
+            return ast::VariableValue(std::move(dotted_ids), slot);
         }
-        return make_unique<ast::VariableValue>(std::move(names));
+        return ast::VariableValue(std::move(dotted_ids));
     }
 
     vector<unique_ptr<ast::Statement>> ParseTestList()  // NOLINT
@@ -365,33 +390,33 @@ private:
 
         if (tok == '<') {
             lexer_.NextToken();
-            return make_unique<ast::Comparison>(runtime::Less, std::move(result),
-                                                ParseExpression());
+            return make_unique<ast::Comparison>(runtime::CompareOp::Less,
+                                                std::move(result), ParseExpression());
         }
         if (tok == '>') {
             lexer_.NextToken();
-            return make_unique<ast::Comparison>(runtime::Greater, std::move(result),
-                                                ParseExpression());
+            return make_unique<ast::Comparison>(runtime::CompareOp::Greater,
+                                                std::move(result), ParseExpression());
         }
         if (tok.Is<TokenType::Eq>()) {
             lexer_.NextToken();
-            return make_unique<ast::Comparison>(runtime::Equal, std::move(result),
-                                                ParseExpression());
+            return make_unique<ast::Comparison>(runtime::CompareOp::Equal,
+                                                std::move(result), ParseExpression());
         }
         if (tok.Is<TokenType::NotEq>()) {
             lexer_.NextToken();
-            return make_unique<ast::Comparison>(runtime::NotEqual, std::move(result),
-                                                ParseExpression());
+            return make_unique<ast::Comparison>(runtime::CompareOp::NotEqual,
+                                                std::move(result), ParseExpression());
         }
         if (tok.Is<TokenType::LessOrEq>()) {
             lexer_.NextToken();
-            return make_unique<ast::Comparison>(runtime::LessOrEqual, std::move(result),
-                                                ParseExpression());
+            return make_unique<ast::Comparison>(runtime::CompareOp::LessOrEqual,
+                                                std::move(result), ParseExpression());
         }
         if (tok.Is<TokenType::GreaterOrEq>()) {
             lexer_.NextToken();
-            return make_unique<ast::Comparison>(runtime::GreaterOrEqual, std::move(result),
-                                                ParseExpression());
+            return make_unique<ast::Comparison>(runtime::CompareOp::GreaterOrEqual,
+                                                std::move(result), ParseExpression());
         }
         return result;
     }
@@ -437,12 +462,46 @@ private:
         return ParseAssignmentOrCall();
     }
 
+    // Слоты переменных метода: self, параметры, затем локальные переменные в порядке
+    // их появления в теле метода
+    class MethodScope {
+    public:
+        explicit MethodScope(const vector<runtime::Symbol>& formal_params) {
+            Resolve("self"sv);
+            for (runtime::Symbol param : formal_params) {
+                // При повторении имени параметра переменная связывается с последним из них
+                slots_[param] = frame_size_++;
+            }
+        }
+
+        // Возвращает слот переменной name, назначая новый при первом упоминании
+        size_t Resolve(runtime::Symbol name) {
+            auto [it, inserted] = slots_.emplace(name, frame_size_);
+            if (inserted) {
+                ++frame_size_;
+            }
+            return it->second;
+        }
+
+        [[nodiscard]] size_t GetFrameSize() const {
+            return frame_size_;
+        }
+
+    private:
+        unordered_map<runtime::Symbol, size_t> slots_;
+        size_t frame_size_ = 0;
+    };
+
     parse::Lexer& lexer_;
     runtime::Closure declared_classes_;
+    // Область видимости разбираемого метода либо nullptr вне методов
+    MethodScope* scope_ = nullptr;
 };
 
 }  // namespace
 
-unique_ptr<runtime::Executable> ParseProgram(parse::Lexer& lexer) {
+unique_ptr<ast::Statement> ParseProgram(parse::Lexer& lexer) {
+    // Узлы программы размещаются в общей арене, которая освобождается вместе с последним из них
+    ast::Arena::Scope arena;
     return Parser{lexer}.ParseProgram();
 }
\ No newline at end of file
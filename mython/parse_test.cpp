@@ -1,3 +1,4 @@
+#include "gc.h"
 #include "lexer.h"
 #include "parse.h"
 #include "statement.h"
@@ -244,6 +245,119 @@ print r, c, t1, t2
                  "Rect(10x20) Circle(52) Triangle(3, 4, 5) Wrong triangle\n"s);
 }
 
+void TestMethodLocals() {
+    const string program = R"(
+class Counter:
+  def __init__():
+    self.value = 0
+
+  def add(n, n):
+    total = self.value + n
+    self.value = total
+    return total
+
+  def nested(depth):
+    local = depth
+    if depth > 0:
+      self.nested(depth - 1)
+    return local
+
+  def unbound():
+    if False:
+      x = 1
+    return x
+
+c = Counter()
+print c.add(1, 2), c.add(3, 4), c.nested(3)
+)"s;
+
+    runtime::DummyContext context;
+
+    runtime::Closure closure;
+    auto tree = ParseProgramFromString(program);
+    tree->Execute(closure, context);
+
+    ASSERT_EQUAL(context.output.str(), "2 6 3\n"s);
+    ASSERT_EQUAL(closure.count("total"s), 0U);
+
+    auto& counter = closure.at("c"s).As<runtime::ClassInstance>();
+    ASSERT_THROWS(counter.Call("unbound"s, {}, context), runtime_error);
+}
+
+void TestNodesOutliveTreeInArena() {
+    const string program = R"(
+class Greeter:
+  def greet(name):
+    return "Hello, " + name + "!"
+
+g = Greeter()
+)"s;
+
+    runtime::DummyContext context;
+    runtime::Closure closure;
+
+    const ast::ArenaStats before = ast::GetArenaStats();
+    auto tree = ParseProgramFromString(program);
+    const ast::ArenaStats& after = ast::GetArenaStats();
+    ASSERT(after.allocations - before.allocations > 5U);
+    ASSERT_EQUAL(after.blocks - before.blocks, 1U);
+
+    tree->Execute(closure, context);
+    tree.reset();
+
+    // Узлы тела метода остаются в арене, пока жив класс
+    auto& greeter = closure.at("g"s).As<runtime::ClassInstance>();
+    const auto name = runtime::ObjectHolder::Own(runtime::String("Mython"s));
+    const auto result = greeter.Call("greet"s, {name}, context);
+    ASSERT_EQUAL(result.As<runtime::String>().GetValue(), "Hello, Mython!"s);
+}
+
+void TestCyclicInstancesOutliveProgram() {
+    if constexpr (!runtime::COLLECT_CYCLES) {
+        return;
+    }
+    const string program = R"(
+class Node:
+  def link(other):
+    self.next = other
+    other.next = self
+
+a = Node()
+a.link(Node())
+b = Node()
+b.link(Node())
+b = None
+)"s;
+
+    const auto class_index = static_cast<size_t>(runtime::ObjectType::Class);
+    const auto instance_index = static_cast<size_t>(runtime::ObjectType::ClassInstance);
+    const runtime::AllocationStats& stats = runtime::GetAllocationStats();
+    auto& collector = runtime::CycleCollector::Instance();
+    collector.Collect();
+    const uint64_t live_classes = stats.live_objects[class_index];
+    const uint64_t live_instances = stats.live_objects[instance_index];
+
+    runtime::DummyContext context;
+    runtime::Closure closure;
+    auto tree = ParseProgramFromString(program);
+    tree->Execute(closure, context);
+    ASSERT_EQUAL(stats.live_objects[instance_index], live_instances + 4);
+
+    // Программа удаляется раньше Closure, в которой остались класс и экземпляры.
+    // Удаление класса освобождает недостижимый цикл, ожидающий сборки
+    tree.reset();
+    closure.erase("Node"s);
+    ASSERT_EQUAL(stats.live_objects[class_index], live_classes);
+    ASSERT_EQUAL(stats.live_objects[instance_index], live_instances + 2);
+    ASSERT_EQUAL(collector.GetCandidateCount(), 0U);
+
+    // Цикл, переживший свой класс, удаляется сборкой без обращения к классу
+    closure.clear();
+    ASSERT(collector.GetCandidateCount() > 0U);
+    ASSERT_EQUAL(collector.Collect(), 2U);
+    ASSERT_EQUAL(stats.live_objects[instance_index], live_instances);
+}
+
 }  // namespace parse
 
 void TestParseProgram(TestRunner& tr) {
@@ -255,4 +369,7 @@ void TestParseProgram(TestRunner& tr) {
     RUN_TEST(tr, parse::TestRecursion2);
     RUN_TEST(tr, parse::TestComplexLogicalExpression);
     RUN_TEST(tr, parse::TestClassicalPolymorphism);
+    RUN_TEST(tr, parse::TestMethodLocals);
+    RUN_TEST(tr, parse::TestNodesOutliveTreeInArena);
+    RUN_TEST(tr, parse::TestCyclicInstancesOutliveProgram);
 }
\ No newline at end of file
@@ -0,0 +1,44 @@
+#pragma once
+
+#include "lexer.h"
+#include "parse.h"
+#include "runtime.h"
+#include "statement.h"
+#include "test_runner.h"
+
+#include <memory>
+#include <sstream>
+#include <string>
+
+// Вспомогательные функции тестов, выполняющих программы Mython, заданные строкой
+
+// Разбирает программу, заданную строкой
+inline std::unique_ptr<ast::Statement> ParseFromString(const std::string& program) {
+    std::istringstream is(program);
+    parse::Lexer lexer(is);
+    return ParseProgram(lexer);
+}
+
+// Выполняет программу и возвращает её вывод
+inline std::string Run(ast::Statement& program) {
+    runtime::DummyContext context;
+    runtime::Closure closure;
+    program.Execute(closure, context);
+    return context.output.str();
+}
+
+// Выполняет программу обходом дерева разбора и исполнителем, который создаёт compile по тексту
+// программы, проверяет, что вывод совпадает, и возвращает его.
+// Исполнитель удаляется раньше closure, поэтому экземпляры классов программы, в том числе
+// образующие циклы, переживают её, как в интерпретаторе, выполняющем несколько программ
+template <typename Compile>
+std::string RunAndCompareWithTree(const std::string& program, Compile compile) {
+    const std::string expected = Run(*ParseFromString(program));
+
+    runtime::DummyContext context;
+    runtime::Closure closure;
+    compile(program)->Execute(closure, context);
+
+    ASSERT_EQUAL(context.output.str(), expected);
+    return context.output.str();
+}
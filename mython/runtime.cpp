@@ -1,27 +1,106 @@
 #include "runtime.h"
 
+#include "gc.h"
+
 #include <algorithm>
 #include <cassert>
+#include <mutex>
 
 using namespace std;
 
 namespace runtime {
 
-const string STR = "__str__"s;
-const string EQ = "__eq__"s;
-const string LT = "__lt__"s;
+namespace {
+const Symbol STR{"__str__"sv};
+const Symbol EQ{"__eq__"sv};
+const Symbol LT{"__lt__"sv};
+const Symbol SELF{"self"sv};
+}  // namespace
+
+AllocationStats& GetAllocationStats() {
+    static AllocationStats stats;
+    return stats;
+}
+
+ObjectHolder ObjectHolder::Adopt(Object* object) noexcept {
+    CycleCollector::Instance().OnAllocation();
+    auto& stats = GetAllocationStats();
+    ++stats.heap_objects;
+    const auto type = static_cast<size_t>(object->GetType());
+    stats.peak_objects[type] = max(stats.peak_objects[type], ++stats.live_objects[type]);
+    object->ref_count_.value = 1;
+    return ObjectHolder(Kind::Heap, object);
+}
 
-ObjectHolder::ObjectHolder(shared_ptr<Object> data)
-    : data_(move(data)) {
+void ObjectHolder::Destroy(Object* object) noexcept {
+    --GetAllocationStats().live_objects[static_cast<size_t>(object->GetType())];
+    if (object->gc_state_.flags != 0) {
+        CycleCollector::Instance().Destroy(object);
+    } else {
+        delete object;
+    }
+}
+
+void ObjectHolder::AddCycleCandidate(Object* object) {
+    CycleCollector::Instance().AddCandidate(object);
 }
 
 void ObjectHolder::AssertIsValid() const {
-    assert(data_ != nullptr);
+    assert(kind_ != Kind::Empty);
 }
 
 ObjectHolder ObjectHolder::Share(Object& object) {
-    // Возвращаем невладеющий shared_ptr (его deleter ничего не делает)
-    return ObjectHolder(shared_ptr<Object>(&object, [](auto* /*p*/) { /* do nothing */ }));
+    if (object.ref_count_.value == 0) {
+        return ObjectHolder(Kind::Shared, &object);
+    }
+
+    ++object.ref_count_.value;
+    return ObjectHolder(Kind::Heap, &object);
+}
+
+Object* ObjectHolder::Box() {
+    ObjectHolder boxed = kind_ == Kind::Number ? Adopt(new Number(value_.number))
+                                               : Adopt(new Bool(value_.boolean));
+    value_ = boxed.value_;
+    kind_ = boxed.kind_;
+    boxed.kind_ = Kind::Empty;
+    return value_.object;
+}
+
+void ObjectHolder::Print(ostream& out, Context& context) const {
+    AssertIsValid();
+
+    switch (kind_) {
+        case Kind::Number:
+            out << value_.number;
+            break;
+        case Kind::Bool:
+            out << (value_.boolean ? "True"sv : "False"sv);
+            break;
+        default:
+            value_.object->Print(out, context);
+            break;
+    }
+}
+
+ObjectHolder::Layout ObjectHolder::GetLayout() noexcept {
+    const ObjectHolder holder;
+    const auto offset = [&holder](const void* field) {
+        return static_cast<size_t>(static_cast<const char*>(field)
+                                   - reinterpret_cast<const char*>(&holder));
+    };
+
+    Layout layout;
+    layout.size = sizeof(ObjectHolder);
+    layout.kind_offset = offset(&holder.kind_);
+    layout.number_offset = offset(&holder.value_.number);
+    layout.bool_offset = offset(&holder.value_.boolean);
+    layout.empty_kind = static_cast<uint8_t>(Kind::Empty);
+    layout.heap_kind = static_cast<uint8_t>(Kind::Heap);
+    layout.shared_kind = static_cast<uint8_t>(Kind::Shared);
+    layout.number_kind = static_cast<uint8_t>(Kind::Number);
+    layout.bool_kind = static_cast<uint8_t>(Kind::Bool);
+    return layout;
 }
 
 ObjectHolder ObjectHolder::None() {
@@ -30,112 +109,338 @@ ObjectHolder ObjectHolder::None() {
 
 Object& ObjectHolder::operator*() const {
     AssertIsValid();
-    
-    return *Get();
+    assert(GetHeapObject() != nullptr);
+
+    return *value_.object;
 }
 
-Object* ObjectHolder::operator->() const {
+ObjectHolder::Arrow::Arrow(int number)
+    : number_{number}, object_{&*number_} {
+}
+
+ObjectHolder::Arrow::Arrow(bool value)
+    : boolean_{value}, object_{&*boolean_} {
+}
+
+ObjectHolder::Arrow ObjectHolder::operator->() const {
     AssertIsValid();
-    
-    return Get();
+
+    switch (kind_) {
+        case Kind::Number:
+            return Arrow(value_.number);
+        case Kind::Bool:
+            return Arrow(value_.boolean);
+        default:
+            return Arrow(value_.object);
+    }
 }
 
-Object* ObjectHolder::Get() const {
-    return data_.get();
+CallStack::Frame::Frame(CallStack& stack, size_t size)
+    : stack_{stack}, prev_base_{stack.frame_base_} {
+    stack_.frame_base_ = stack_.slots_.size();
+    stack_.slots_.resize(stack_.frame_base_ + size);
 }
 
-ObjectHolder::operator bool() const {
-    return Get() != nullptr;
+CallStack::Frame::~Frame() {
+    stack_.slots_.resize(stack_.frame_base_);
+    stack_.frame_base_ = prev_base_;
 }
 
-bool IsTrue(const ObjectHolder& object) {
-    if (auto obj = object.TryAs<Bool>()) {
-        return obj->GetValue() == true;
+StringStats& GetStringStats() {
+    static StringStats stats;
+    return stats;
+}
+
+String::ValueObject(ObjectHolder left, ObjectHolder right)
+    : left_(move(left))
+    , right_(move(right))
+    , size_(left_.As<String>().GetSize() + right_.As<String>().GetSize()) {
+    SetType(ObjectType::String);
+    ++GetStringStats().ropes;
+}
+
+String::~ValueObject() {
+    if (!left_) {
+        return;
     }
+    // Длинная цепочка конкатенаций освобождается без рекурсии: слагаемые, которыми больше
+    // никто не владеет, передают свои слагаемые в очередь до собственного удаления
+    vector<ObjectHolder> pending;
+    pending.push_back(move(left_));
+    pending.push_back(move(right_));
+    while (!pending.empty()) {
+        ObjectHolder holder = move(pending.back());
+        pending.pop_back();
+        if (const auto& str = holder.As<String>(); holder.IsUnique() && str.left_) {
+            pending.push_back(move(str.left_));
+            pending.push_back(move(str.right_));
+        }
+    }
+}
 
-    if (auto obj = object.TryAs<Number>()) {
-        return !(obj->GetValue() == 0);
+void String::Flatten() const {
+    string result;
+    result.reserve(size_);
+    vector<const String*> stack{this};
+    while (!stack.empty()) {
+        const String* str = stack.back();
+        stack.pop_back();
+        if (str->left_) {
+            stack.push_back(&str->right_.As<String>());
+            stack.push_back(&str->left_.As<String>());
+        } else {
+            result += str->value_;
+        }
+    }
+    value_ = move(result);
+    left_ = ObjectHolder();
+    right_ = ObjectHolder();
+    ++GetStringStats().flattened_ropes;
+}
+
+ObjectHolder ConcatenateStrings(const ObjectHolder& lhs, const ObjectHolder& rhs) {
+    const auto& lhs_str = lhs.As<String>();
+    const auto& rhs_str = rhs.As<String>();
+    if (lhs_str.GetSize() + rhs_str.GetSize() < String::MIN_ROPE_SIZE) {
+        return ObjectHolder::Own(String(lhs_str.GetValue() + rhs_str.GetValue()));
     }
+    return ObjectHolder::Own(String(lhs, rhs));
+}
+
+ConstantPoolStats& GetConstantPoolStats() {
+    static ConstantPoolStats stats;
+    return stats;
+}
 
-    if (auto obj = object.TryAs<String>()) {
-        return !(obj->GetValue().empty());
+ObjectHolder InternString(const string& value) {
+    // Строки пула разделяются всеми программами процесса, в том числе выполняемыми в разных
+    // потоках. Пул владеет ими без счётчика ссылок и возвращает невладеющие ObjectHolder,
+    // поэтому обращения к строкам не изменяют их. Пул не удаляется до завершения программы.
+    // Ключи ссылаются на содержимое строк пула, которые не изменяются и не перемещаются
+    static auto* pool = new unordered_map<string_view, unique_ptr<String>>;
+    static mutex pool_mutex;
+    const lock_guard guard{pool_mutex};
+
+    auto& stats = GetConstantPoolStats();
+    if (auto it = pool->find(value); it != pool->end()) {
+        ++stats.reused;
+        return ObjectHolder::Share(*it->second);
     }
+    auto str = make_unique<String>(value);
+    String& result = *str;
+    pool->emplace(result.GetValue(), move(str));
+    ++stats.strings;
+    return ObjectHolder::Share(result);
+}
 
-    return false;
+bool IsTrue(const ObjectHolder& object) {
+    switch (object.GetType()) {
+        case ObjectType::Bool:
+            return object.AsBool();
+        case ObjectType::Number:
+            return object.AsNumber() != 0;
+        case ObjectType::String:
+            return object.As<String>().GetSize() != 0;
+        default:
+            return false;
+    }
 }
 
 void ClassInstance::Print(ostream& out, Context& context) {
     if (HasMethod(STR, 0U)) {
-        Call(STR, {}, context)->Print(out, context);
+        Call(STR, {}, context).Print(out, context);
     } else {
         out << this;
     }
 }
 
-bool ClassInstance::HasMethod(const string& method, size_t argument_count) const {
-    if (auto m = cls_.GetMethod(method)) {
-        if (m->formal_params.size() == argument_count) {
-            return true;
+bool ClassInstance::HasMethod(Symbol method, size_t argument_count) const {
+    return cls_.GetMethod(method, argument_count) != nullptr;
+}
+
+ObjectHolder* ClassInstance::GetField(Symbol name) {
+    if (shape_ != nullptr) {
+        auto index = shape_->FindField(name);
+        return index ? &fields_[*index] : nullptr;
+    }
+    if (!dictionary_) {
+        return nullptr;
+    }
+
+    auto it = dictionary_->find(name);
+    return it != dictionary_->end() ? &it->second : nullptr;
+}
+
+void ClassInstance::SetField(Symbol name, ObjectHolder value) {
+    if (shape_ != nullptr) {
+        if (auto index = shape_->FindField(name)) {
+            fields_[*index] = move(value);
+            return;
+        }
+        if (fields_.size() < Shape::MAX_FIELD_COUNT) {
+            shape_ = shape_->AddField(name);
+            fields_.push_back(move(value));
+            return;
         }
     }
 
-    return false;
+    Fields()[name] = move(value);
 }
 
 Closure& ClassInstance::Fields() {
-    return closure_;
+    if (shape_ != nullptr) {
+        dictionary_ = make_unique<Closure>();
+
+        const auto& names = shape_->GetFieldNames();
+        for (size_t i = 0; i < names.size(); ++i) {
+            dictionary_->emplace(names[i], move(fields_[i]));
+        }
+
+        shape_ = nullptr;
+        fields_.clear();
+        fields_.shrink_to_fit();
+    } else if (!dictionary_) {
+        dictionary_ = make_unique<Closure>();
+    }
+
+    return *dictionary_;
+}
+
+void ClassInstance::ClearFields() noexcept {
+    // Значения полей освобождаются после того, как объект перестаёт на них ссылаться
+    auto fields = move(fields_);
+    auto dictionary = move(dictionary_);
+    fields_.clear();
+    shape_ = nullptr;
 }
 
 const Closure& ClassInstance::Fields() const {
-    return closure_;
+    // Переход к хранению полей в Closure не изменяет наблюдаемого состояния объекта
+    return const_cast<ClassInstance&>(*this).Fields();
+}
+
+ClassInstance::ClassInstance(const Class& cls)
+    : cls_(cls), shape_(&cls.GetRootShape()) {
+    SetType(ObjectType::ClassInstance);
 }
 
-ClassInstance::ClassInstance(const Class& cls) : cls_(cls) {
+Shape::Shape(vector<Symbol> field_names)
+    : field_names_{move(field_names)} {
 }
 
-ObjectHolder ClassInstance::Call(const string& method,
+optional<size_t> Shape::FindField(Symbol name) const {
+    for (size_t i = 0; i < field_names_.size(); ++i) {
+        if (field_names_[i] == name) {
+            return i;
+        }
+    }
+    return nullopt;
+}
+
+const Shape* Shape::AddField(Symbol name) const {
+    auto& next = transitions_[name];
+    if (!next) {
+        vector<Symbol> field_names = field_names_;
+        field_names.push_back(name);
+        next.reset(new Shape(move(field_names)));
+    }
+    return next.get();
+}
+
+ObjectHolder ClassInstance::Call(Symbol method,
     const vector<ObjectHolder>& actual_args,
     Context& context) {
 
-    if (!HasMethod(method, actual_args.size())) {
-        throw runtime_error("No method "s + method +" in class "s + cls_.GetName()
+    auto m = cls_.GetMethod(method, actual_args.size());
+    if (m == nullptr) {
+        throw runtime_error("No method "s + method.GetName() + " in class "s + cls_.GetName()
             + " with "s + to_string(actual_args.size()) + " arguments."s);
     }
 
-    auto m = cls_.GetMethod(method);
+    return Call(*m, actual_args, context);
+}
+
+ObjectHolder ClassInstance::Call(const Method& method,
+    const vector<ObjectHolder>& actual_args,
+    Context& context) {
+    ObjectHolder result = Execute(method, actual_args, context);
+
+    while (auto tail_call = context.TakeTailCall()) {
+        auto& instance = tail_call->instance.As<ClassInstance>();
+        result = instance.Execute(*tail_call->method, tail_call->args, context);
+    }
+    return result;
+}
+
+ObjectHolder ClassInstance::Execute(const Method& method,
+    const vector<ObjectHolder>& actual_args,
+    Context& context) {
+    assert(method.formal_params.size() == actual_args.size());
+    Context::MethodExecution execution(context);
+
+    if (method.frame_size != 0) {
+        CallStack& stack = context.GetCallStack();
+        CallStack::Frame frame(stack, method.frame_size);
+
+        stack.Slot(0) = ObjectHolder::Share(*this);
+        for (size_t i = 0; i < actual_args.size(); ++i) {
+            stack.Slot(i + 1) = actual_args[i];
+        }
+
+        // Переменные метода хранятся в кадре, поэтому Closure остаётся пустым
+        Closure unused;
+        return method.body->Execute(unused, context);
+    }
+
     Closure args;
-    args["self"s] = ObjectHolder::Share(*this);
+    args[SELF] = ObjectHolder::Share(*this);
 
     size_t index = 0;
 
-    for (auto& param : m->formal_params) {
+    for (auto& param : method.formal_params) {
         args[param] = actual_args.at(index++);
     }
 
-    return m->body->Execute(args, context);
+    return method.body->Execute(args, context);
 }
 
 Class::Class(string name, vector<Method> methods, const Class* parent)
-    : name_{move(name)}, methods_{move(methods)}, parent_{parent} {
+    : name_{move(name)}
+    , methods_{move(methods)}
+    , parent_{parent}
+    , root_shape_{make_unique<Shape>()} {
+    SetType(ObjectType::Class);
+    // Среди одноимённых методов класса действует первый, как и при поиске по списку методов
+    for (const Method& m : methods_) {
+        method_table_.emplace(m.name, &m);
+    }
+    if (parent_ != nullptr) {
+        for (const auto& [name, m] : parent_->method_table_) {
+            method_table_.emplace(name, m);
+        }
+    }
 }
 
-const Method* Class::GetMethod(const string& name) const {
-    auto find_by_name = [&name](const Method& m){
-        return m.name == name;
-    };
-
-    if(auto res = find_if(methods_.begin(), methods_.end(), find_by_name);
-            res != methods_.end()) {
-        return &(*res);
-    } else {
-        if (parent_ != nullptr) {
-            return parent_->GetMethod(name);
-        } else {
-            return nullptr;
-        }
+Class::~Class() {
+    // Экземпляры класса могут пережить его в списке кандидатов сборщика. Программа удаляет
+    // классы вместе с деревом разбора, поэтому мусор удаляется здесь, а не при сборке,
+    // которая может начаться уже в следующей программе
+    auto& collector = CycleCollector::Instance();
+    if (collector.GetCandidateCount() != 0) {
+        collector.Collect();
     }
 }
 
+const Method* Class::GetMethod(Symbol name) const {
+    auto it = method_table_.find(name);
+    return it != method_table_.end() ? it->second : nullptr;
+}
+
+const Method* Class::GetMethod(Symbol name, size_t argument_count) const {
+    const Method* m = GetMethod(name);
+    return m != nullptr && m->formal_params.size() == argument_count ? m : nullptr;
+}
+
 [[nodiscard]] const string& Class::GetName() const {
     return name_;
 }
@@ -148,48 +453,105 @@ void Bool::Print(ostream& out, [[maybe_unused]] Context& context) {
     out << (GetValue() ? "True"sv : "False"sv);
 }
 
-bool Equal(const ObjectHolder& lhs, const ObjectHolder& rhs, Context& context) {
-    try {
-        return CompareObjects(lhs, rhs, equal_to());
-    }  catch (runtime_error&) {
-        if (auto l = lhs.TryAs<ClassInstance>()) {
-            return IsTrue(l->Call(EQ, {rhs}, context));
-        }
+namespace {
+
+// Возвращает операцию, результат которой противоположен результату op
+CompareOp Negate(CompareOp op) {
+    switch (op) {
+        case CompareOp::Equal:
+            return CompareOp::NotEqual;
+        case CompareOp::NotEqual:
+            return CompareOp::Equal;
+        case CompareOp::Less:
+            return CompareOp::GreaterOrEqual;
+        case CompareOp::Greater:
+            return CompareOp::LessOrEqual;
+        case CompareOp::LessOrEqual:
+            return CompareOp::Greater;
+        case CompareOp::GreaterOrEqual:
+            return CompareOp::Less;
+    }
+    return op;
+}
 
-        if (!lhs && !rhs) {
-            return true;
-        }
+// Имя метода, реализующего операцию сравнения
+Symbol GetCompareMethodName(CompareOp op) {
+    static const Symbol names[] = {EQ, "__ne__"sv, LT, "__gt__"sv, "__le__"sv, "__ge__"sv};
+    return names[static_cast<size_t>(op)];
+}
+
+bool CompareInstance(CompareOp op, ClassInstance& lhs, const ObjectHolder& rhs,
+                     Context& context) {
+    const Class& cls = lhs.GetClass();
 
-        throw;
+    if (auto m = cls.GetMethod(GetCompareMethodName(op), 1)) {
+        return IsTrue(lhs.Call(*m, {rhs}, context));
+    }
+    if (auto m = cls.GetMethod(GetCompareMethodName(Negate(op)), 1)) {
+        return !IsTrue(lhs.Call(*m, {rhs}, context));
     }
-}
 
-bool Less(const ObjectHolder& lhs, const ObjectHolder& rhs, Context& context) {
-    try {
-        return CompareObjects(lhs, rhs, less());
-    }  catch (runtime_error&) {
-        if (auto l = lhs.TryAs<ClassInstance>()) {
-            return IsTrue(l->Call(LT, {rhs}, context));
-        }
+    switch (op) {
+        case CompareOp::Greater:
+            return !(CompareInstance(CompareOp::Less, lhs, rhs, context)
+                     || CompareInstance(CompareOp::Equal, lhs, rhs, context));
+        case CompareOp::LessOrEqual:
+            return CompareInstance(CompareOp::Less, lhs, rhs, context)
+                   || CompareInstance(CompareOp::Equal, lhs, rhs, context);
+        default:
+            throw runtime_error("Cannot compare objects: no method "s
+                                + GetCompareMethodName(op).GetName() + " in class "s
+                                + cls.GetName());
+    }
+}
 
-        throw;
+}  // namespace
+
+bool Compare(CompareOp op, const ObjectHolder& lhs, const ObjectHolder& rhs, Context& context) {
+    switch (CombineTypes(lhs.GetType(), rhs.GetType())) {
+        case CombineTypes(ObjectType::Number, ObjectType::Number):
+            return ApplyCompareOp(op, lhs.AsNumber(), rhs.AsNumber());
+        case CombineTypes(ObjectType::String, ObjectType::String):
+            return ApplyCompareOp(op, lhs.As<String>().GetValue(), rhs.As<String>().GetValue());
+        case CombineTypes(ObjectType::Bool, ObjectType::Bool):
+            return ApplyCompareOp(op, lhs.AsBool(), rhs.AsBool());
+        case CombineTypes(ObjectType::None, ObjectType::None):
+            if (op == CompareOp::Equal || op == CompareOp::NotEqual) {
+                return op == CompareOp::Equal;
+            }
+            break;
+        default:
+            if (lhs.GetType() == ObjectType::ClassInstance) {
+                return CompareInstance(op, lhs.As<ClassInstance>(), rhs, context);
+            }
+            break;
     }
+
+    throw runtime_error("Cannot compare objects"s);
+}
+
+bool Equal(const ObjectHolder& lhs, const ObjectHolder& rhs, Context& context) {
+    return Compare(CompareOp::Equal, lhs, rhs, context);
+}
+
+bool Less(const ObjectHolder& lhs, const ObjectHolder& rhs, Context& context) {
+    return Compare(CompareOp::Less, lhs, rhs, context);
 }
 
 bool NotEqual(const ObjectHolder& lhs, const ObjectHolder& rhs, Context& context) {
-    return !Equal(lhs, rhs, context);
+    return Compare(CompareOp::NotEqual, lhs, rhs, context);
 }
 
 bool Greater(const ObjectHolder& lhs, const ObjectHolder& rhs, Context& context) {
-    return !(Less(lhs, rhs, context) || Equal(lhs, rhs, context));
+    return Compare(CompareOp::Greater, lhs, rhs, context);
 }
 
 bool LessOrEqual(const ObjectHolder& lhs, const ObjectHolder& rhs, Context& context) {
-    return !Greater(lhs, rhs, context);
+    return Compare(CompareOp::LessOrEqual, lhs, rhs, context);
 }
 
 bool GreaterOrEqual(const ObjectHolder& lhs, const ObjectHolder& rhs, Context& context) {
-    return !Less(lhs, rhs, context);
+    return Compare(CompareOp::GreaterOrEqual, lhs, rhs, context);
 }
 
 }  // namespace runtime
\ No newline at end of file
@@ -1,97 +1,749 @@
 #pragma once
 
+#include "object_pool.h"
+#include "symbol.h"
+
+#include <array>
+#include <atomic>
+#include <cassert>
+#include <cstdint>
 #include <memory>
+#include <optional>
 #include <sstream>
 #include <string>
+#include <string_view>
+#include <type_traits>
 #include <unordered_map>
+#include <utility>
 #include <vector>
 
 namespace runtime {
     
-// Контекст исполнения инструкций Mython
-class Context {
-public:
-    // Возвращает поток вывода для команд print
-    virtual std::ostream& GetOutputStream() = 0;
+class Context;
 
-protected:
-    ~Context() = default;
+// Счётчик ссылок объекта. Атомарный счётчик нужен, только если объекты Mython
+// разделяются между потоками
+#ifdef MYTHON_ATOMIC_REFCOUNT
+using RefCounter = std::atomic<std::uint32_t>;
+#else
+using RefCounter = std::uint32_t;
+#endif
+
+// Сборщик циклов (см. gc.h) изменяет счётчики ссылок и состояние объектов без синхронизации,
+// поэтому объекты, разделяемые между потоками, ему не передаются, и их циклы не собираются
+#ifdef MYTHON_ATOMIC_REFCOUNT
+inline constexpr bool COLLECT_CYCLES = false;
+#else
+inline constexpr bool COLLECT_CYCLES = true;
+#endif
+
+// Тип значения Mython. Хранится в заголовке объекта и позволяет определять тип значения
+// без обращения к RTTI
+enum class ObjectType : std::uint8_t {
+    None,           // значение None (пустой ObjectHolder)
+    Other,          // объекты прочих типов
+    Number,
+    String,
+    Bool,
+    Class,
+    ClassInstance,
 };
 
+// Число значений ObjectType
+inline constexpr std::size_t OBJECT_TYPE_COUNT =
+    static_cast<std::size_t>(ObjectType::ClassInstance) + 1;
+
+// Объединяет типы двух операндов в одно значение, пригодное для использования в switch
+constexpr unsigned CombineTypes(ObjectType lhs, ObjectType rhs) {
+    return (static_cast<unsigned>(lhs) << 8U) | static_cast<unsigned>(rhs);
+}
+
 // Базовый класс для всех объектов языка Mython
 class Object {
 public:
     virtual ~Object() = default;
+
+    // Объекты, создаваемые в куче, размещаются в ObjectPool
+    static void* operator new(std::size_t size) {
+        return ObjectPool::Allocate(size);
+    }
+    static void operator delete(void* ptr, std::size_t size) noexcept {
+        ObjectPool::Deallocate(ptr, size);
+    }
+
     // выводит в out своё представление в виде строки
     virtual void Print(std::ostream& out, Context& context) = 0;
+
+    // Возвращает тип объекта
+    [[nodiscard]] ObjectType GetType() const {
+        return type_;
+    }
+
+protected:
+    Object() = default;
+
+    // Задаёт тип объекта. Вызывается из конструкторов классов-наследников
+    void SetType(ObjectType type) noexcept {
+        type_ = type;
+    }
+
+private:
+    friend class ObjectHolder;
+    friend class CycleCollector;
+
+    // Число ObjectHolder, владеющих объектом. Ноль означает, что объект создан не через
+    // ObjectHolder::Own (например, размещён на стеке), и ссылки на него не подсчитываются.
+    // Копия объекта получает собственный, нулевой счётчик
+    struct RefCount {
+        RefCount() = default;
+        RefCount(const RefCount& /*other*/) noexcept {
+        }
+        RefCount& operator=(const RefCount& /*other*/) noexcept {
+            return *this;
+        }
+
+        RefCounter value = 0;
+    };
+
+    // Состояние объекта в сборщике циклов: цвет и признаки, см. gc.cpp. Ноль - объект
+    // не обрабатывается сборщиком. Копия объекта получает нулевое состояние
+    struct GcState {
+        GcState() = default;
+        GcState(const GcState& /*other*/) noexcept {
+        }
+        GcState& operator=(const GcState& /*other*/) noexcept {
+            return *this;
+        }
+
+        std::uint8_t flags = 0;
+    };
+
+    RefCount ref_count_;
+    ObjectType type_ = ObjectType::Other;
+    GcState gc_state_;
+};
+
+template <typename T>
+class ValueObject;
+// Строковое значение. Определено ниже, после ObjectHolder
+template <>
+class ValueObject<std::string>;
+using String = ValueObject<std::string>;
+// Числовое значение
+using Number = ValueObject<int>;
+
+class Bool;
+class Class;
+class ClassInstance;
+struct Method;
+
+// Тип, соответствующий классу T. Для классов без собственного типа - ObjectType::Other
+template <typename T>
+inline constexpr ObjectType OBJECT_TYPE_OF = ObjectType::Other;
+template <>
+inline constexpr ObjectType OBJECT_TYPE_OF<Number> = ObjectType::Number;
+template <>
+inline constexpr ObjectType OBJECT_TYPE_OF<String> = ObjectType::String;
+template <>
+inline constexpr ObjectType OBJECT_TYPE_OF<Bool> = ObjectType::Bool;
+template <>
+inline constexpr ObjectType OBJECT_TYPE_OF<Class> = ObjectType::Class;
+template <>
+inline constexpr ObjectType OBJECT_TYPE_OF<ClassInstance> = ObjectType::ClassInstance;
+
+// Объект-значение, хранящий значение типа T
+template <typename T>
+class ValueObject : public Object {
+public:
+    ValueObject(T v)  // NOLINT(google-explicit-constructor,hicpp-explicit-conversions)
+        : value_(v) {
+        SetType(OBJECT_TYPE_OF<ValueObject>);
+    }
+
+    void Print(std::ostream& out, [[maybe_unused]] Context& context) override {
+        out << value_;
+    }
+
+    [[nodiscard]] const T& GetValue() const {
+        return value_;
+    }
+
+protected:
+    ValueObject(T v, ObjectType type)
+        : value_(v) {
+        SetType(type);
+    }
+
+private:
+    T value_;
+};
+
+// Логическое значение
+class Bool : public ValueObject<bool> {
+public:
+    Bool(bool v)  // NOLINT(google-explicit-constructor,hicpp-explicit-conversions)
+        : ValueObject<bool>(v, ObjectType::Bool) {
+    }
+
+    void Print(std::ostream& out, Context& context) override;
+};
+
+// Типы, значения которых ObjectHolder хранит непосредственно, без размещения в куче
+template <typename T>
+inline constexpr bool IsImmediate = std::is_same_v<T, Number> || std::is_same_v<T, Bool>;
+
+// Статистика размещения объектов в куче
+struct AllocationStats {
+    // Объекты, размещённые в куче через ObjectHolder::Own
+    std::uint64_t heap_objects = 0;
+    // Промежуточные значения выражений, которые не покидают выражение и поэтому вычислены
+    // без создания объекта в куче
+    std::uint64_t avoided_objects = 0;
+    // Число существующих объектов в куче и наибольшее их число по типам (индекс - ObjectType)
+    std::array<std::uint64_t, OBJECT_TYPE_COUNT> live_objects{};
+    std::array<std::uint64_t, OBJECT_TYPE_COUNT> peak_objects{};
 };
 
-// Специальный класс-обёртка, предназначенный для хранения объекта в Mython-программе
+// Возвращает накопленную статистику размещения объектов
+AllocationStats& GetAllocationStats();
+
+// Специальный класс-обёртка, предназначенный для хранения объекта в Mython-программе.
+// Значения типов Number и Bool хранятся непосредственно внутри ObjectHolder (без размещения
+// в куче), на остальные объекты ObjectHolder ссылается, используя счётчик ссылок в самом объекте.
+// ObjectHolder занимает два машинных слова: указатель либо значение и признак способа хранения
 class ObjectHolder {
 public:
     // Создаёт пустое значение
-    ObjectHolder() = default;
+    ObjectHolder() noexcept;
+
+    ObjectHolder(const ObjectHolder& other);
+    ObjectHolder(ObjectHolder&& other) noexcept;
+    ObjectHolder& operator=(const ObjectHolder& other);
+    ObjectHolder& operator=(ObjectHolder&& other) noexcept;
+
+    ~ObjectHolder();
 
     // Возвращает ObjectHolder, владеющий объектом типа T
     // Тип T - конкретный класс-наследник Object.
-    // object копируется или перемещается в кучу
+    // Number и Bool сохраняются непосредственно в ObjectHolder, остальные объекты
+    // копируются или перемещаются в кучу
     template <typename T>
     [[nodiscard]] static ObjectHolder Own(T&& object) {
-        return ObjectHolder(std::make_shared<T>(std::forward<T>(object)));
+        using Type = std::decay_t<T>;
+
+        if constexpr (IsImmediate<Type>) {
+            return ObjectHolder(Type(object.GetValue()));
+        } else {
+            return Adopt(new Type(std::forward<T>(object)));
+        }
     }
 
-    // Создаёт ObjectHolder, не владеющий объектом (аналог слабой ссылки)
+    // Создаёт ObjectHolder, ссылающийся на object без выделения памяти.
+    // Если объект создан через Own, ссылка владеющая, иначе - невладеющая (аналог слабой ссылки)
     [[nodiscard]] static ObjectHolder Share(Object& object);
     // Создаёт пустой ObjectHolder, соответствующий значению None
     [[nodiscard]] static ObjectHolder None();
 
-    // Возвращает ссылку на Object внутри ObjectHolder.
-    // ObjectHolder должен быть непустым
+    // Результат operator->. Непосредственно хранимое значение копируется во временный объект,
+    // который существует до конца выражения, поэтому обращение к нему не размещает значение
+    // в куче и не изменяет ObjectHolder
+    class Arrow {
+    public:
+        Object* operator->() {
+            return object_;
+        }
+
+    private:
+        friend class ObjectHolder;
+
+        explicit Arrow(Object* object) noexcept
+            : object_{object} {
+        }
+        explicit Arrow(int number);
+        explicit Arrow(bool value);
+
+        Arrow(const Arrow&) = delete;
+        Arrow& operator=(const Arrow&) = delete;
+
+        std::optional<Number> number_;
+        std::optional<Bool> boolean_;
+        Object* object_;
+    };
+
+    // Возвращает ссылку на объект в куче, на который ссылается ObjectHolder.
+    // ObjectHolder должен быть непустым и не хранить число или логическое значение непосредственно
     Object& operator*() const;
 
-    Object* operator->() const;
+    // Позволяет вызывать методы хранимого объекта. ObjectHolder должен быть непустым
+    Arrow operator->() const;
+
+    // Возвращает указатель на объект в куче, на который ссылается ObjectHolder, либо nullptr
+    // для None и непосредственно хранимых значений. Не размещает значений в куче, поэтому
+    // пригоден для сравнения объектов по адресу
+    [[nodiscard]] Object* GetHeapObject() const {
+        return kind_ == Kind::Heap || kind_ == Kind::Shared ? value_.object : nullptr;
+    }
+
+    // Возвращает указатель на хранимый объект. Непосредственно хранимое значение при этом
+    // размещается в куче, и ObjectHolder становится владельцем размещённого объекта, поэтому
+    // Get недоступен у константного ObjectHolder.
+    // Для чтения чисел и логических значений предназначены AsNumber и AsBool
+    [[nodiscard]] Object* Get();
+
+    // Возвращает число, хранимое в ObjectHolder. Тип значения должен быть заранее проверен
+    [[nodiscard]] int AsNumber() const;
+    // Возвращает логическое значение, хранимое в ObjectHolder. Тип значения должен быть
+    // заранее проверен
+    [[nodiscard]] bool AsBool() const;
 
-    [[nodiscard]] Object* Get() const;
+    // Выводит в out представление хранимого значения. ObjectHolder должен быть непустым
+    void Print(std::ostream& out, Context& context) const;
+
+    // Возвращает тип хранимого значения. Для пустого ObjectHolder возвращает ObjectType::None
+    [[nodiscard]] ObjectType GetType() const;
+
+    // Возвращает true, если ObjectHolder - единственный владелец объекта в куче
+    [[nodiscard]] bool IsUnique() const {
+        return kind_ == Kind::Heap && value_.object->ref_count_.value == 1;
+    }
 
     // Возвращает указатель на объект типа T либо nullptr, если внутри ObjectHolder не хранится
-    // объект данного типа
+    // объект данного типа. Для типов значений Mython проверяется только тип в заголовке объекта.
+    // Number и Bool доступны только через неконстантный ObjectHolder, так как их значение
+    // размещается в куче
     template <typename T>
     [[nodiscard]] T* TryAs() const {
-        return dynamic_cast<T*>(this->Get());
+        static_assert(!IsImmediate<T>);
+        if constexpr (OBJECT_TYPE_OF<T> != ObjectType::Other) {
+            return GetType() == OBJECT_TYPE_OF<T> ? static_cast<T*>(value_.object) : nullptr;
+        } else {
+            return dynamic_cast<T*>(GetHeapObject());
+        }
+    }
+    template <typename T>
+    [[nodiscard]] T* TryAs() {
+        if constexpr (IsImmediate<T>) {
+            return GetType() == OBJECT_TYPE_OF<T> ? static_cast<T*>(Get()) : nullptr;
+        } else {
+            return std::as_const(*this).template TryAs<T>();
+        }
+    }
+
+    // Возвращает ссылку на объект типа T. Тип хранимого значения должен быть заранее проверен
+    template <typename T>
+    [[nodiscard]] T& As() const {
+        T* object = TryAs<T>();
+        assert(object != nullptr);
+        return *object;
+    }
+    template <typename T>
+    [[nodiscard]] T& As() {
+        T* object = TryAs<T>();
+        assert(object != nullptr);
+        return *object;
     }
 
     // Возвращает true, если ObjectHolder не пуст
     explicit operator bool() const;
 
+    // Расположение непосредственно хранимых значений в ObjectHolder.
+    // Используется генератором машинного кода для работы с числами без вызова функций
+    struct Layout {
+        std::size_t size = 0;
+        // Смещения признака способа хранения, значения числа и логического значения
+        std::size_t kind_offset = 0;
+        std::size_t number_offset = 0;
+        std::size_t bool_offset = 0;
+        // Значения признака способа хранения
+        std::uint8_t empty_kind = 0;
+        std::uint8_t heap_kind = 0;
+        std::uint8_t shared_kind = 0;
+        std::uint8_t number_kind = 0;
+        std::uint8_t bool_kind = 0;
+    };
+
+    [[nodiscard]] static Layout GetLayout() noexcept;
+
 private:
-    explicit ObjectHolder(std::shared_ptr<Object> data);
+    friend class CycleCollector;
+
+    // Способ хранения значения
+    enum class Kind : std::uint8_t {
+        Empty,   // значение None
+        Heap,    // объект, на который указывает value_.object и которым владеет ObjectHolder
+        Shared,  // объект, на который указывает value_.object, без владения
+        Number,  // число в value_.number
+        Bool,    // логическое значение в value_.boolean
+    };
+
+    // Хранимое значение
+    union Value {
+        Object* object;
+        int number;
+        bool boolean;
+    };
+
+    ObjectHolder(Kind kind, Object* object) noexcept;
+    // Создаёт ObjectHolder, становящийся первым владельцем только что созданного объекта
+    static ObjectHolder Adopt(Object* object) noexcept;
+    explicit ObjectHolder(Number number) noexcept;
+    explicit ObjectHolder(Bool value) noexcept;
     void AssertIsValid() const;
 
-    std::shared_ptr<Object> data_;
+    // Копирует значение other в пустой ObjectHolder
+    void CopyFrom(const ObjectHolder& other);
+    // Переносит значение other в пустой ObjectHolder, оставляя other пустым
+    void MoveFrom(ObjectHolder& other) noexcept;
+    // Делает ObjectHolder пустым. Возвращает объект, владение которым перешло к вызывающему,
+    // либо nullptr
+    Object* ReleaseOwnership() noexcept;
+    // Уменьшает счётчик ссылок объекта, полученного от ReleaseOwnership
+    static void Release(Object* object) noexcept;
+    // Удаляет объект, последняя ссылка на который освобождена
+    static void Destroy(Object* object) noexcept;
+    // Передаёт экземпляр класса сборщику циклов
+    static void AddCycleCandidate(Object* object);
+    // Освобождает значение, оставляя ObjectHolder пустым
+    void Reset() noexcept;
+    // Размещает непосредственно хранимое значение в куче и возвращает указатель на него
+    Object* Box();
+
+    Kind kind_ = Kind::Empty;
+    Value value_{};
 };
 
-// Объект-значение, хранящий значение типа T
-template <typename T>
-class ValueObject : public Object {
+// Операции копирования и проверки типа ObjectHolder выполняются при вычислении каждого
+// выражения, поэтому определены в заголовке
+
+inline ObjectHolder::ObjectHolder() noexcept {
+}
+
+inline ObjectHolder::ObjectHolder(Kind kind, Object* object) noexcept
+    : kind_{kind} {
+    value_.object = object;
+}
+
+inline ObjectHolder::ObjectHolder(Number number) noexcept
+    : kind_{Kind::Number} {
+    value_.number = number.GetValue();
+}
+
+inline ObjectHolder::ObjectHolder(Bool value) noexcept
+    : kind_{Kind::Bool} {
+    value_.boolean = value.GetValue();
+}
+
+inline ObjectHolder::ObjectHolder(const ObjectHolder& other) {
+    CopyFrom(other);
+}
+
+inline ObjectHolder::ObjectHolder(ObjectHolder&& other) noexcept {
+    MoveFrom(other);
+}
+
+inline ObjectHolder& ObjectHolder::operator=(const ObjectHolder& other) {
+    if (this != &other) {
+        // other может принадлежать объекту, которым владеет текущее значение,
+        // поэтому это значение освобождается после копирования
+        Object* old_object = ReleaseOwnership();
+        CopyFrom(other);
+        Release(old_object);
+    }
+    return *this;
+}
+
+inline ObjectHolder& ObjectHolder::operator=(ObjectHolder&& other) noexcept {
+    if (this != &other) {
+        Object* old_object = ReleaseOwnership();
+        MoveFrom(other);
+        Release(old_object);
+    }
+    return *this;
+}
+
+inline ObjectHolder::~ObjectHolder() {
+    Reset();
+}
+
+inline void ObjectHolder::CopyFrom(const ObjectHolder& other) {
+    value_ = other.value_;
+    kind_ = other.kind_;
+    if (kind_ == Kind::Heap) {
+        ++value_.object->ref_count_.value;
+    }
+}
+
+inline void ObjectHolder::MoveFrom(ObjectHolder& other) noexcept {
+    value_ = other.value_;
+    kind_ = other.kind_;
+    other.kind_ = Kind::Empty;
+}
+
+inline Object* ObjectHolder::ReleaseOwnership() noexcept {
+    Object* owned = kind_ == Kind::Heap ? value_.object : nullptr;
+    kind_ = Kind::Empty;
+    return owned;
+}
+
+inline void ObjectHolder::Release(Object* object) noexcept {
+    if (object == nullptr) {
+        return;
+    }
+    if (--object->ref_count_.value == 0) {
+        Destroy(object);
+    } else if (COLLECT_CYCLES && object->type_ == ObjectType::ClassInstance
+               && object->gc_state_.flags == 0) {
+        // Оставшиеся ссылки могут принадлежать циклу, недостижимому из программы
+        AddCycleCandidate(object);
+    }
+}
+
+inline void ObjectHolder::Reset() noexcept {
+    Release(ReleaseOwnership());
+}
+
+inline Object* ObjectHolder::Get() {
+    switch (kind_) {
+        case Kind::Heap:
+        case Kind::Shared:
+            return value_.object;
+        case Kind::Number:
+        case Kind::Bool:
+            return Box();
+        default:
+            return nullptr;
+    }
+}
+
+inline ObjectType ObjectHolder::GetType() const {
+    switch (kind_) {
+        case Kind::Heap:
+        case Kind::Shared:
+            return value_.object->GetType();
+        case Kind::Number:
+            return ObjectType::Number;
+        case Kind::Bool:
+            return ObjectType::Bool;
+        default:
+            return ObjectType::None;
+    }
+}
+
+inline ObjectHolder::operator bool() const {
+    return kind_ != Kind::Empty;
+}
+
+inline int ObjectHolder::AsNumber() const {
+    assert(GetType() == ObjectType::Number);
+    return kind_ == Kind::Number ? value_.number
+                                 : static_cast<const Number*>(value_.object)->GetValue();
+}
+
+inline bool ObjectHolder::AsBool() const {
+    assert(GetType() == ObjectType::Bool);
+    return kind_ == Kind::Bool ? value_.boolean
+                               : static_cast<const Bool*>(value_.object)->GetValue();
+}
+
+// Статистика строк-конкатенаций
+struct StringStats {
+    // Строки, созданные конкатенацией без копирования слагаемых
+    std::uint64_t ropes = 0;
+    // Строки-конкатенации, содержимое которых собрано в непрерывную строку
+    std::uint64_t flattened_ropes = 0;
+};
+
+// Возвращает накопленную статистику строк-конкатенаций
+StringStats& GetStringStats();
+
+// Строковое значение Mython.
+// Результат конкатенации достаточно длинных строк хранится как узел, ссылающийся на обе
+// строки-слагаемые (rope), поэтому накопление строки в цикле s = s + piece не копирует
+// уже накопленную часть. Непрерывная строка собирается при первом обращении к GetValue
+// (вывод, сравнение, преобразование) и сохраняется, а ссылки на слагаемые освобождаются
+template <>
+class ValueObject<std::string> : public Object {
 public:
-    ValueObject(T v)  // NOLINT(google-explicit-constructor,hicpp-explicit-conversions)
-        : value_(v) {
+    // Конкатенации, результат которых короче, копируют содержимое слагаемых сразу
+    static constexpr std::size_t MIN_ROPE_SIZE = 128;
+
+    ValueObject(std::string v)  // NOLINT(google-explicit-constructor,hicpp-explicit-conversions)
+        : value_(std::move(v)), size_(value_.size()) {
+        SetType(ObjectType::String);
     }
 
+    // Создаёт конкатенацию строк left и right, не копируя их содержимое
+    ValueObject(ObjectHolder left, ObjectHolder right);
+
+    ValueObject(const ValueObject& other) = default;
+    ValueObject& operator=(const ValueObject& other) = default;
+
+    ~ValueObject() override;
+
     void Print(std::ostream& out, [[maybe_unused]] Context& context) override {
-        out << value_;
+        out << GetValue();
     }
 
-    [[nodiscard]] const T& GetValue() const {
+    [[nodiscard]] const std::string& GetValue() const {
+        if (left_) {
+            Flatten();
+        }
         return value_;
     }
 
+    // Возвращает длину строки, не собирая конкатенацию
+    [[nodiscard]] std::size_t GetSize() const {
+        return size_;
+    }
+
+    // Возвращает true, если содержимое строки хранится непрерывно
+    [[nodiscard]] bool IsFlat() const {
+        return !left_;
+    }
+
 private:
-    T value_;
+    // Собирает содержимое конкатенации в value_ и освобождает слагаемые
+    void Flatten() const;
+
+    mutable std::string value_;
+    // Слагаемые ещё не собранной конкатенации, иначе - пустые
+    mutable ObjectHolder left_;
+    mutable ObjectHolder right_;
+    std::size_t size_;
 };
 
+// Возвращает конкатенацию строк lhs и rhs
+ObjectHolder ConcatenateStrings(const ObjectHolder& lhs, const ObjectHolder& rhs);
+
+// Статистика пула строковых констант
+struct ConstantPoolStats {
+    // Различные строки в пуле
+    std::uint64_t strings = 0;
+    // Константы, получившие уже имеющуюся в пуле строку
+    std::uint64_t reused = 0;
+};
+
+// Возвращает накопленную статистику пула строковых констант
+ConstantPoolStats& GetConstantPoolStats();
+
+// Возвращает строку-константу с содержимым value из общего для процесса пула. Одинаковые
+// литералы всех программ разделяют один объект String, который не удаляется до завершения
+// программы, и получают невладеющие ObjectHolder без подсчёта ссылок. Числа и логические
+// значения хранятся в ObjectHolder непосредственно и в пуле не нуждаются
+ObjectHolder InternString(const std::string& value);
+
 // Таблица символов, связывающая имя объекта с его значением
-using Closure = std::unordered_map<std::string, ObjectHolder>;
+using Closure = std::unordered_map<Symbol, ObjectHolder>;
+
+// Стек кадров методов, переменным которых при разборе программы назначены номера слотов.
+// Кадры размещаются подряд в одном векторе, память которого переиспользуется между вызовами
+class CallStack {
+public:
+    // Кадр из size пустых слотов, остающийся текущим до своего уничтожения
+    class Frame {
+    public:
+        Frame(CallStack& stack, size_t size);
+        ~Frame();
+
+        Frame(const Frame&) = delete;
+        Frame& operator=(const Frame&) = delete;
+
+    private:
+        CallStack& stack_;
+        size_t prev_base_;
+    };
+
+    // Возвращает слот index текущего кадра. Пустой слот соответствует переменной,
+    // которой ещё не присвоено значение.
+    // Ссылка действительна до создания следующего кадра
+    std::optional<ObjectHolder>& Slot(size_t index) {
+        assert(frame_base_ + index < slots_.size());
+        return slots_[frame_base_ + index];
+    }
+
+private:
+    std::vector<std::optional<ObjectHolder>> slots_;
+    size_t frame_base_ = 0;
+};
+
+// Контекст исполнения инструкций Mython
+class Context {
+public:
+    // Возвращает поток вывода для команд print
+    virtual std::ostream& GetOutputStream() = 0;
+
+    // Возвращает стек кадров вызываемых методов
+    CallStack& GetCallStack() {
+        return call_stack_;
+    }
+
+    // Возвращает true, если выполнена инструкция return, и выполнение текущего метода
+    // должно завершиться
+    [[nodiscard]] bool IsReturning() const {
+        return returning_;
+    }
+
+    void SetReturning(bool returning) {
+        returning_ = returning;
+    }
+
+    // Вызов метода в хвостовой позиции (return obj.method(...)), отложенный до освобождения
+    // кадра вызвавшего его метода
+    struct TailCall {
+        ObjectHolder instance;
+        const Method* method = nullptr;
+        std::vector<ObjectHolder> args;
+    };
+
+    // Возвращает true, если выполняется тело метода, и вызов в хвостовой позиции может быть
+    // отложен. Код верхнего уровня программы выполняет такие вызовы сразу
+    [[nodiscard]] bool CanDeferTailCall() const {
+        return method_depth_ != 0 && !tail_call_;
+    }
+
+    [[nodiscard]] bool HasTailCall() const {
+        return tail_call_.has_value();
+    }
+
+    void DeferTailCall(TailCall call) {
+        tail_call_ = std::move(call);
+    }
+
+    // Возвращает отложенный вызов, если он есть, и удаляет его из контекста
+    std::optional<TailCall> TakeTailCall() {
+        std::optional<TailCall> call = std::move(tail_call_);
+        tail_call_.reset();
+        return call;
+    }
+
+    // Отмечает выполнение тела метода на время своего существования
+    class MethodExecution {
+    public:
+        explicit MethodExecution(Context& context)
+            : context_{context} {
+            ++context_.method_depth_;
+        }
+
+        ~MethodExecution() {
+            --context_.method_depth_;
+        }
+
+        MethodExecution(const MethodExecution&) = delete;
+        MethodExecution& operator=(const MethodExecution&) = delete;
+
+    private:
+        Context& context_;
+    };
+
+protected:
+    ~Context() = default;
+
+private:
+    CallStack call_stack_;
+    bool returning_ = false;
+    size_t method_depth_ = 0;
+    std::optional<TailCall> tail_call_;
+};
 
 // Проверяет, содержится ли в object значение, приводимое к True
 // Для отличных от нуля чисел, True и непустых строк возвращается true. В остальных случаях - false.
@@ -106,27 +758,46 @@ public:
     virtual ObjectHolder Execute(Closure& closure, Context& context) = 0;
 };
 
-// Строковое значение
-using String = ValueObject<std::string>;
-// Числовое значение
-using Number = ValueObject<int>;
-
-// Логическое значение
-class Bool : public ValueObject<bool> {
-public:
-    using ValueObject<bool>::ValueObject;
-
-    void Print(std::ostream& out, Context& context) override;
-};
-
 // Метод класса
 struct Method {
     // Имя метода
-    std::string name;
+    Symbol name;
     // Имена формальных параметров метода
-    std::vector<std::string> formal_params;
+    std::vector<Symbol> formal_params;
     // Тело метода
     std::unique_ptr<Executable> body;
+    // Размер кадра метода: слот 0 занимает self, за ним следуют параметры и локальные переменные.
+    // Ноль означает, что слоты не назначены, и тело метода выполняется над Closure
+    size_t frame_size = 0;
+};
+
+// Форма (скрытый класс) экземпляров класса: упорядоченный список имён полей.
+// Экземпляры одного класса, которым поля присваивались в одинаковом порядке, разделяют форму
+// и хранят значения полей в плотном векторе по индексам, заданным формой
+class Shape {
+public:
+    // Наибольшее число полей формы. Экземпляр с большим числом полей хранит их в Closure
+    static constexpr size_t MAX_FIELD_COUNT = 32;
+
+    Shape() = default;
+
+    // Возвращает индекс поля name либо nullopt, если поля в форме нет
+    [[nodiscard]] std::optional<size_t> FindField(Symbol name) const;
+
+    // Возвращает форму, получаемую из текущей добавлением поля name.
+    // Формы-потомки создаются при первом обращении и принадлежат текущей форме
+    [[nodiscard]] const Shape* AddField(Symbol name) const;
+
+    // Возвращает имена полей в порядке их индексов
+    [[nodiscard]] const std::vector<Symbol>& GetFieldNames() const {
+        return field_names_;
+    }
+
+private:
+    explicit Shape(std::vector<Symbol> field_names);
+
+    std::vector<Symbol> field_names_;
+    mutable std::unordered_map<Symbol, std::unique_ptr<Shape>> transitions_;
 };
 
 // Класс
@@ -136,12 +807,30 @@ public:
     // Если parent равен nullptr, то создаётся базовый класс
     explicit Class(std::string name, std::vector<Method> methods, const Class* parent);
 
+    // Удаляет экземпляры-кандидаты сборщика циклов, ставшие мусором, пока их класс ещё жив
+    ~Class() override;
+
+    Class(Class&& other) = default;
+
     // Возвращает указатель на метод name или nullptr, если метод с таким именем отсутствует
-    [[nodiscard]] const Method* GetMethod(const std::string& name) const;
+    [[nodiscard]] const Method* GetMethod(Symbol name) const;
+    // Возвращает указатель на метод name, принимающий argument_count параметров, или nullptr
+    [[nodiscard]] const Method* GetMethod(Symbol name, size_t argument_count) const;
 
     // Возвращает имя класса
     [[nodiscard]] const std::string& GetName() const;
 
+    // Возвращает методы, объявленные в самом классе. Проходы компиляции могут заменять тела
+    // методов, но не должны изменять состав методов и их сигнатуры
+    [[nodiscard]] std::vector<Method>& Methods() {
+        return methods_;
+    }
+
+    // Возвращает форму экземпляра класса без полей
+    [[nodiscard]] const Shape& GetRootShape() const {
+        return *root_shape_;
+    }
+
     // Выводит в out строку "Class <имя класса>", например "Class cat"
     void Print(std::ostream& out, Context& context) override;
 
@@ -151,6 +840,12 @@ private:
     std::vector<Method> methods_;
 
     const Class* parent_;
+
+    // Методы класса вместе с унаследованными, не переопределёнными в классе.
+    // Строится в конструкторе, поэтому поиск метода не обходит цепочку родителей
+    std::unordered_map<Symbol, const Method*> method_table_;
+
+    std::unique_ptr<Shape> root_shape_;
 };
 
 // Экземпляр класса
@@ -170,26 +865,120 @@ public:
      * Если ни сам класс, ни его родители не содержат метод method, метод выбрасывает исключение
      * runtime_error
      */
-    ObjectHolder Call(const std::string& method, const std::vector<ObjectHolder>& actual_args,
+    ObjectHolder Call(Symbol method, const std::vector<ObjectHolder>& actual_args,
+        Context& context);
+    // Вызывает у объекта заранее найденный метод method класса объекта.
+    // Метод должен принимать actual_args.size() параметров.
+    // Вызовы, отложенные методом в хвостовой позиции, выполняются здесь же после освобождения
+    // его кадра, поэтому хвостовая рекурсия не расходует стек C++
+    ObjectHolder Call(const Method& method, const std::vector<ObjectHolder>& actual_args,
         Context& context);
 
+    // Возвращает класс объекта
+    [[nodiscard]] const Class& GetClass() const {
+        return cls_;
+    }
+
     // Возвращает true, если объект имеет метод method, принимающий argument_count параметров
-    [[nodiscard]] bool HasMethod(const std::string& method, size_t argument_count) const;
+    [[nodiscard]] bool HasMethod(Symbol method, size_t argument_count) const;
 
-    // Возвращает ссылку на Closure, содержащий поля объекта
+    // Возвращает указатель на значение поля name либо nullptr, если поле отсутствует.
+    // Указатель действителен до следующего изменения набора полей объекта
+    [[nodiscard]] ObjectHolder* GetField(Symbol name);
+    // Присваивает полю name значение value, добавляя поле при его отсутствии
+    void SetField(Symbol name, ObjectHolder value);
+
+    // Возвращает форму объекта либо nullptr, если поля объекта хранятся в Closure
+    [[nodiscard]] const Shape* GetShape() const {
+        return shape_;
+    }
+
+    // Возвращает ссылку на Closure, содержащий поля объекта.
+    // После первого обращения объект перестаёт использовать форму и хранит поля в Closure
     [[nodiscard]] Closure& Fields();
     // Возвращает константную ссылку на Closure, содержащую поля объекта
     [[nodiscard]] const Closure& Fields() const;
 
+    // Вызывает f для значения каждого поля, не изменяя способ хранения полей
+    template <typename F>
+    void ForEachField(F&& f) const {
+        if (shape_ != nullptr) {
+            for (const ObjectHolder& value : fields_) {
+                f(value);
+            }
+        } else if (dictionary_) {
+            for (const auto& [name, value] : *dictionary_) {
+                f(value);
+            }
+        }
+    }
+
 private:
+    friend class CycleCollector;
+
+    // Удаляет все поля объекта. Класс объекта к этому моменту может быть уже удалён,
+    // поэтому объект не обращается к нему, а остаётся без формы и без Closure
+    void ClearFields() noexcept;
+
+    // Выполняет тело метода method в новом кадре
+    ObjectHolder Execute(const Method& method, const std::vector<ObjectHolder>& actual_args,
+        Context& context);
+
     const Class& cls_;
-    Closure closure_;
+    const Shape* shape_;
+    // Значения полей в порядке, заданном формой shape_
+    std::vector<ObjectHolder> fields_;
+    // Поля объекта без формы. Пуст у объекта, поля которого удалены ClearFields
+    std::unique_ptr<Closure> dictionary_;
+};
+
+// Операция сравнения
+enum class CompareOp : std::uint8_t {
+    Equal,
+    NotEqual,
+    Less,
+    Greater,
+    LessOrEqual,
+    GreaterOrEqual,
 };
 
+// Применяет операцию op к значениям одного типа, для которого определены операторы сравнения
+template <typename T>
+bool ApplyCompareOp(CompareOp op, const T& lhs, const T& rhs) {
+    switch (op) {
+        case CompareOp::Equal:
+            return lhs == rhs;
+        case CompareOp::NotEqual:
+            return lhs != rhs;
+        case CompareOp::Less:
+            return lhs < rhs;
+        case CompareOp::Greater:
+            return lhs > rhs;
+        case CompareOp::LessOrEqual:
+            return lhs <= rhs;
+        case CompareOp::GreaterOrEqual:
+            return lhs >= rhs;
+    }
+    return false;
+}
+
+/*
+ * Возвращает результат сравнения lhs op rhs.
+ * Числа, строки и значения Bool сравниваются между собой без исключений и вызовов методов.
+ * Значения None равны друг другу.
+ * Если lhs - объект, сравнение выполняет не более одного вызова метода lhs:
+ * метода операции (__eq__, __ne__, __lt__, __gt__, __le__, __ge__) либо метода противоположной
+ * операции с инверсией результата. Если у объекта нет ни того ни другого, операции >
+ * и <= вычисляются через __lt__ и __eq__.
+ * В остальных случаях функция выбрасывает исключение runtime_error.
+ */
+bool Compare(CompareOp op, const ObjectHolder& lhs, const ObjectHolder& rhs, Context& context);
+
 /*
  * Возвращает true, если lhs и rhs содержат одинаковые числа, строки или значения типа Bool.
  * Если lhs - объект с методом __eq__, функция возвращает результат вызова lhs.__eq__(rhs),
- * приведённый к типу Bool. Если lhs и rhs имеют значение None, функция возвращает true.
+ * приведённый к типу Bool, а при отсутствии __eq__ - инвертированный результат lhs.__ne__(rhs).
+ * Если lhs и rhs имеют значение None, функция возвращает true.
  * В остальных случаях функция выбрасывает исключение runtime_error.
  *
  * Параметр context задаёт контекст для выполнения метода __eq__
@@ -200,18 +989,21 @@ bool Equal(const ObjectHolder& lhs, const ObjectHolder& rhs, Context& context);
  * Если lhs и rhs - числа, строки или значения bool, функция возвращает результат их сравнения
  * оператором <.
  * Если lhs - объект с методом __lt__, возвращает результат вызова lhs.__lt__(rhs),
- * приведённый к типу bool. В остальных случаях функция выбрасывает исключение runtime_error.
+ * приведённый к типу bool, а при отсутствии __lt__ - инвертированный результат lhs.__ge__(rhs).
+ * В остальных случаях функция выбрасывает исключение runtime_error.
  *
  * Параметр context задаёт контекст для выполнения метода __lt__
  */
 bool Less(const ObjectHolder& lhs, const ObjectHolder& rhs, Context& context);
-// Возвращает значение, противоположное Equal(lhs, rhs, context)
+// Возвращает значение lhs!=rhs. Для объектов вызывает __ne__ либо инвертирует результат Equal
 bool NotEqual(const ObjectHolder& lhs, const ObjectHolder& rhs, Context& context);
-// Возвращает значение lhs>rhs, используя функции Equal и Less
+// Возвращает значение lhs>rhs. Для объектов вызывает __gt__ либо инвертирует результат __le__,
+// а при отсутствии обоих методов использует Less и Equal
 bool Greater(const ObjectHolder& lhs, const ObjectHolder& rhs, Context& context);
-// Возвращает значение lhs<=rhs, используя функции Equal и Less
+// Возвращает значение lhs<=rhs. Для объектов вызывает __le__ либо инвертирует результат __gt__,
+// а при отсутствии обоих методов использует Less и Equal
 bool LessOrEqual(const ObjectHolder& lhs, const ObjectHolder& rhs, Context& context);
-// Возвращает значение, противоположное Less(lhs, rhs, context)
+// Возвращает значение lhs>=rhs. Для объектов вызывает __ge__ либо инвертирует результат Less
 bool GreaterOrEqual(const ObjectHolder& lhs, const ObjectHolder& rhs, Context& context);
 
 // Контекст-заглушка, применяется в тестах.
@@ -238,24 +1030,5 @@ public:
 private:
     std::ostream& output_;
 };
-    
-template <typename Pred>
-bool CompareObjects(const runtime::ObjectHolder& lhs, const runtime::ObjectHolder& rhs, Pred predicate) {
-    using namespace std::literals;
-    
-    if (lhs.TryAs<runtime::Bool>() && rhs.TryAs<runtime::Bool>()) {
-        return predicate(lhs.TryAs<runtime::Bool>()->GetValue(), rhs.TryAs<runtime::Bool>()->GetValue());
-    }
-
-    if (lhs.TryAs<runtime::Number>() && rhs.TryAs<runtime::Number>()) {
-        return predicate(lhs.TryAs<runtime::Number>()->GetValue(), rhs.TryAs<runtime::Number>()->GetValue());
-    }
-
-    if (lhs.TryAs<runtime::String>() && rhs.TryAs<runtime::String>()) {
-        return predicate(lhs.TryAs<runtime::String>()->GetValue(), rhs.TryAs<runtime::String>()->GetValue());
-    }
-    
-    throw std::runtime_error("Cannot compare objects"s);
-}
 
 }  // namespace runtime
\ No newline at end of file
@@ -1,7 +1,9 @@
+#include "gc.h"
 #include "runtime.h"
 #include "test_runner.h"
 
 #include <functional>
+#include <thread>
 
 using namespace std;
 
@@ -242,12 +244,234 @@ void TestMove() {
     }
 }
 
+void TestShareOwned() {
+    ASSERT_EQUAL(Logger::instance_count, 0);
+    {
+        auto owner = ObjectHolder::Own(Logger(5));
+        auto shared = ObjectHolder::Share(*owner);
+        ASSERT(shared.Get() == owner.Get());
+
+        owner = ObjectHolder::None();
+        ASSERT_EQUAL(Logger::instance_count, 1);
+        ASSERT(shared.TryAs<Logger>()->GetId() == 5);
+    }
+    ASSERT_EQUAL(Logger::instance_count, 0);
+}
+
 void TestNullptr() {
     ObjectHolder oh;
     ASSERT(!oh);
     ASSERT(!oh.Get());
 }
 
+void TestImmediates() {
+    auto num = ObjectHolder::Own(Number{42});
+    auto flag = ObjectHolder::Own(Bool{true});
+    ASSERT(num && flag);
+    ASSERT(num.TryAs<Number>() != nullptr && num.TryAs<Number>()->GetValue() == 42);
+    ASSERT(flag.TryAs<Bool>() != nullptr && flag.TryAs<Bool>()->GetValue());
+    ASSERT(num.TryAs<Bool>() == nullptr);
+    ASSERT(flag.TryAs<Number>() == nullptr);
+    ASSERT(num.TryAs<String>() == nullptr);
+
+    ASSERT_EQUAL(sizeof(ObjectHolder), 2 * sizeof(void*));
+    ObjectHolder value = ObjectHolder::Own(Number{7});
+    ObjectHolder copy = value;
+    ASSERT_EQUAL(copy.AsNumber(), 7);
+    // Копии, сделанные до размещения значения в куче, размещают собственные объекты
+    ASSERT(copy.Get() != value.Get());
+    copy = num;
+    ASSERT(copy.Get() == num.Get());
+    ASSERT_EQUAL(copy.TryAs<Number>()->GetValue(), 42);
+
+    ObjectHolder moved = std::move(flag);
+    ASSERT(!flag);  // NOLINT
+    ASSERT(moved.TryAs<Bool>()->GetValue());
+
+    moved = copy;
+    ASSERT_EQUAL(moved.TryAs<Number>()->GetValue(), 42);
+    copy = ObjectHolder::Own(String{"str"s});
+    ASSERT_EQUAL(copy.TryAs<String>()->GetValue(), "str"s);
+
+    DummyContext context;
+    num->Print(context.output, context);
+    ASSERT_EQUAL(context.output.str(), "42"s);
+
+    // Обращение через константный ObjectHolder не размещает значение в куче
+    const uint64_t heap_objects = GetAllocationStats().heap_objects;
+    const ObjectHolder& constant = ObjectHolder::Own(Number{5});
+    constant->Print(context.output, context);
+    ASSERT_EQUAL(context.output.str(), "425"s);
+    ASSERT(constant.GetHeapObject() == nullptr);
+    ASSERT_EQUAL(GetAllocationStats().heap_objects, heap_objects);
+}
+
+void TestLiveObjectCounts() {
+    const auto string_index = static_cast<size_t>(ObjectType::String);
+    const AllocationStats& stats = GetAllocationStats();
+    const uint64_t live = stats.live_objects[string_index];
+    {
+        vector<ObjectHolder> strings;
+        for (int i = 0; i < 3; ++i) {
+            strings.push_back(ObjectHolder::Own(String{"s"s}));
+        }
+        ObjectHolder shared = strings.front();
+        ASSERT_EQUAL(stats.live_objects[string_index], live + 3);
+        ASSERT(stats.peak_objects[string_index] >= live + 3);
+
+        // Числа не размещаются в куче
+        ObjectHolder number = ObjectHolder::Own(Number{1});
+        ASSERT_EQUAL(stats.live_objects[static_cast<size_t>(ObjectType::Number)], 0U);
+    }
+    ASSERT_EQUAL(stats.live_objects[string_index], live);
+
+    // Освобождённая ячейка пула используется повторно
+    const ObjectPoolStats pool_before = GetObjectPoolStats();
+    for (int i = 0; i < 1000; ++i) {
+        ObjectHolder str = ObjectHolder::Own(String{"temporary"s});
+    }
+    ASSERT(GetObjectPoolStats().slabs - pool_before.slabs <= 1U);
+}
+
+void TestRopeStrings() {
+    const string piece(String::MIN_ROPE_SIZE, 'x');
+    const StringStats before = GetStringStats();
+
+    // Короткие строки складываются копированием
+    ObjectHolder short_str = ConcatenateStrings(ObjectHolder::Own(String{"ab"s}),
+                                                ObjectHolder::Own(String{"c"s}));
+    ASSERT(short_str.TryAs<String>()->IsFlat());
+    ASSERT_EQUAL(short_str.TryAs<String>()->GetValue(), "abc"s);
+
+    ObjectHolder str = ObjectHolder::Own(String{piece});
+    ObjectHolder middle;
+    const size_t count = 100'000;
+    for (size_t i = 1; i < count; ++i) {
+        str = ConcatenateStrings(str, i % 2 == 0 ? ObjectHolder::Own(String{piece}) : short_str);
+        if (i == count / 2) {
+            middle = str;
+        }
+    }
+    const auto& rope = *str.TryAs<String>();
+    ASSERT(!rope.IsFlat());
+    ASSERT_EQUAL(GetStringStats().ropes, before.ropes + count - 1);
+    ASSERT_EQUAL(rope.GetSize(), count / 2 * (piece.size() + 3));
+    ASSERT(IsTrue(str));
+    ASSERT(!rope.IsFlat());
+
+    ASSERT_EQUAL(rope.GetValue().size(), rope.GetSize());
+    ASSERT(rope.IsFlat());
+    ASSERT_EQUAL(GetStringStats().flattened_ropes, before.flattened_ropes + 1);
+    ASSERT_EQUAL(rope.GetValue().substr(0, piece.size() + 6), piece + "abc"s + "xxx"s);
+
+    // Освобождение длинной цепочки не переполняет стек, общая часть цепочки сохраняется
+    str = {};
+    const auto& middle_str = *middle.TryAs<String>();
+    ASSERT(!middle_str.IsFlat());
+    ASSERT_EQUAL(middle_str.GetValue().size(), middle_str.GetSize());
+    middle = {};
+}
+
+void TestCycleCollector() {
+    if constexpr (!COLLECT_CYCLES) {
+        return;
+    }
+    Class cls{"Node"s, {}, nullptr};
+    const auto instance_index = static_cast<size_t>(ObjectType::ClassInstance);
+    const AllocationStats& stats = GetAllocationStats();
+    CycleCollector& collector = CycleCollector::Instance();
+    collector.SetThreshold(0);
+    collector.Collect();
+    const uint64_t live = stats.live_objects[instance_index];
+    const uint64_t freed = collector.GetStats().freed_objects;
+
+    ObjectHolder survivor;
+    {
+        // Два объекта, ссылающиеся друг на друга, и объект, ссылающийся на себя
+        ObjectHolder a = ObjectHolder::Own(ClassInstance{cls});
+        ObjectHolder b = ObjectHolder::Own(ClassInstance{cls});
+        a.TryAs<ClassInstance>()->SetField("next"s, b);
+        b.TryAs<ClassInstance>()->Fields()["prev"s] = a;
+        a.TryAs<ClassInstance>()->SetField("name"s, ObjectHolder::Own(String{"a"s}));
+        ObjectHolder self = ObjectHolder::Own(ClassInstance{cls});
+        self.TryAs<ClassInstance>()->SetField("self"s, self);
+
+        // Цикл, на который ссылается переменная, достижим
+        ObjectHolder c = ObjectHolder::Own(ClassInstance{cls});
+        ObjectHolder d = ObjectHolder::Own(ClassInstance{cls});
+        c.TryAs<ClassInstance>()->SetField("next"s, d);
+        d.TryAs<ClassInstance>()->SetField("next"s, c);
+        d.TryAs<ClassInstance>()->SetField("value"s, ObjectHolder::Own(Number{42}));
+        survivor = c;
+    }
+    ASSERT_EQUAL(stats.live_objects[instance_index], live + 5);
+    ASSERT(collector.GetCandidateCount() > 0U);
+
+    ASSERT_EQUAL(collector.Collect(), 3U);
+    ASSERT_EQUAL(collector.GetStats().freed_objects, freed + 3);
+    ASSERT_EQUAL(stats.live_objects[instance_index], live + 2);
+    ASSERT_EQUAL(collector.GetCandidateCount(), 0U);
+
+    // Поля достижимого цикла сохранились
+    const ObjectHolder& next = survivor.TryAs<ClassInstance>()->Fields().at("next"s);
+    ASSERT(next.TryAs<ClassInstance>()->Fields().at("next"s).Get() == survivor.Get());
+    ASSERT_EQUAL(next.TryAs<ClassInstance>()->Fields().at("value"s).AsNumber(), 42);
+
+    survivor = {};
+    collector.Collect();
+    ASSERT_EQUAL(stats.live_objects[instance_index], live);
+    collector.SetThreshold(CycleCollector::DEFAULT_THRESHOLD);
+}
+
+void TestCycleCollectorPerThread() {
+    if constexpr (!COLLECT_CYCLES) {
+        return;
+    }
+    Class cls{"Node"s, {}, nullptr};
+    CycleCollector& collector = CycleCollector::Instance();
+    collector.Collect();
+
+    // Кандидаты, освобождённые в другом потоке, попадают в сборщик этого потока
+    size_t thread_candidates = 0;
+    uint64_t thread_freed = 0;
+    thread worker([&] {
+        {
+            ObjectHolder a = ObjectHolder::Own(ClassInstance{cls});
+            ObjectHolder b = ObjectHolder::Own(ClassInstance{cls});
+            a.TryAs<ClassInstance>()->SetField("next"s, b);
+            b.TryAs<ClassInstance>()->SetField("next"s, a);
+        }
+        CycleCollector& thread_collector = CycleCollector::Instance();
+        thread_candidates = thread_collector.GetCandidateCount();
+        thread_freed = thread_collector.Collect();
+    });
+    worker.join();
+
+    ASSERT(thread_candidates > 0U);
+    ASSERT_EQUAL(thread_freed, 2U);
+    ASSERT_EQUAL(collector.GetCandidateCount(), 0U);
+}
+
+void TestObjectTypes() {
+    Class cls{"Test"s, {}, nullptr};
+    Logger logger;
+
+    ASSERT(ObjectHolder::None().GetType() == ObjectType::None);
+    ASSERT(ObjectHolder::Own(Number{1}).GetType() == ObjectType::Number);
+    ASSERT(ObjectHolder::Own(Bool{false}).GetType() == ObjectType::Bool);
+    ASSERT(ObjectHolder::Own(String{"s"s}).GetType() == ObjectType::String);
+    ASSERT(ObjectHolder::Share(cls).GetType() == ObjectType::Class);
+    ASSERT(ObjectHolder::Own(ClassInstance{cls}).GetType() == ObjectType::ClassInstance);
+    ASSERT(ObjectHolder::Share(logger).GetType() == ObjectType::Other);
+
+    auto instance = ObjectHolder::Own(ClassInstance{cls});
+    ASSERT(instance.TryAs<ClassInstance>() != nullptr);
+    ASSERT(instance.TryAs<Class>() == nullptr);
+    ASSERT(ObjectHolder::Share(cls).TryAs<Class>() == &cls);
+    ASSERT(ObjectHolder::Share(logger).TryAs<Logger>() == &logger);
+    ASSERT(ObjectHolder::Share(logger).TryAs<Number>() == nullptr);
+}
+
 void TestIsTrue() {
     {
         ASSERT(!IsTrue(ObjectHolder::Own(Bool{false})));
@@ -474,6 +698,44 @@ void TestComparison() {
     }
 }
 
+void TestComparisonMethods() {
+    vector<string> calls;
+    auto make_method = [&calls](string name, bool result) {
+        auto body = [&calls, name, result](Closure& closure, [[maybe_unused]] Context& ctx) {
+            ASSERT(closure.count("rhs"s) != 0);
+            calls.push_back(name);
+            return ObjectHolder::Own(Bool{result});
+        };
+        return Method{name, {"rhs"s}, make_unique<TestMethodBody>(body)};
+    };
+
+    vector<Method> methods;
+    methods.push_back(make_method("__ne__"s, true));
+    methods.push_back(make_method("__gt__"s, true));
+    methods.push_back(make_method("__ge__"s, false));
+    Class cls{"Ordered"s, move(methods), nullptr};
+    ClassInstance instance{cls};
+    auto lhs = ObjectHolder::Share(instance);
+    auto rhs = ObjectHolder::Own(Number{1});
+
+    DummyContext ctx;
+    auto check = [&](CompareOp op, bool expected, const string& method) {
+        calls.clear();
+        ASSERT_EQUAL(Compare(op, lhs, rhs, ctx), expected);
+        ASSERT_EQUAL(calls, vector<string>{method});
+    };
+
+    check(CompareOp::NotEqual, true, "__ne__"s);
+    check(CompareOp::Equal, false, "__ne__"s);
+    check(CompareOp::Greater, true, "__gt__"s);
+    check(CompareOp::LessOrEqual, false, "__gt__"s);
+    check(CompareOp::GreaterOrEqual, false, "__ge__"s);
+    check(CompareOp::Less, true, "__ge__"s);
+
+    ASSERT_THROWS(Compare(CompareOp::Less, rhs, lhs, ctx), runtime_error);
+    ASSERT_THROWS(Compare(CompareOp::Equal, rhs, ObjectHolder::None(), ctx), runtime_error);
+}
+
 void TestClass() {
     vector<Method> methods;
     Closure* passed_closure = nullptr;
@@ -504,6 +766,33 @@ void TestClass() {
     ASSERT_EQUAL(out.str(), "Class Test"s);
 }
 
+void TestInheritedMethods() {
+    auto make_method = [](string name, vector<Symbol> params) {
+        return Method{move(name), move(params), make_unique<TestMethodBody>(
+            []([[maybe_unused]] Closure& closure, [[maybe_unused]] Context& ctx) {
+                return ObjectHolder::None();
+            })};
+    };
+
+    vector<Method> base_methods;
+    base_methods.push_back(make_method("area"s, {}));
+    base_methods.push_back(make_method("name"s, {}));
+    Class base{"Shape"s, move(base_methods), nullptr};
+
+    vector<Method> rect_methods;
+    rect_methods.push_back(make_method("area"s, {"scale"s}));
+    Class rect{"Rect"s, move(rect_methods), &base};
+
+    Class square{"Square"s, {}, &rect};
+
+    ASSERT_EQUAL(square.GetMethod("name"s), base.GetMethod("name"s));
+    ASSERT_EQUAL(square.GetMethod("area"s), rect.GetMethod("area"s));
+    ASSERT_EQUAL(square.GetMethod("area"s, 1), rect.GetMethod("area"s));
+    ASSERT_EQUAL(square.GetMethod("area"s, 0), nullptr);
+    ASSERT_EQUAL(base.GetMethod("area"s, 1), nullptr);
+    ASSERT_EQUAL(square.GetMethod("missing"s), nullptr);
+}
+
 void TestClassInstance() {
     vector<Method> methods;
 
@@ -529,6 +818,56 @@ void TestClassInstance() {
     ASSERT_THROWS(instance.Call("missing_method"s, {}, ctx), runtime_error);
 }
 
+void TestShapes() {
+    Class cls{"Point"s, {}, nullptr};
+    ClassInstance p1{cls};
+    ClassInstance p2{cls};
+    ClassInstance p3{cls};
+
+    ASSERT_EQUAL(p1.GetShape(), &cls.GetRootShape());
+    ASSERT(p1.GetField("x"s) == nullptr);
+
+    p1.SetField("x"s, ObjectHolder::Own(Number{1}));
+    p1.SetField("y"s, ObjectHolder::Own(Number{2}));
+    p2.SetField("x"s, ObjectHolder::Own(Number{3}));
+    p2.SetField("y"s, ObjectHolder::Own(Number{4}));
+    p3.SetField("y"s, ObjectHolder::Own(Number{5}));
+    p3.SetField("x"s, ObjectHolder::Own(Number{6}));
+
+    ASSERT_EQUAL(p1.GetShape(), p2.GetShape());
+    ASSERT(p1.GetShape() != p3.GetShape());
+    ASSERT_EQUAL(p2.GetField("y"s)->As<Number>().GetValue(), 4);
+    ASSERT_EQUAL(p3.GetField("x"s)->As<Number>().GetValue(), 6);
+
+    p1.SetField("x"s, ObjectHolder::Own(Number{7}));
+    ASSERT_EQUAL(p1.GetShape(), p2.GetShape());
+
+    // Обращение к Fields() переводит объект к хранению полей в Closure
+    Closure& fields = p1.Fields();
+    ASSERT(p1.GetShape() == nullptr);
+    ASSERT_EQUAL(fields.size(), 2U);
+    ASSERT_EQUAL(fields.at("x"s).As<Number>().GetValue(), 7);
+
+    fields["z"s] = ObjectHolder::Own(Number{8});
+    ASSERT_EQUAL(p1.GetField("z"s)->As<Number>().GetValue(), 8);
+    p1.SetField("y"s, ObjectHolder::None());
+    ASSERT(!fields.at("y"s));
+}
+
+void TestSymbols() {
+    Symbol x{"x"s};
+    ASSERT(x == Symbol{"x"sv});
+    ASSERT(x != Symbol{"y"s});
+    ASSERT_EQUAL(x.GetId(), Symbol{"x"}.GetId());
+    ASSERT_EQUAL(x.GetName(), "x"s);
+    ASSERT_EQUAL(Symbol{}.GetName(), ""s);
+
+    Closure closure;
+    closure["x"s] = ObjectHolder::Own(Number{1});
+    ASSERT_EQUAL(closure.count(x), 1U);
+    ASSERT_EQUAL(closure.count("y"s), 0U);
+}
+
 }  // namespace
 
 void RunObjectsTests(TestRunner& tr) {
@@ -538,15 +877,26 @@ void RunObjectsTests(TestRunner& tr) {
     RUN_TEST(tr, runtime::TestMethodInvocation);
     RUN_TEST(tr, runtime::TestIsTrue);
     RUN_TEST(tr, runtime::TestComparison);
+    RUN_TEST(tr, runtime::TestComparisonMethods);
     RUN_TEST(tr, runtime::TestClass);
+    RUN_TEST(tr, runtime::TestInheritedMethods);
     RUN_TEST(tr, runtime::TestClassInstance);
+    RUN_TEST(tr, runtime::TestShapes);
+    RUN_TEST(tr, runtime::TestSymbols);
 }
 
 void RunObjectHolderTests(TestRunner& tr) {
     RUN_TEST(tr, runtime::TestNonowning);
     RUN_TEST(tr, runtime::TestOwning);
     RUN_TEST(tr, runtime::TestMove);
+    RUN_TEST(tr, runtime::TestShareOwned);
     RUN_TEST(tr, runtime::TestNullptr);
+    RUN_TEST(tr, runtime::TestImmediates);
+    RUN_TEST(tr, runtime::TestLiveObjectCounts);
+    RUN_TEST(tr, runtime::TestRopeStrings);
+    RUN_TEST(tr, runtime::TestCycleCollector);
+    RUN_TEST(tr, runtime::TestCycleCollectorPerThread);
+    RUN_TEST(tr, runtime::TestObjectTypes);
 }
 
 }  // namespace runtime
\ No newline at end of file
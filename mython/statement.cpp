@@ -9,59 +9,127 @@ using namespace std;
 
 namespace ast {
 
+using runtime::ApplyCompareOp;
 using runtime::Closure;
 using runtime::Context;
 using runtime::ObjectHolder;
 
 namespace {
-const string ADD_METHOD = "__add__"s;
-const string INIT_METHOD = "__init__"s;
+const runtime::Symbol ADD_METHOD{"__add__"sv};
+const runtime::Symbol INIT_METHOD{"__init__"sv};
 const string EMPTY_OBJECT = "None"s;
+
+vector<runtime::Symbol> ToSymbols(const vector<string>& names) {
+    return {names.begin(), names.end()};
+}
+
+// Возвращает ссылку на значение переменной name: из слота slot кадра метода, если слот назначен,
+// иначе из closure
+ObjectHolder& Variable(runtime::Symbol name, const optional<size_t>& slot, Closure& closure,
+                       Context& context) {
+    if (slot) {
+        auto& value = context.GetCallStack().Slot(*slot);
+        if (!value) {
+            throw runtime_error("Var "s + name.GetName() + " not found"s);
+        }
+        return *value;
+    }
+
+    auto it = closure.find(name);
+    if (it == closure.end()) {
+        throw runtime_error("Var "s + name.GetName() + " not found"s);
+    }
+    return it->second;
+}
 }  // namespace
 
 ObjectHolder Assignment::Execute(Closure& closure, Context& context) {
-    closure[var_] = rv_->Execute(closure, context);
-    
-    return closure.at(var_);
+    ObjectHolder value = rv_->Execute(closure, context);
+
+    if (slot_) {
+        return context.GetCallStack().Slot(*slot_).emplace(move(value));
+    }
+    return closure[var_] = move(value);
+}
+
+Assignment::Assignment(runtime::Symbol var, unique_ptr<Statement> rv)
+    : var_{var}, rv_{move(rv)} {
+}
+
+Assignment::Assignment(runtime::Symbol var, size_t slot, unique_ptr<Statement> rv)
+    : var_{var}, slot_{slot}, rv_{move(rv)} {
+}
+
+namespace {
+
+// Размер заголовка узла, сохраняющий выравнивание самого узла
+constexpr size_t NODE_HEADER_SIZE = alignof(max_align_t);
+static_assert(sizeof(Arena*) <= NODE_HEADER_SIZE);
+
+}  // namespace
+
+void* Statement::operator new(size_t size) {
+    Arena* arena = Arena::Current();
+    void* block = arena != nullptr ? arena->allocate(NODE_HEADER_SIZE + size, alignof(max_align_t))
+                                   : ::operator new(NODE_HEADER_SIZE + size);
+    *static_cast<Arena**>(block) = arena;
+    return static_cast<byte*>(block) + NODE_HEADER_SIZE;
 }
 
-Assignment::Assignment(string var, unique_ptr<Statement> rv)
-    : var_{move(var)}, rv_{move(rv)} {
+void Statement::operator delete(void* ptr, size_t size) noexcept {
+    void* block = static_cast<byte*>(ptr) - NODE_HEADER_SIZE;
+    if (Arena* arena = *static_cast<Arena**>(block)) {
+        arena->deallocate(block, NODE_HEADER_SIZE + size, alignof(max_align_t));
+    } else {
+        ::operator delete(block);
+    }
 }
 
-VariableValue::VariableValue(const string& var_name)
+VariableValue::VariableValue(runtime::Symbol var_name)
     : var_name_{var_name} {
 }
 
-VariableValue::VariableValue(vector<string> dotted_ids) {
-    if (auto size = dotted_ids.size(); size > 0) {
-        var_name_ = move(dotted_ids.at(0));
-        
-        dotted_ids_.resize(size - 1);
-        
-        move(next(dotted_ids.begin()), dotted_ids.end(), dotted_ids_.begin());
+VariableValue::VariableValue(const vector<string>& dotted_ids)
+    : VariableValue(ToSymbols(dotted_ids)) {
+}
+
+VariableValue::VariableValue(vector<runtime::Symbol> dotted_ids) {
+    if (!dotted_ids.empty()) {
+        var_name_ = dotted_ids.front();
+        dotted_ids_.assign(next(dotted_ids.begin()), dotted_ids.end());
     }
 }
 
+VariableValue::VariableValue(vector<runtime::Symbol> dotted_ids, size_t slot)
+    : VariableValue(move(dotted_ids)) {
+    slot_ = slot;
+}
+
 ObjectHolder VariableValue::Execute(Closure& closure, Context& context) {
-    if (closure.count(var_name_)) {
-        auto result = closure.at(var_name_);
-        
-        if (dotted_ids_.size() > 0) {
-            if (auto obj = result.TryAs<runtime::ClassInstance>()) {
-                return VariableValue(dotted_ids_).Execute(obj->Fields(), context);
-            } else {
-                throw runtime_error("Var " + var_name_+ " is not class"s);
-            }
+    ObjectHolder result = Variable(var_name_, slot_, closure, context);
+    runtime::Symbol name = var_name_;
+
+    for (runtime::Symbol field : dotted_ids_) {
+        auto obj = result.TryAs<runtime::ClassInstance>();
+        if (!obj) {
+            throw runtime_error("Var "s + name.GetName() + " is not class"s);
         }
-        
-        return result;
-    } else {
-        throw runtime_error("Var "s + var_name_ + " not found"s);
+
+        auto field_value = obj->GetField(field);
+        if (!field_value) {
+            throw runtime_error("Var "s + field.GetName() + " not found"s);
+        }
+
+        // Сначала копируется значение поля: result может быть последней ссылкой на объект
+        ObjectHolder value = *field_value;
+        result = move(value);
+        name = field;
     }
+
+    return result;
 }
 
-unique_ptr<Print> Print::Variable(const string& name) {
+unique_ptr<Print> Print::Variable(runtime::Symbol name) {
     return make_unique<Print>(make_unique<VariableValue>(name));
 }
 
@@ -86,7 +154,7 @@ ObjectHolder Print::Execute(Closure& closure, Context& context) {
         auto obj = arg->Execute(closure, context);
         
         if (obj) {
-            obj->Print(out, context);
+            obj.Print(out, context);
         } else {
             out << EMPTY_OBJECT;
         }
@@ -98,21 +166,69 @@ ObjectHolder Print::Execute(Closure& closure, Context& context) {
     return {};
 }
 
-MethodCall::MethodCall(unique_ptr<Statement> object, string method,
+MethodCall::MethodCall(unique_ptr<Statement> object, runtime::Symbol method,
     vector<unique_ptr<Statement>> args)
-        : object_{move(object)}, method_{move(method)}, args_{move(args)} {
+        : object_{move(object)}, method_{method}, args_{move(args)} {
+}
+
+MethodCacheStats& GetMethodCacheStats() {
+    static MethodCacheStats stats;
+    return stats;
+}
+
+const runtime::Method* MethodCache::FindMethod(const runtime::Class& cls, runtime::Symbol name,
+                                               size_t argument_count) {
+    auto& stats = GetMethodCacheStats();
+
+    for (size_t i = 0; i < size_; ++i) {
+        if (entries_[i].cls == &cls) {
+            ++stats.hits;
+            return entries_[i].method;
+        }
+    }
+
+    const runtime::Method* method = cls.GetMethod(name, argument_count);
+    if (method == nullptr) {
+        return nullptr;
+    }
+
+    // Переполненный кэш больше не пополняется
+    if (size_ == CACHE_SIZE) {
+        ++stats.megamorphic;
+    } else {
+        ++stats.misses;
+        entries_[size_++] = {&cls, method};
+    }
+
+    return method;
 }
 
 ObjectHolder MethodCall::Execute(Closure& closure, Context& context) {
+    // holder удерживает объект на время вызова метода
+    auto holder = object_->Execute(closure, context);
 
-    if (auto class_instance =
-        object_->Execute(closure, context).TryAs<runtime::ClassInstance>()) {
+    auto class_instance = proven_method_ != nullptr ? &holder.As<runtime::ClassInstance>()
+                                                    : holder.TryAs<runtime::ClassInstance>();
+    if (class_instance) {
         vector<runtime::ObjectHolder> executed_args;
+        executed_args.reserve(args_.size());
         
         for (auto &arg : args_) {
             executed_args.push_back(arg->Execute(closure, context));
         }
-        
+
+        auto method = proven_method_ != nullptr
+                          ? proven_method_
+                          : cache_.FindMethod(class_instance->GetClass(), method_, args_.size());
+        if (method) {
+            if (tail_call_ && context.CanDeferTailCall()) {
+                // Вызов выполнит ClassInstance::Call метода, содержащего данную инструкцию return
+                context.DeferTailCall({move(holder), method, move(executed_args)});
+                return ObjectHolder::None();
+            }
+            return class_instance->Call(*method, executed_args, context);
+        }
+        // Метод не найден: сообщение об ошибке формирует ClassInstance::Call
         return class_instance->Call(method_, executed_args, context);
     } else {
         throw runtime_error("Obj is not class instance"s);
@@ -124,7 +240,7 @@ ObjectHolder Stringify::Execute(Closure& closure, Context& context) {
     
     if (obj) {
         ostringstream out;
-        obj->Print(out, context);
+        obj.Print(out, context);
         
         return ObjectHolder::Own(runtime::String(out.str()));
     } else {
@@ -132,38 +248,152 @@ ObjectHolder Stringify::Execute(Closure& closure, Context& context) {
     }
 }
 
-// макрос, сокращающий дублирование кода при проверке типов
-#define CHECK_TYPE(TYPE, LHS, RHS) LHS.TryAs<TYPE>() && RHS.TryAs<TYPE>()
+// макрос, сокращающий дублирование кода при выборе ветки по типам обоих операндов
+#define TYPE_PAIR(TYPE) runtime::CombineTypes(runtime::ObjectType::TYPE, runtime::ObjectType::TYPE)
 
 // макрос, сокращающий дублирование кода при применени операции
-#define COMPUTE_AS_TYPE(TYPE, OP, LHS, RHS) \
-    ObjectHolder::Own(TYPE(LHS.TryAs<TYPE>()->GetValue() OP RHS.TryAs<TYPE>()->GetValue())); 
+#define COMPUTE_AS_NUMBER(OP, LHS, RHS) \
+    ObjectHolder::Own(runtime::Number(LHS.AsNumber() OP RHS.AsNumber()));
+
+QuickeningStats& GetQuickeningStats() {
+    static QuickeningStats stats;
+    return stats;
+}
+
+BinaryOperation::Specialization BinaryOperation::Specialize(const ObjectHolder& lhs,
+                                                            const ObjectHolder& rhs) {
+    if (proven_) {
+        return specialization_;
+    }
+    const unsigned types = runtime::CombineTypes(lhs.GetType(), rhs.GetType());
+
+    switch (specialization_) {
+        case Specialization::IntInt:
+            if (types == TYPE_PAIR(Number)) {
+                return Specialization::IntInt;
+            }
+            break;
+        case Specialization::StrStr:
+            if (types == TYPE_PAIR(String)) {
+                return Specialization::StrStr;
+            }
+            break;
+        case Specialization::Generic:
+            return Specialization::Generic;
+        case Specialization::Uninitialized:
+            if (types == TYPE_PAIR(Number) || types == TYPE_PAIR(String)) {
+                ++GetQuickeningStats().specializations;
+                specialization_ = types == TYPE_PAIR(Number) ? Specialization::IntInt
+                                                             : Specialization::StrStr;
+            } else {
+                specialization_ = Specialization::Generic;
+            }
+            return specialization_;
+    }
+
+    ++GetQuickeningStats().deoptimizations;
+    specialization_ = Specialization::Generic;
+    return specialization_;
+}
+
+namespace {
+
+// Возвращает строку prefix + buffer, где prefix - строка либо пустое значение
+ObjectHolder JoinConcatenation(const ObjectHolder& prefix, string& buffer) {
+    ObjectHolder tail = ObjectHolder::Own(runtime::String(move(buffer)));
+    return prefix ? runtime::ConcatenateStrings(prefix, tail) : tail;
+}
+
+}  // namespace
 
 ObjectHolder Add::Execute(Closure& closure, Context& context) {
+    if (temporary_lhs_) {
+        string buffer;
+        ObjectHolder result;
+        if (Concatenate(closure, context, buffer, result)) {
+            return JoinConcatenation(result, buffer);
+        }
+        return result;
+    }
+
     ObjectHolder lhs_h = lhs_->Execute(closure, context);
     ObjectHolder rhs_h = rhs_->Execute(closure, context);
+    return Sum(lhs_h, rhs_h, context);
+}
 
-    if (CHECK_TYPE(runtime::Number, lhs_h, rhs_h)) {
-        return COMPUTE_AS_TYPE(runtime::Number, +, lhs_h, rhs_h)
+bool Add::Concatenate(Closure& closure, Context& context, string& buffer, ObjectHolder& result) {
+    ObjectHolder lhs_h;
+    bool lhs_in_buffer = false;
+    if (temporary_lhs_) {
+        lhs_in_buffer = static_cast<Add&>(*lhs_).Concatenate(closure, context, buffer, lhs_h);
+    } else {
+        lhs_h = lhs_->Execute(closure, context);
     }
+    ObjectHolder rhs_h = rhs_->Execute(closure, context);
 
-    if (CHECK_TYPE(runtime::String, lhs_h, rhs_h)) {
-        return COMPUTE_AS_TYPE(runtime::String, +, lhs_h, rhs_h)
+    auto rhs_str = rhs_h.TryAs<runtime::String>();
+    if (lhs_in_buffer) {
+        if (rhs_str != nullptr) {
+            buffer += rhs_str->GetValue();
+            result = move(lhs_h);
+            ++runtime::GetAllocationStats().avoided_objects;
+            return true;
+        }
+        // Сложение строки со значением другого типа завершится ошибкой в Sum
+        lhs_h = JoinConcatenation(lhs_h, buffer);
+        buffer.clear();
+    } else if (auto lhs_str = lhs_h.TryAs<runtime::String>();
+               lhs_str != nullptr && rhs_str != nullptr) {
+        if (lhs_str->GetSize() >= runtime::String::MIN_ROPE_SIZE) {
+            // Накопленная строка (s + a + b) не копируется: к ней присоединяется буфер
+            result = move(lhs_h);
+            buffer += rhs_str->GetValue();
+            return true;
+        }
+        buffer.reserve(lhs_str->GetValue().size() + rhs_str->GetValue().size());
+        buffer += lhs_str->GetValue();
+        buffer += rhs_str->GetValue();
+        return true;
+    }
+
+    result = Sum(lhs_h, rhs_h, context);
+    return false;
+}
+
+ObjectHolder Add::Sum(const ObjectHolder& lhs_h, const ObjectHolder& rhs_h, Context& context) {
+    switch (Specialize(lhs_h, rhs_h)) {
+        case Specialization::IntInt:
+            return COMPUTE_AS_NUMBER(+, lhs_h, rhs_h)
+        case Specialization::StrStr:
+            return runtime::ConcatenateStrings(lhs_h, rhs_h);
+        default:
+            break;
+    }
+
+    switch (runtime::CombineTypes(lhs_h.GetType(), rhs_h.GetType())) {
+        case TYPE_PAIR(Number):
+            return COMPUTE_AS_NUMBER(+, lhs_h, rhs_h)
+        case TYPE_PAIR(String):
+            return runtime::ConcatenateStrings(lhs_h, rhs_h);
+        default:
+            break;
     }
     
-    if (auto left_class = lhs_h.TryAs<runtime::ClassInstance>()) {
-        return left_class->Call(ADD_METHOD, {rhs_h}, context);
+    if (lhs_h.GetType() == runtime::ObjectType::ClassInstance) {
+        return lhs_h.As<runtime::ClassInstance>().Call(ADD_METHOD, {rhs_h}, context);
     }
     
-    throw runtime_error("Can only add nums, strings, class instances with "s + ADD_METHOD);
+    throw runtime_error("Can only add nums, strings, class instances with "s
+                        + ADD_METHOD.GetName());
 }
 
 ObjectHolder Sub::Execute(Closure& closure, Context& context) {
     ObjectHolder lhs_h = lhs_->Execute(closure, context);
     ObjectHolder rhs_h = rhs_->Execute(closure, context);
 
-    if (CHECK_TYPE(runtime::Number, lhs_h, rhs_h)) {
-        return COMPUTE_AS_TYPE(runtime::Number, -, lhs_h, rhs_h)
+    if (Specialize(lhs_h, rhs_h) == Specialization::IntInt
+        || runtime::CombineTypes(lhs_h.GetType(), rhs_h.GetType()) == TYPE_PAIR(Number)) {
+        return COMPUTE_AS_NUMBER(-, lhs_h, rhs_h)
     }
     
     throw runtime_error("Can sub only nums"s);
@@ -173,8 +403,9 @@ ObjectHolder Mult::Execute(Closure& closure, Context& context) {
     ObjectHolder lhs_h = lhs_->Execute(closure, context);
     ObjectHolder rhs_h = rhs_->Execute(closure, context);
 
-    if (CHECK_TYPE(runtime::Number, lhs_h, rhs_h)) {
-        return COMPUTE_AS_TYPE(runtime::Number, *, lhs_h, rhs_h)
+    if (Specialize(lhs_h, rhs_h) == Specialization::IntInt
+        || runtime::CombineTypes(lhs_h.GetType(), rhs_h.GetType()) == TYPE_PAIR(Number)) {
+        return COMPUTE_AS_NUMBER(*, lhs_h, rhs_h)
     }
     
     throw runtime_error("Can multiply only nums"s);
@@ -184,52 +415,68 @@ ObjectHolder Div::Execute(Closure& closure, Context& context) {
     ObjectHolder lhs_h = lhs_->Execute(closure, context);
     ObjectHolder rhs_h = rhs_->Execute(closure, context);
     
-    auto right = rhs_h.TryAs<runtime::Number>();
-    
-    if (right && right->GetValue() == 0) {
+    if (rhs_h.GetType() == runtime::ObjectType::Number
+        && rhs_h.AsNumber() == 0) {
         throw runtime_error("Division by zero"s);
     }
 
-    if (CHECK_TYPE(runtime::Number, lhs_h, rhs_h)) {
-        return COMPUTE_AS_TYPE(runtime::Number, /, lhs_h, rhs_h)
+    if (Specialize(lhs_h, rhs_h) == Specialization::IntInt
+        || runtime::CombineTypes(lhs_h.GetType(), rhs_h.GetType()) == TYPE_PAIR(Number)) {
+        return COMPUTE_AS_NUMBER(/, lhs_h, rhs_h)
     }
     
     throw runtime_error("Can divide only nums"s);
 }
 
-#undef CHECK_TYPE
-#undef COMPUTE_AS_TYPE
+#undef TYPE_PAIR
+#undef COMPUTE_AS_NUMBER
 
 ObjectHolder Compound::Execute(Closure& closure, Context& context) {
     for (auto &arg : args_) {
-        arg->Execute(closure, context);
+        ObjectHolder result = arg->Execute(closure, context);
+        if (context.IsReturning()) {
+            return result;
+        }
     }
     return ObjectHolder::None();
 }
 
 ObjectHolder Return::Execute(Closure& closure, Context& context) {
-    throw statement_->Execute(closure, context);
+    ObjectHolder result = statement_->Execute(closure, context);
+    context.SetReturning(true);
+    return result;
 }
 
 ClassDefinition::ClassDefinition(ObjectHolder cls)
-    : cls_{move(cls)} {
+    : cls_{move(cls)}, name_{cls_.TryAs<runtime::Class>()->GetName()} {
+}
+
+ClassDefinition::ClassDefinition(ObjectHolder cls, size_t slot)
+    : ClassDefinition(move(cls)) {
+    slot_ = slot;
 }
 
-ObjectHolder ClassDefinition::Execute(Closure& closure, [[maybe_unused]] Context& context) {
-    closure[cls_.TryAs<runtime::Class>()->GetName()] = cls_;
+ObjectHolder ClassDefinition::Execute(Closure& closure, Context& context) {
+    if (slot_) {
+        context.GetCallStack().Slot(*slot_) = cls_;
+    } else {
+        closure[name_] = cls_;
+    }
     return ObjectHolder::None();
 }
 
-FieldAssignment::FieldAssignment(VariableValue object, string field_name,
+FieldAssignment::FieldAssignment(VariableValue object, runtime::Symbol field_name,
     unique_ptr<Statement> rv)
-        : object_{move(object)}, field_name_{move(field_name)}, rv_{move(rv)} {
+        : object_{move(object)}, field_name_{field_name}, rv_{move(rv)} {
 }
 
 ObjectHolder FieldAssignment::Execute(Closure& closure, Context& context) {
-    auto obj = object_.Execute(closure, context).TryAs<runtime::ClassInstance>();
+    auto holder = object_.Execute(closure, context);
     
-    if (obj) {
-        return obj->Fields()[field_name_] = rv_->Execute(closure, context);
+    if (auto obj = holder.TryAs<runtime::ClassInstance>()) {
+        ObjectHolder value = rv_->Execute(closure, context);
+        obj->SetField(field_name_, value);
+        return value;
     } else {
         throw runtime_error("Object is not class"s);
     }
@@ -279,17 +526,42 @@ ObjectHolder Not::Execute(Closure& closure, Context& context) {
 Comparison::Comparison(Comparator cmp, unique_ptr<Statement> lhs, unique_ptr<Statement> rhs)
     : BinaryOperation(move(lhs), move(rhs)) {
     cmp_ = move(cmp);
+    // Произвольная функция сравнения выполняется только общим путём
+    specialization_ = Specialization::Generic;
+}
+
+Comparison::Comparison(runtime::CompareOp op, unique_ptr<Statement> lhs,
+    unique_ptr<Statement> rhs)
+        : BinaryOperation(move(lhs), move(rhs)), op_{op} {
 }
 
 ObjectHolder Comparison::Execute(Closure& closure, Context& context) {
-    auto result = cmp_(lhs_->Execute(closure, context), rhs_->Execute(closure, context), context);
-    
+    ObjectHolder lhs_h = lhs_->Execute(closure, context);
+    ObjectHolder rhs_h = rhs_->Execute(closure, context);
+
+    if (op_) {
+        switch (Specialize(lhs_h, rhs_h)) {
+            case Specialization::IntInt:
+                return ObjectHolder::Own(
+                    runtime::Bool(ApplyCompareOp(*op_, lhs_h.AsNumber(), rhs_h.AsNumber())));
+            case Specialization::StrStr:
+                return ObjectHolder::Own(runtime::Bool(
+                    ApplyCompareOp(*op_, lhs_h.As<runtime::String>().GetValue(),
+                                   rhs_h.As<runtime::String>().GetValue())));
+            default:
+                break;
+        }
+    }
+
+    bool result = op_ ? runtime::Compare(*op_, lhs_h, rhs_h, context)
+                      : cmp_(lhs_h, rhs_h, context);
+
     return runtime::ObjectHolder::Own(runtime::Bool(result));
 }
 
 NewInstance::NewInstance(const runtime::Class& class_,
     vector<unique_ptr<Statement>> args) 
-        : instance_{class_}, args_{move(args)} {
+        : class_{class_}, args_{move(args)} {
 }
 
 NewInstance::NewInstance(const runtime::Class& class_)
@@ -297,17 +569,20 @@ NewInstance::NewInstance(const runtime::Class& class_)
 }
 
 ObjectHolder NewInstance::Execute(Closure& closure, Context& context) {
-    if (instance_.HasMethod(INIT_METHOD, args_.size())) {
+    auto holder = ObjectHolder::Own(runtime::ClassInstance(class_));
+    auto& instance = *holder.TryAs<runtime::ClassInstance>();
+
+    if (instance.HasMethod(INIT_METHOD, args_.size())) {
         vector<runtime::ObjectHolder> executed_args;
         
         for (auto& arg : args_) {
             executed_args.push_back(arg->Execute(closure, context));
         }
         
-        instance_.Call(INIT_METHOD, executed_args, context);
+        instance.Call(INIT_METHOD, executed_args, context);
     }
 
-    return runtime::ObjectHolder::Share(instance_);
+    return holder;
 }
 
 MethodBody::MethodBody(unique_ptr<Statement>&& body)
@@ -315,14 +590,13 @@ MethodBody::MethodBody(unique_ptr<Statement>&& body)
 }
 
 ObjectHolder MethodBody::Execute(Closure& closure, Context& context) {
-    try {
-        body_->Execute(closure, context);
-        return runtime::ObjectHolder::None();
-    }  catch (runtime::ObjectHolder &result) {
+    ObjectHolder result = body_->Execute(closure, context);
+
+    if (context.IsReturning()) {
+        context.SetReturning(false);
         return result;
-    }  catch (...) {
-        throw;
     }
+    return ObjectHolder::None();
 }
 
 }  // namespace ast
\ No newline at end of file
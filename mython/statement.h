@@ -1,12 +1,91 @@
 #pragma once
 
+#include "arena.h"
 #include "runtime.h"
 
+#include <array>
+#include <cstdint>
 #include <functional>
+#include <optional>
 
 namespace ast {
 
-using Statement = runtime::Executable;
+template <typename T>
+class ValueStatement;
+using NumericConst = ValueStatement<runtime::Number>;
+using StringConst = ValueStatement<runtime::String>;
+using BoolConst = ValueStatement<runtime::Bool>;
+class VariableValue;
+class Assignment;
+class FieldAssignment;
+class None;
+class Print;
+class MethodCall;
+class NewInstance;
+class Stringify;
+class Add;
+class Sub;
+class Mult;
+class Div;
+class Or;
+class And;
+class Not;
+class Compound;
+class MethodBody;
+class Return;
+class ClassDefinition;
+class IfElse;
+class Comparison;
+
+// Посетитель узлов дерева разбора. Используется проходами, анализирующими
+// и преобразующими программу
+class Visitor {
+public:
+    virtual void Visit(NumericConst& node) = 0;
+    virtual void Visit(StringConst& node) = 0;
+    virtual void Visit(BoolConst& node) = 0;
+    virtual void Visit(VariableValue& node) = 0;
+    virtual void Visit(Assignment& node) = 0;
+    virtual void Visit(FieldAssignment& node) = 0;
+    virtual void Visit(None& node) = 0;
+    virtual void Visit(Print& node) = 0;
+    virtual void Visit(MethodCall& node) = 0;
+    virtual void Visit(NewInstance& node) = 0;
+    virtual void Visit(Stringify& node) = 0;
+    virtual void Visit(Add& node) = 0;
+    virtual void Visit(Sub& node) = 0;
+    virtual void Visit(Mult& node) = 0;
+    virtual void Visit(Div& node) = 0;
+    virtual void Visit(Or& node) = 0;
+    virtual void Visit(And& node) = 0;
+    virtual void Visit(Not& node) = 0;
+    virtual void Visit(Compound& node) = 0;
+    virtual void Visit(MethodBody& node) = 0;
+    virtual void Visit(Return& node) = 0;
+    virtual void Visit(ClassDefinition& node) = 0;
+    virtual void Visit(IfElse& node) = 0;
+    virtual void Visit(Comparison& node) = 0;
+
+protected:
+    ~Visitor() = default;
+};
+
+// Узел дерева разбора
+class Statement : public runtime::Executable {
+public:
+    // Вызывает метод посетителя, соответствующий типу узла
+    virtual void Accept(Visitor& visitor) = 0;
+
+    // Узлы, создаваемые во время разбора программы, размещаются в текущей арене (см. Arena),
+    // остальные - в куче. Перед узлом хранится арена, из которой он выделен, либо nullptr
+    static void* operator new(std::size_t size);
+    static void operator delete(void* ptr, std::size_t size) noexcept;
+};
+
+#define AST_ACCEPT_VISITOR                  \
+    void Accept(Visitor& visitor) override { \
+        visitor.Visit(*this);                \
+    }
 
 // Выражение, возвращающее значение типа T,
 // используется как основа для создания констант
@@ -14,21 +93,43 @@ template <typename T>
 class ValueStatement : public Statement {
 public:
     explicit ValueStatement(T v)
-        : value_(std::move(v)) {
+        : value_(MakeConstant(std::move(v))) {
     }
 
     runtime::ObjectHolder Execute(runtime::Closure& /*closure*/,
                                   runtime::Context& /*context*/) override {
-        return runtime::ObjectHolder::Share(value_);
+        // Числа и логические значения копируются в ObjectHolder без обращения к куче,
+        // строки разделяются с пулом констант
+        return value_;
+    }
+
+    AST_ACCEPT_VISITOR
+
+    // Числа и логические значения возвращаются по значению, чтобы не размещать их в куче
+    [[nodiscard]] decltype(auto) GetValue() const {
+        if constexpr (std::is_same_v<T, runtime::Number>) {
+            return runtime::Number(value_.AsNumber());
+        } else if constexpr (std::is_same_v<T, runtime::Bool>) {
+            return runtime::Bool(value_.AsBool());
+        } else {
+            return static_cast<const T&>(value_.template As<T>());
+        }
+    }
+    [[nodiscard]] const runtime::ObjectHolder& GetHolder() const {
+        return value_;
     }
 
 private:
-    T value_;
-};
+    static runtime::ObjectHolder MakeConstant(T v) {
+        if constexpr (runtime::IsImmediate<T>) {
+            return runtime::ObjectHolder::Own(std::move(v));
+        } else {
+            return runtime::InternString(v.GetValue());
+        }
+    }
 
-using NumericConst = ValueStatement<runtime::Number>;
-using StringConst = ValueStatement<runtime::String>;
-using BoolConst = ValueStatement<runtime::Bool>;
+    runtime::ObjectHolder value_;
+};
 
 /*
 Вычисляет значение переменной либо цепочки вызовов полей объектов id1.id2.id3.
@@ -37,35 +138,82 @@ x = circle.center.x
 */
 class VariableValue : public Statement {
 public:
-    explicit VariableValue(const std::string& var_name);
-    explicit VariableValue(std::vector<std::string> dotted_ids);
+    explicit VariableValue(runtime::Symbol var_name);
+    explicit VariableValue(const std::vector<std::string>& dotted_ids);
+    explicit VariableValue(std::vector<runtime::Symbol> dotted_ids);
+    // Значение переменной первого идентификатора цепочки читается из слота slot кадра метода
+    VariableValue(std::vector<runtime::Symbol> dotted_ids, size_t slot);
 
     runtime::ObjectHolder Execute(runtime::Closure& closure, runtime::Context& context) override;
+    AST_ACCEPT_VISITOR
+
+    // Возвращает имя переменной - первый идентификатор цепочки
+    [[nodiscard]] runtime::Symbol GetName() const {
+        return var_name_;
+    }
+    // Возвращает имена полей, следующих в цепочке за переменной
+    [[nodiscard]] const std::pmr::vector<runtime::Symbol>& GetFieldNames() const {
+        return dotted_ids_;
+    }
+    // Возвращает слот переменной в кадре метода либо nullopt для переменной из Closure
+    [[nodiscard]] std::optional<size_t> GetSlot() const {
+        return slot_;
+    }
+
 private:
-    std::string var_name_;
-    std::vector<std::string> dotted_ids_;
+    runtime::Symbol var_name_;
+    std::pmr::vector<runtime::Symbol> dotted_ids_{Arena::CurrentResource()};
+    std::optional<size_t> slot_;
 };
 
 // Присваивает переменной, имя которой задано в параметре var, значение выражения rv
 class Assignment : public Statement {
 public:
-    Assignment(std::string var, std::unique_ptr<Statement> rv);
+    Assignment(runtime::Symbol var, std::unique_ptr<Statement> rv);
+    // Значение сохраняется в слот slot кадра метода
+    Assignment(runtime::Symbol var, size_t slot, std::unique_ptr<Statement> rv);
 
     runtime::ObjectHolder Execute(runtime::Closure& closure, runtime::Context& context) override;
+    AST_ACCEPT_VISITOR
+
+    [[nodiscard]] runtime::Symbol GetName() const {
+        return var_;
+    }
+    [[nodiscard]] std::optional<size_t> GetSlot() const {
+        return slot_;
+    }
+    std::unique_ptr<Statement>& Value() {
+        return rv_;
+    }
+
 private:
-    std::string var_;
+    runtime::Symbol var_;
+    std::optional<size_t> slot_;
     std::unique_ptr<Statement> rv_;
 };
 
 // Присваивает полю object.field_name значение выражения rv
 class FieldAssignment : public Statement {
 public:
-    FieldAssignment(VariableValue object, std::string field_name, std::unique_ptr<Statement> rv);
+    FieldAssignment(VariableValue object, runtime::Symbol field_name,
+                    std::unique_ptr<Statement> rv);
 
     runtime::ObjectHolder Execute(runtime::Closure& closure, runtime::Context& context) override;
+    AST_ACCEPT_VISITOR
+
+    VariableValue& Object() {
+        return object_;
+    }
+    [[nodiscard]] runtime::Symbol GetFieldName() const {
+        return field_name_;
+    }
+    std::unique_ptr<Statement>& Value() {
+        return rv_;
+    }
+
 private:
     VariableValue object_;
-    std::string field_name_;
+    runtime::Symbol field_name_;
     std::unique_ptr<Statement> rv_;
 };
 
@@ -76,6 +224,7 @@ public:
                                   [[maybe_unused]] runtime::Context& context) override {
         return {};
     }
+    AST_ACCEPT_VISITOR
 };
 
 // Команда print
@@ -87,26 +236,101 @@ public:
     explicit Print(std::vector<std::unique_ptr<Statement>> args);
 
     // Инициализирует команду print для вывода значения переменной name
-    static std::unique_ptr<Print> Variable(const std::string& name);
+    static std::unique_ptr<Print> Variable(runtime::Symbol name);
 
     // Во время выполнения команды print вывод должен осуществляться в поток, возвращаемый из
     // context.GetOutputStream()
     runtime::ObjectHolder Execute(runtime::Closure& closure, runtime::Context& context) override;
+    AST_ACCEPT_VISITOR
+
+    std::vector<std::unique_ptr<Statement>>& Args() {
+        return args_;
+    }
+
 private:
     std::vector<std::unique_ptr<Statement>> args_;
 };
 
+// Статистика инлайн-кэшей в местах вызова методов
+struct MethodCacheStats {
+    // Вызовы, метод которых найден в кэше
+    std::uint64_t hits = 0;
+    // Вызовы, потребовавшие поиска метода в классе и заполнившие кэш
+    std::uint64_t misses = 0;
+    // Вызовы в местах, где встретилось больше классов, чем вмещает кэш
+    std::uint64_t megamorphic = 0;
+};
+
+// Возвращает накопленную статистику инлайн-кэшей вызовов методов
+MethodCacheStats& GetMethodCacheStats();
+
+// Полиморфный инлайн-кэш места вызова метода: методы классов объектов, встречавшихся в данном
+// месте. Методы класса не меняются после его создания, поэтому записи кэша не требуют инвалидации
+class MethodCache {
+public:
+    // Число классов, методы которых запоминаются в месте вызова
+    static constexpr size_t CACHE_SIZE = 4;
+
+    // Возвращает метод name класса cls, принимающий argument_count параметров, либо nullptr,
+    // если у класса нет подходящего метода
+    const runtime::Method* FindMethod(const runtime::Class& cls, runtime::Symbol name,
+                                      size_t argument_count);
+
+private:
+    struct Entry {
+        const runtime::Class* cls = nullptr;
+        const runtime::Method* method = nullptr;
+    };
+
+    std::array<Entry, CACHE_SIZE> entries_;
+    size_t size_ = 0;
+};
+
 // Вызывает метод object.method со списком параметров args
 class MethodCall : public Statement {
 public:
-    MethodCall(std::unique_ptr<Statement> object, std::string method,
+    MethodCall(std::unique_ptr<Statement> object, runtime::Symbol method,
                std::vector<std::unique_ptr<Statement>> args);
 
     runtime::ObjectHolder Execute(runtime::Closure& closure, runtime::Context& context) override;
+    AST_ACCEPT_VISITOR
+
+    std::unique_ptr<Statement>& Object() {
+        return object_;
+    }
+    [[nodiscard]] runtime::Symbol GetMethodName() const {
+        return method_;
+    }
+    std::vector<std::unique_ptr<Statement>>& Args() {
+        return args_;
+    }
+
+    // Отмечает вызов, результат которого сразу возвращается инструкцией return.
+    // Такой вызов внутри метода выполняется после освобождения кадра этого метода
+    void MarkTailCall() {
+        tail_call_ = true;
+    }
+    [[nodiscard]] bool IsTailCall() const {
+        return tail_call_;
+    }
+
+    // Задаёт метод, вызываемый в данном месте. Используется, когда выводом типов доказано,
+    // что объект - всегда экземпляр одного класса. Тип объекта при вызове не проверяется
+    void SetProvenMethod(const runtime::Method* method) {
+        proven_method_ = method;
+    }
+    [[nodiscard]] const runtime::Method* GetProvenMethod() const {
+        return proven_method_;
+    }
+
 private:
     std::unique_ptr<Statement> object_;
-    std::string method_;
+    runtime::Symbol method_;
     std::vector<std::unique_ptr<Statement>> args_;
+
+    MethodCache cache_;
+    bool tail_call_ = false;
+    const runtime::Method* proven_method_ = nullptr;
 };
 
 /*
@@ -124,10 +348,19 @@ class NewInstance : public Statement {
 public:
     explicit NewInstance(const runtime::Class& class_);
     NewInstance(const runtime::Class& class_, std::vector<std::unique_ptr<Statement>> args);
-    // Возвращает объект, содержащий значение типа ClassInstance
+    // Возвращает объект, содержащий новое значение типа ClassInstance
     runtime::ObjectHolder Execute(runtime::Closure& closure, runtime::Context& context) override;
+    AST_ACCEPT_VISITOR
+
+    [[nodiscard]] const runtime::Class& GetClass() const {
+        return class_;
+    }
+    std::vector<std::unique_ptr<Statement>>& Args() {
+        return args_;
+    }
+
 private:
-    runtime::ClassInstance instance_;
+    const runtime::Class& class_;
     std::vector<std::unique_ptr<Statement>> args_;
 };
 
@@ -137,6 +370,11 @@ public:
     explicit UnaryOperation(std::unique_ptr<Statement> argument)
         : argument_{std::move(argument)} {
     }
+
+    std::unique_ptr<Statement>& Argument() {
+        return argument_;
+    }
+
 protected:
     std::unique_ptr<Statement> argument_;
 };
@@ -146,16 +384,65 @@ class Stringify : public UnaryOperation {
 public:
     using UnaryOperation::UnaryOperation;
     runtime::ObjectHolder Execute(runtime::Closure& closure, runtime::Context& context) override;
+    AST_ACCEPT_VISITOR
+};
+
+// Статистика специализации узлов арифметических операций и сравнений
+struct QuickeningStats {
+    // Узлы, специализированные по типам операндов
+    std::uint64_t specializations = 0;
+    // Специализированные узлы, вернувшиеся к общему пути из-за операндов других типов
+    std::uint64_t deoptimizations = 0;
 };
 
+// Возвращает накопленную статистику специализации узлов
+QuickeningStats& GetQuickeningStats();
+
 // Родительский класс Бинарная операция с аргументами lhs и rhs
 class BinaryOperation : public Statement {
 public:
+    // Вариант узла, выбранный по типам операндов, наблюдавшимся при его выполнении
+    enum class Specialization : std::uint8_t {
+        Uninitialized,  // узел ещё не выполнялся
+        IntInt,         // оба операнда - числа
+        StrStr,         // оба операнда - строки
+        Generic,        // общий путь для операндов любых типов
+    };
+
     BinaryOperation(std::unique_ptr<Statement> lhs, std::unique_ptr<Statement> rhs)
         : lhs_{std::move(lhs)}, rhs_{std::move(rhs)} {
     }
+
+    std::unique_ptr<Statement>& Lhs() {
+        return lhs_;
+    }
+    std::unique_ptr<Statement>& Rhs() {
+        return rhs_;
+    }
+
+    [[nodiscard]] Specialization GetSpecialization() const {
+        return specialization_;
+    }
+
+    // Закрепляет вариант узла, для которого выводом типов доказаны типы операндов.
+    // Типы операндов такого узла не проверяются
+    void SetProvenSpecialization(Specialization specialization) {
+        specialization_ = specialization;
+        proven_ = true;
+    }
+    [[nodiscard]] bool IsProven() const {
+        return proven_;
+    }
+
 protected:
+    // Возвращает вариант узла для значений операндов lhs и rhs. При первом выполнении узел
+    // специализируется по типам операндов. Если операнды перестают соответствовать
+    // специализации, узел навсегда переходит на общий путь
+    Specialization Specialize(const runtime::ObjectHolder& lhs, const runtime::ObjectHolder& rhs);
+
     std::unique_ptr<Statement> lhs_, rhs_;
+    Specialization specialization_ = Specialization::Uninitialized;
+    bool proven_ = false;
 };
 
 // Возвращает результат операции + над аргументами lhs и rhs
@@ -169,6 +456,28 @@ public:
     //  объект1 + объект2, если у объект1 - пользовательский класс с методом _add__(rhs)
     // В противном случае при вычислении выбрасывается runtime_error
     runtime::ObjectHolder Execute(runtime::Closure& closure, runtime::Context& context) override;
+    AST_ACCEPT_VISITOR
+
+    // Отмечает, что левый операнд - сложение, строковый результат которого не покидает
+    // данный узел. Такой результат накапливается в буфере без создания объекта String
+    void SetTemporaryLhs() {
+        temporary_lhs_ = true;
+    }
+    [[nodiscard]] bool HasTemporaryLhs() const {
+        return temporary_lhs_;
+    }
+
+private:
+    // Вычисляет сумму. Если сумма - строка, записывает её в пустой buffer и возвращает true;
+    // длинная левая строка при этом не копируется, а сохраняется в result, и сумма равна
+    // result + buffer. Иначе сохраняет значение суммы в result и возвращает false
+    bool Concatenate(runtime::Closure& closure, runtime::Context& context, std::string& buffer,
+                     runtime::ObjectHolder& result);
+    // Складывает вычисленные значения операндов
+    runtime::ObjectHolder Sum(const runtime::ObjectHolder& lhs, const runtime::ObjectHolder& rhs,
+                             runtime::Context& context);
+
+    bool temporary_lhs_ = false;
 };
 
 // Возвращает результат вычитания аргументов lhs и rhs
@@ -180,6 +489,7 @@ public:
     //  число - число
     // Если lhs и rhs - не числа, выбрасывается исключение runtime_error
     runtime::ObjectHolder Execute(runtime::Closure& closure, runtime::Context& context) override;
+    AST_ACCEPT_VISITOR
 };
 
 // Возвращает результат умножения аргументов lhs и rhs
@@ -191,6 +501,7 @@ public:
     //  число * число
     // Если lhs и rhs - не числа, выбрасывается исключение runtime_error
     runtime::ObjectHolder Execute(runtime::Closure& closure, runtime::Context& context) override;
+    AST_ACCEPT_VISITOR
 };
 
 // Возвращает результат деления lhs и rhs
@@ -203,6 +514,7 @@ public:
     // Если lhs и rhs - не числа, выбрасывается исключение runtime_error
     // Если rhs равен 0, выбрасывается исключение runtime_error
     runtime::ObjectHolder Execute(runtime::Closure& closure, runtime::Context& context) override;
+    AST_ACCEPT_VISITOR
 };
 
 // Возвращает результат вычисления логической операции or над lhs и rhs
@@ -212,6 +524,7 @@ public:
     // Значение аргумента rhs вычисляется, только если значение lhs
     // после приведения к Bool равно False
     runtime::ObjectHolder Execute(runtime::Closure& closure, runtime::Context& context) override;
+    AST_ACCEPT_VISITOR
 };
 
 // Возвращает результат вычисления логической операции and над lhs и rhs
@@ -221,6 +534,7 @@ public:
     // Значение аргумента rhs вычисляется, только если значение lhs
     // после приведения к Bool равно True
     runtime::ObjectHolder Execute(runtime::Closure& closure, runtime::Context& context) override;
+    AST_ACCEPT_VISITOR
 };
 
 // Возвращает результат вычисления логической операции not над единственным аргументом операции
@@ -228,6 +542,7 @@ class Not : public UnaryOperation {
 public:
     using UnaryOperation::UnaryOperation;
     runtime::ObjectHolder Execute(runtime::Closure& closure, runtime::Context& context) override;
+    AST_ACCEPT_VISITOR
 };
 
 // Составная инструкция (например: тело метода, содержимое ветки if, либо else)
@@ -243,8 +558,16 @@ public:
         args_.push_back(std::move(stmt));
     }
 
-    // Последовательно выполняет добавленные инструкции. Возвращает None
+    // Последовательно выполняет добавленные инструкции. Возвращает None.
+    // Если одна из инструкций выполнила return, оставшиеся инструкции пропускаются,
+    // а Compound возвращает результат return
     runtime::ObjectHolder Execute(runtime::Closure& closure, runtime::Context& context) override;
+    AST_ACCEPT_VISITOR
+
+    std::vector<std::unique_ptr<Statement>>& Statements() {
+        return args_;
+    }
+
 private:
     std::vector<std::unique_ptr<Statement>> args_;
 
@@ -266,6 +589,12 @@ public:
     // Если внутри body была выполнена инструкция return, возвращает результат return
     // В противном случае возвращает None
     runtime::ObjectHolder Execute(runtime::Closure& closure, runtime::Context& context) override;
+    AST_ACCEPT_VISITOR
+
+    std::unique_ptr<Statement>& Body() {
+        return body_;
+    }
+
 private:
     std::unique_ptr<Statement> body_;
 };
@@ -275,11 +604,22 @@ class Return : public Statement {
 public:
     explicit Return(std::unique_ptr<Statement> statement)
         : statement_{std::move(statement)} {
+        if (auto call = dynamic_cast<MethodCall*>(statement_.get())) {
+            call->MarkTailCall();
+        }
     }
 
     // Останавливает выполнение текущего метода. После выполнения инструкции return метод,
     // внутри которого она была исполнена, должен вернуть результат вычисления выражения statement.
+    // Возвращает результат statement и устанавливает в context признак выполнения return,
+    // по которому объемлющие инструкции прекращают выполнение
     runtime::ObjectHolder Execute(runtime::Closure& closure, runtime::Context& context) override;
+    AST_ACCEPT_VISITOR
+
+    std::unique_ptr<Statement>& Value() {
+        return statement_;
+    }
+
 private:
     std::unique_ptr<Statement> statement_;
 };
@@ -289,12 +629,29 @@ class ClassDefinition : public Statement {
 public:
     // Гарантируется, что ObjectHolder содержит объект типа runtime::Class
     explicit ClassDefinition(runtime::ObjectHolder cls);
+    // Класс объявляется внутри метода, и его значение сохраняется в слот slot кадра метода
+    ClassDefinition(runtime::ObjectHolder cls, size_t slot);
 
     // Создаёт внутри closure новый объект, совпадающий с именем класса и значением, переданным в
     // конструктор
     runtime::ObjectHolder Execute(runtime::Closure& closure, runtime::Context& context) override;
+    AST_ACCEPT_VISITOR
+
+    // Возвращает объявляемый класс
+    [[nodiscard]] runtime::Class& GetClass() const {
+        return cls_.As<runtime::Class>();
+    }
+    [[nodiscard]] const runtime::ObjectHolder& GetClassHolder() const {
+        return cls_;
+    }
+    [[nodiscard]] std::optional<size_t> GetSlot() const {
+        return slot_;
+    }
+
 private:
     runtime::ObjectHolder cls_;
+    runtime::Symbol name_;
+    std::optional<size_t> slot_;
 };
 
 // Инструкция if <condition> <if_body> else <else_body>
@@ -305,6 +662,19 @@ public:
            std::unique_ptr<Statement> else_body);
 
     runtime::ObjectHolder Execute(runtime::Closure& closure, runtime::Context& context) override;
+    AST_ACCEPT_VISITOR
+
+    std::unique_ptr<Statement>& Condition() {
+        return condition_;
+    }
+    std::unique_ptr<Statement>& IfBody() {
+        return if_body_;
+    }
+    // Может быть равен nullptr
+    std::unique_ptr<Statement>& ElseBody() {
+        return else_body_;
+    }
+
 private:
     std::unique_ptr<Statement> condition_, if_body_, else_body_;
 };
@@ -317,12 +687,28 @@ public:
         const runtime::ObjectHolder&, runtime::Context&)>;
 
     Comparison(Comparator cmp, std::unique_ptr<Statement> lhs, std::unique_ptr<Statement> rhs);
+    // Сравнение выполняется функцией runtime::Compare с операцией op
+    Comparison(runtime::CompareOp op, std::unique_ptr<Statement> lhs,
+               std::unique_ptr<Statement> rhs);
 
     // Вычисляет значение выражений lhs и rhs и возвращает результат работы comparator,
     // приведённый к типу runtime::Bool
     runtime::ObjectHolder Execute(runtime::Closure& closure, runtime::Context& context) override;
+    AST_ACCEPT_VISITOR
+
+    // Возвращает операцию сравнения либо nullopt, если сравнение задано функцией Comparator
+    [[nodiscard]] std::optional<runtime::CompareOp> GetOp() const {
+        return op_;
+    }
+    [[nodiscard]] const Comparator& GetComparator() const {
+        return cmp_;
+    }
+
 private:
     Comparator cmp_;
+    std::optional<runtime::CompareOp> op_;
 };
 
+#undef AST_ACCEPT_VISITOR
+
 }  // namespace ast
\ No newline at end of file
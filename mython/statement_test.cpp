@@ -1,6 +1,9 @@
 #include "statement.h"
 #include "test_runner.h"
 
+#include <atomic>
+#include <thread>
+
 using namespace std;
 
 namespace ast {
@@ -65,6 +68,54 @@ void TestStringConst() {
     ASSERT(context.output.str().empty());
 }
 
+void TestStringConstsAreInterned() {
+    runtime::DummyContext context;
+    Closure empty;
+    const runtime::ConstantPoolStats before = runtime::GetConstantPoolStats();
+
+    StringConst first(runtime::String("interned literal"s));
+    StringConst second(runtime::String("interned literal"s));
+    StringConst other(runtime::String("another literal"s));
+
+    // Одинаковые литералы разделяют одну строку из пула констант
+    ASSERT(first.Execute(empty, context).GetHeapObject()
+           == second.Execute(empty, context).GetHeapObject());
+    ASSERT(first.Execute(empty, context).GetHeapObject()
+           != other.Execute(empty, context).GetHeapObject());
+    ASSERT_EQUAL(runtime::GetConstantPoolStats().strings, before.strings + 2);
+    ASSERT_EQUAL(runtime::GetConstantPoolStats().reused, before.reused + 1);
+
+    // Строки пула не используют счётчик ссылок, поэтому потоки разделяют их без синхронизации
+    atomic<size_t> same_object = 0;
+    vector<thread> threads;
+    for (int i = 0; i < 4; ++i) {
+        threads.emplace_back([&first, &same_object, expected = first.Execute(empty, context)] {
+            runtime::DummyContext thread_context;
+            Closure thread_closure;
+            for (int j = 0; j < 1000; ++j) {
+                ObjectHolder copy = first.Execute(thread_closure, thread_context);
+                ObjectHolder interned = runtime::InternString("interned literal"s);
+                if (copy.GetHeapObject() == expected.GetHeapObject()
+                    && interned.GetHeapObject() == expected.GetHeapObject()) {
+                    ++same_object;
+                }
+            }
+        });
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+    ASSERT_EQUAL(same_object.load(), 4000U);
+
+    // Значение константы может пережить узел дерева
+    ObjectHolder value;
+    {
+        StringConst temporary(runtime::String("short-lived node"s));
+        value = temporary.Execute(empty, context);
+    }
+    ASSERT_EQUAL(value.TryAs<runtime::String>()->GetValue(), "short-lived node"s);
+}
+
 void TestVariable() {
     runtime::DummyContext context;
 
@@ -287,6 +338,20 @@ void TestClassInstanceAddWithoutMethod() {
     ASSERT(context.output.str().empty());
 }
 
+void TestNewInstanceCreatesDistinctObjects() {
+    runtime::DummyContext context;
+
+    runtime::Class cls("Empty"s, {}, nullptr);
+    NewInstance new_instance(cls);
+
+    Closure empty;
+    auto first = new_instance.Execute(empty, context);
+    auto second = new_instance.Execute(empty, context);
+    ASSERT(first.TryAs<runtime::ClassInstance>() != nullptr);
+    ASSERT(second.TryAs<runtime::ClassInstance>() != nullptr);
+    ASSERT(first.Get() != second.Get());
+}
+
 void TestCompound() {
     runtime::DummyContext context;
 
@@ -308,6 +373,29 @@ void TestCompound() {
     ASSERT(context.output.str().empty());
 }
 
+void TestReturn() {
+    runtime::DummyContext context;
+
+    auto if_body = make_unique<Compound>(
+        make_unique<Return>(make_unique<StringConst>("from if"s)),
+        make_unique<Print>(make_unique<StringConst>("unreachable"s)));
+    MethodBody body{make_unique<Compound>(
+        make_unique<Print>(make_unique<StringConst>("before"s)),
+        make_unique<IfElse>(make_unique<VariableValue>("flag"s), move(if_body), nullptr),
+        make_unique<Return>(make_unique<NumericConst>(1)),
+        make_unique<Print>(make_unique<StringConst>("after"s)))};
+
+    Closure closure = {{"flag"s, ObjectHolder::Own(runtime::Bool{true})}};
+    ASSERT_OBJECT_VALUE_EQUAL(body.Execute(closure, context), "from if"s);
+    ASSERT(!context.IsReturning());
+
+    closure["flag"s] = ObjectHolder::Own(runtime::Bool{false});
+    ASSERT_OBJECT_VALUE_EQUAL(body.Execute(closure, context), 1);
+    ASSERT(!context.IsReturning());
+
+    ASSERT_EQUAL(context.output.str(), "before\nbefore\n"s);
+}
+
 void TestFields() {
     runtime::DummyContext context;
 
@@ -407,6 +495,68 @@ void TestInheritance() {
     ASSERT(!cls.GetMethod("AsStringValue"s));
 }
 
+void TestMethodCallCache() {
+    runtime::DummyContext context;
+    vector<unique_ptr<runtime::Class>> classes;
+    for (int i = 0; i < 6; ++i) {
+        vector<runtime::Method> methods;
+        methods.push_back({"id"s, {}, make_unique<NumericConst>(i)});
+        classes.push_back(make_unique<runtime::Class>("C"s + to_string(i), move(methods), nullptr));
+    }
+
+    MethodCall call(make_unique<VariableValue>("obj"s), "id"s, {});
+    const MethodCacheStats before = GetMethodCacheStats();
+
+    for (int pass = 0; pass < 2; ++pass) {
+        for (int i = 0; i < 6; ++i) {
+            Closure closure = {{"obj"s, ObjectHolder::Own(runtime::ClassInstance{*classes[i]})}};
+            AssertObjectValueEqual(call.Execute(closure, context), i,
+                                   "Class C"s + to_string(i));
+        }
+    }
+
+    const MethodCacheStats& after = GetMethodCacheStats();
+    ASSERT_EQUAL(after.misses - before.misses, 4U);
+    ASSERT_EQUAL(after.hits - before.hits, 4U);
+    ASSERT_EQUAL(after.megamorphic - before.megamorphic, 4U);
+
+    Closure closure = {{"obj"s, ObjectHolder::Own(runtime::Number{1})}};
+    ASSERT_THROWS(call.Execute(closure, context), runtime_error);
+}
+
+void TestQuickening() {
+    runtime::DummyContext context;
+    using Specialization = BinaryOperation::Specialization;
+
+    Add add(make_unique<VariableValue>("x"s), make_unique<VariableValue>("y"s));
+    Comparison less(runtime::CompareOp::Less, make_unique<VariableValue>("x"s),
+                    make_unique<VariableValue>("y"s));
+    ASSERT(add.GetSpecialization() == Specialization::Uninitialized);
+    const QuickeningStats before = GetQuickeningStats();
+
+    Closure numbers = {{"x"s, ObjectHolder::Own(runtime::Number{2})},
+                       {"y"s, ObjectHolder::Own(runtime::Number{3})}};
+    AssertObjectValueEqual(add.Execute(numbers, context), 5, "2 + 3"s);
+    AssertObjectValueEqual(add.Execute(numbers, context), 5, "2 + 3"s);
+    ASSERT(add.GetSpecialization() == Specialization::IntInt);
+
+    Closure strings = {{"x"s, ObjectHolder::Own(runtime::String{"a"s})},
+                       {"y"s, ObjectHolder::Own(runtime::String{"b"s})}};
+    AssertObjectValueEqual(less.Execute(strings, context), "True"s, "'a' < 'b'"s);
+    ASSERT(less.GetSpecialization() == Specialization::StrStr);
+
+    // Операнды другого типа возвращают узел к общему пути, результат остаётся верным
+    AssertObjectValueEqual(add.Execute(strings, context), "ab"s, "'a' + 'b'"s);
+    ASSERT(add.GetSpecialization() == Specialization::Generic);
+    AssertObjectValueEqual(add.Execute(numbers, context), 5, "2 + 3"s);
+    ASSERT(add.GetSpecialization() == Specialization::Generic);
+    AssertObjectValueEqual(less.Execute(numbers, context), "True"s, "2 < 3"s);
+
+    const QuickeningStats& after = GetQuickeningStats();
+    ASSERT_EQUAL(after.specializations - before.specializations, 2U);
+    ASSERT_EQUAL(after.deoptimizations - before.deoptimizations, 2U);
+}
+
 void TestOr() {
     auto test_or = [](bool lhs, bool rhs) {
         Or or_statement{make_unique<BoolConst>(lhs), make_unique<BoolConst>(rhs)};
@@ -458,6 +608,7 @@ void TestNot() {
 void RunUnitTests(TestRunner& tr) {
     RUN_TEST(tr, ast::TestNumericConst);
     RUN_TEST(tr, ast::TestStringConst);
+    RUN_TEST(tr, ast::TestStringConstsAreInterned);
     RUN_TEST(tr, ast::TestVariable);
     RUN_TEST(tr, ast::TestAssignment);
     RUN_TEST(tr, ast::TestFieldAssignment);
@@ -469,10 +620,14 @@ void RunUnitTests(TestRunner& tr) {
     RUN_TEST(tr, ast::TestBadAddition);
     RUN_TEST(tr, ast::TestSuccessfulClassInstanceAdd);
     RUN_TEST(tr, ast::TestClassInstanceAddWithoutMethod);
+    RUN_TEST(tr, ast::TestNewInstanceCreatesDistinctObjects);
     RUN_TEST(tr, ast::TestCompound);
+    RUN_TEST(tr, ast::TestReturn);
     RUN_TEST(tr, ast::TestFields);
     RUN_TEST(tr, ast::TestBaseClass);
     RUN_TEST(tr, ast::TestInheritance);
+    RUN_TEST(tr, ast::TestMethodCallCache);
+    RUN_TEST(tr, ast::TestQuickening);
     RUN_TEST(tr, ast::TestOr);
     RUN_TEST(tr, ast::TestAnd);
     RUN_TEST(tr, ast::TestNot);
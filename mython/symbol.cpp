@@ -0,0 +1,51 @@
+#include "symbol.h"
+
+#include <deque>
+#include <mutex>
+#include <ostream>
+#include <unordered_map>
+
+using namespace std;
+
+namespace runtime {
+
+Symbol::Symbol()
+    : entry_{Intern({})} {
+}
+
+Symbol::Symbol(string_view name)
+    : entry_{Intern(name)} {
+}
+
+Symbol::Symbol(const string& name)
+    : entry_{Intern(name)} {
+}
+
+Symbol::Symbol(const char* name)
+    : entry_{Intern(name)} {
+}
+
+const Symbol::Entry* Symbol::Intern(string_view name) {
+    // Таблица создаётся при первом обращении, чтобы символы можно было использовать
+    // в инициализаторах глобальных констант
+    static mutex table_mutex;
+    static deque<Entry> entries;
+    static unordered_map<string_view, const Entry*> index;
+
+    lock_guard guard(table_mutex);
+
+    if (auto it = index.find(name); it != index.end()) {
+        return it->second;
+    }
+
+    const auto id = static_cast<uint32_t>(entries.size());
+    const auto& entry = entries.emplace_back(Entry{string(name), id});
+    index.emplace(entry.name, &entry);
+    return &entry;
+}
+
+ostream& operator<<(ostream& out, Symbol symbol) {
+    return out << symbol.GetName();
+}
+
+}  // namespace runtime
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <iosfwd>
+#include <string>
+#include <string_view>
+
+namespace runtime {
+
+// Интернированное имя: идентификатор, имя поля или метода.
+// Символы с одинаковыми именами ссылаются на одну запись глобальной таблицы символов,
+// поэтому сравнение символов сводится к сравнению указателей, а хеш символа - его номер
+class Symbol {
+public:
+    // Создаёт символ с пустым именем
+    Symbol();
+    // Возвращают символ для имени name, при необходимости добавляя имя в таблицу символов
+    Symbol(std::string_view name);   // NOLINT(google-explicit-constructor,hicpp-explicit-conversions)
+    Symbol(const std::string& name);  // NOLINT(google-explicit-constructor,hicpp-explicit-conversions)
+    Symbol(const char* name);         // NOLINT(google-explicit-constructor,hicpp-explicit-conversions)
+
+    // Возвращает имя символа
+    [[nodiscard]] const std::string& GetName() const {
+        return entry_->name;
+    }
+
+    // Возвращает порядковый номер символа в таблице символов.
+    // Номера выдаются подряд, начиная с нуля
+    [[nodiscard]] std::uint32_t GetId() const {
+        return entry_->id;
+    }
+
+    friend bool operator==(Symbol lhs, Symbol rhs) {
+        return lhs.entry_ == rhs.entry_;
+    }
+
+    friend bool operator!=(Symbol lhs, Symbol rhs) {
+        return lhs.entry_ != rhs.entry_;
+    }
+
+private:
+    struct Entry {
+        std::string name;
+        std::uint32_t id;
+    };
+
+    static const Entry* Intern(std::string_view name);
+
+    const Entry* entry_;
+};
+
+std::ostream& operator<<(std::ostream& out, Symbol symbol);
+
+}  // namespace runtime
+
+namespace std {
+
+template <>
+struct hash<runtime::Symbol> {
+    size_t operator()(runtime::Symbol symbol) const noexcept {
+        return symbol.GetId();
+    }
+};
+
+}  // namespace std
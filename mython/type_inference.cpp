@@ -0,0 +1,527 @@
+#include "type_inference.h"
+
+#include "optimizer.h"
+
+#include <algorithm>
+#include <map>
+#include <set>
+#include <sstream>
+#include <unordered_map>
+#include <vector>
+
+using namespace std;
+
+namespace ast {
+
+namespace {
+
+const runtime::Symbol SELF{"self"sv};
+const runtime::Symbol INIT{"__init__"sv};
+
+// Множество типов, которые может иметь значение выражения
+class TypeSet {
+public:
+    enum Primitive : uint8_t {
+        NONE = 1U << 0U,
+        NUMBER = 1U << 1U,
+        STRING = 1U << 2U,
+        BOOL = 1U << 3U,
+    };
+
+    TypeSet() = default;
+
+    static TypeSet Of(Primitive primitive) {
+        TypeSet result;
+        result.primitives_ = primitive;
+        return result;
+    }
+
+    static TypeSet Instance(const runtime::Class* cls) {
+        TypeSet result;
+        result.classes_.insert(cls);
+        return result;
+    }
+
+    // Значение любого типа, в том числе объект класса
+    static TypeSet Any() {
+        TypeSet result;
+        result.any_ = true;
+        return result;
+    }
+
+    // Объединяет множество с other. Возвращает true, если множество изменилось
+    bool Merge(const TypeSet& other) {
+        if (any_) {
+            return false;
+        }
+        if (other.any_) {
+            *this = Any();
+            return true;
+        }
+
+        bool changed = (primitives_ | other.primitives_) != primitives_;
+        primitives_ |= other.primitives_;
+        for (const runtime::Class* cls : other.classes_) {
+            changed = classes_.insert(cls).second || changed;
+        }
+        return changed;
+    }
+
+    [[nodiscard]] bool IsAny() const {
+        return any_;
+    }
+
+    [[nodiscard]] bool MayBe(Primitive primitive) const {
+        return any_ || (primitives_ & primitive) != 0;
+    }
+
+    // Возвращает true, если значение всегда имеет тип primitive
+    [[nodiscard]] bool IsOnly(Primitive primitive) const {
+        return !any_ && classes_.empty() && primitives_ == primitive;
+    }
+
+    [[nodiscard]] bool MayBeInstance() const {
+        return any_ || !classes_.empty();
+    }
+
+    // Возвращает класс, экземпляром которого всегда является значение, либо nullptr
+    [[nodiscard]] const runtime::Class* GetOnlyClass() const {
+        return !any_ && primitives_ == 0 && classes_.size() == 1 ? *classes_.begin() : nullptr;
+    }
+
+    [[nodiscard]] const set<const runtime::Class*>& GetClasses() const {
+        return classes_;
+    }
+
+    [[nodiscard]] string ToString() const {
+        if (any_) {
+            return "Any"s;
+        }
+
+        vector<string> names;
+        const pair<Primitive, const char*> primitive_names[] = {
+            {NONE, "None"}, {NUMBER, "Number"}, {STRING, "String"}, {BOOL, "Bool"}};
+        for (auto [primitive, name] : primitive_names) {
+            if (primitives_ & primitive) {
+                names.emplace_back(name);
+            }
+        }
+        vector<string> class_names;
+        for (const runtime::Class* cls : classes_) {
+            class_names.push_back(cls->GetName());
+        }
+        sort(class_names.begin(), class_names.end());
+        names.insert(names.end(), class_names.begin(), class_names.end());
+
+        if (names.empty()) {
+            return "Never"s;
+        }
+        string result = names[0];
+        for (size_t i = 1; i < names.size(); ++i) {
+            result += " | "s + names[i];
+        }
+        return result;
+    }
+
+private:
+    bool any_ = false;
+    uint8_t primitives_ = 0;
+    set<const runtime::Class*> classes_;
+};
+
+// Вычисляет типы выражений, повторяя обход программы и тел методов, пока типы переменных,
+// полей, параметров и результатов методов не перестанут расширяться
+class TypeInference : public Visitor {
+public:
+    TypeInferenceResult Infer(Statement& program) {
+        do {
+            changed_ = false;
+            Visit(program);
+        } while (changed_);
+
+        annotate_ = true;
+        Visit(program);
+        result_.description = Describe();
+        return move(result_);
+    }
+
+    void Visit([[maybe_unused]] NumericConst& node) override {
+        type_ = TypeSet::Of(TypeSet::NUMBER);
+    }
+    void Visit([[maybe_unused]] StringConst& node) override {
+        type_ = TypeSet::Of(TypeSet::STRING);
+    }
+    void Visit([[maybe_unused]] BoolConst& node) override {
+        type_ = TypeSet::Of(TypeSet::BOOL);
+    }
+    void Visit([[maybe_unused]] None& node) override {
+        type_ = TypeSet::Of(TypeSet::NONE);
+    }
+
+    void Visit(VariableValue& node) override {
+        TypeSet type = ReadVariable(node.GetName());
+        for (runtime::Symbol field : node.GetFieldNames()) {
+            type = type.MayBeInstance() ? fields_[field] : TypeSet();
+        }
+        type_ = move(type);
+    }
+
+    void Visit(Assignment& node) override {
+        AssignVariable(node.GetName(), Infer(node.Value()));
+        type_ = TypeSet::Of(TypeSet::NONE);
+    }
+
+    void Visit(FieldAssignment& node) override {
+        Visit(node.Object());
+        Merge(fields_[node.GetFieldName()], Infer(node.Value()));
+        type_ = TypeSet::Of(TypeSet::NONE);
+    }
+
+    void Visit(Print& node) override {
+        for (auto& arg : node.Args()) {
+            Infer(arg);
+        }
+        type_ = TypeSet::Of(TypeSet::NONE);
+    }
+
+    void Visit(MethodCall& node) override {
+        const TypeSet receiver = Infer(node.Object());
+        vector<TypeSet> args;
+        for (auto& arg : node.Args()) {
+            args.push_back(Infer(arg));
+        }
+
+        TypeSet result;
+        for (const runtime::Method* method : FindTargets(receiver, node.GetMethodName(),
+                                                         args.size())) {
+            Call(*method, args);
+            result.Merge(GetMethodInfo(*method).result);
+        }
+
+        if (annotate_) {
+            if (const runtime::Class* cls = receiver.GetOnlyClass()) {
+                if (auto method = cls->GetMethod(node.GetMethodName(), args.size())) {
+                    node.SetProvenMethod(method);
+                    ++result_.typed_calls;
+                }
+            }
+        }
+        type_ = move(result);
+    }
+
+    void Visit(NewInstance& node) override {
+        vector<TypeSet> args;
+        for (auto& arg : node.Args()) {
+            args.push_back(Infer(arg));
+        }
+        if (auto init = node.GetClass().GetMethod(INIT, args.size())) {
+            Call(*init, args);
+        }
+        type_ = TypeSet::Instance(&node.GetClass());
+    }
+
+    void Visit(Stringify& node) override {
+        Infer(node.Argument());
+        type_ = TypeSet::Of(TypeSet::STRING);
+    }
+
+    void Visit(Add& node) override {
+        const TypeSet lhs = Infer(node.Lhs());
+        const TypeSet rhs = Infer(node.Rhs());
+
+        // Сложение экземпляров классов вызывает метод __add__, результат которого не выводится
+        if (lhs.MayBeInstance()) {
+            type_ = TypeSet::Any();
+        } else {
+            type_ = TypeSet();
+            if (lhs.MayBe(TypeSet::NUMBER) && rhs.MayBe(TypeSet::NUMBER)) {
+                type_.Merge(TypeSet::Of(TypeSet::NUMBER));
+            }
+            if (lhs.MayBe(TypeSet::STRING) && rhs.MayBe(TypeSet::STRING)) {
+                type_.Merge(TypeSet::Of(TypeSet::STRING));
+            }
+        }
+        Annotate(node, lhs, rhs, true);
+    }
+
+    void Visit(Sub& node) override {
+        VisitArithmetic(node);
+    }
+    void Visit(Mult& node) override {
+        VisitArithmetic(node);
+    }
+    void Visit(Div& node) override {
+        VisitArithmetic(node);
+    }
+
+    void Visit(Or& node) override {
+        VisitLogical(node);
+    }
+    void Visit(And& node) override {
+        VisitLogical(node);
+    }
+
+    void Visit(Not& node) override {
+        Infer(node.Argument());
+        type_ = TypeSet::Of(TypeSet::BOOL);
+    }
+
+    void Visit(Compound& node) override {
+        for (auto& statement : node.Statements()) {
+            Infer(statement);
+        }
+        type_ = TypeSet::Of(TypeSet::NONE);
+    }
+
+    void Visit(MethodBody& node) override {
+        Infer(node.Body());
+        type_ = TypeSet::Of(TypeSet::NONE);
+    }
+
+    void Visit(Return& node) override {
+        const TypeSet value = Infer(node.Value());
+        if (method_ != nullptr) {
+            Merge(GetMethodInfo(*method_).result, value);
+        }
+        type_ = TypeSet::Of(TypeSet::NONE);
+    }
+
+    void Visit(ClassDefinition& node) override {
+        runtime::Class& cls = node.GetClass();
+        AssignVariable(cls.GetName(), TypeSet::Any());
+
+        if (find(classes_.begin(), classes_.end(), &cls) == classes_.end()) {
+            classes_.push_back(&cls);
+            changed_ = true;
+        }
+
+        const runtime::Method* saved_method = method_;
+        for (runtime::Method& method : cls.Methods()) {
+            method_ = &method;
+            MethodInfo& info = GetMethodInfo(method);
+            info.owner = &cls;
+            if (auto body = dynamic_cast<Statement*>(method.body.get())) {
+                Visit(*body);
+                if (!AlwaysReturns(*body)) {
+                    Merge(info.result, TypeSet::Of(TypeSet::NONE));
+                }
+            } else {
+                Merge(info.result, TypeSet::Any());
+            }
+        }
+        method_ = saved_method;
+        type_ = TypeSet::Of(TypeSet::NONE);
+    }
+
+    void Visit(IfElse& node) override {
+        Infer(node.Condition());
+        Infer(node.IfBody());
+        Infer(node.ElseBody());
+        type_ = TypeSet::Of(TypeSet::NONE);
+    }
+
+    void Visit(Comparison& node) override {
+        const TypeSet lhs = Infer(node.Lhs());
+        const TypeSet rhs = Infer(node.Rhs());
+        if (node.GetOp()) {
+            Annotate(node, lhs, rhs, true);
+        }
+        type_ = TypeSet::Of(TypeSet::BOOL);
+    }
+
+private:
+    struct MethodInfo {
+        // Класс, в котором объявлен метод
+        const runtime::Class* owner = nullptr;
+        TypeSet result;
+        // Типы параметров и локальных переменных
+        unordered_map<runtime::Symbol, TypeSet> variables;
+    };
+
+    void Visit(Statement& node) {
+        node.Accept(*this);
+    }
+
+    TypeSet Infer(unique_ptr<Statement>& node) {
+        type_ = TypeSet();
+        if (node) {
+            node->Accept(*this);
+        }
+        return move(type_);
+    }
+
+    void VisitArithmetic(BinaryOperation& node) {
+        const TypeSet lhs = Infer(node.Lhs());
+        const TypeSet rhs = Infer(node.Rhs());
+        type_ = TypeSet::Of(TypeSet::NUMBER);
+        Annotate(node, lhs, rhs, false);
+    }
+
+    void VisitLogical(BinaryOperation& node) {
+        Infer(node.Lhs());
+        Infer(node.Rhs());
+        type_ = TypeSet::Of(TypeSet::BOOL);
+    }
+
+    // Закрепляет вариант операции, если типы обоих операндов доказаны
+    void Annotate(BinaryOperation& node, const TypeSet& lhs, const TypeSet& rhs,
+                  bool strings_allowed) {
+        if (!annotate_) {
+            return;
+        }
+        if (lhs.IsOnly(TypeSet::NUMBER) && rhs.IsOnly(TypeSet::NUMBER)) {
+            node.SetProvenSpecialization(BinaryOperation::Specialization::IntInt);
+            ++result_.typed_operations;
+        } else if (strings_allowed && lhs.IsOnly(TypeSet::STRING)
+                   && rhs.IsOnly(TypeSet::STRING)) {
+            node.SetProvenSpecialization(BinaryOperation::Specialization::StrStr);
+            ++result_.typed_operations;
+        }
+    }
+
+    MethodInfo& GetMethodInfo(const runtime::Method& method) {
+        auto [it, inserted] = methods_.try_emplace(&method);
+        if (inserted) {
+            method_order_.push_back(&method);
+            // Методы с именами вида __name__ вызывает интерпретатор с аргументами любых типов
+            const string& name = method.name.GetName();
+            if (method.name != INIT && name.size() > 4 && name.substr(0, 2) == "__"s) {
+                for (runtime::Symbol param : method.formal_params) {
+                    it->second.variables[param] = TypeSet::Any();
+                }
+            }
+        }
+        return it->second;
+    }
+
+    // Передаёт типы аргументов в параметры метода
+    void Call(const runtime::Method& method, const vector<TypeSet>& args) {
+        MethodInfo& info = GetMethodInfo(method);
+        for (size_t i = 0; i < args.size() && i < method.formal_params.size(); ++i) {
+            Merge(info.variables[method.formal_params[i]], args[i]);
+        }
+    }
+
+    // Возвращает методы, которые может вызвать obj.name(...) с argument_count аргументами
+    // для объекта obj типа receiver
+    vector<const runtime::Method*> FindTargets(const TypeSet& receiver, runtime::Symbol name,
+                                               size_t argument_count) const {
+        vector<const runtime::Method*> targets;
+        auto add = [&](const runtime::Class* cls) {
+            const runtime::Method* method = cls->GetMethod(name, argument_count);
+            if (method != nullptr
+                && find(targets.begin(), targets.end(), method) == targets.end()) {
+                targets.push_back(method);
+            }
+        };
+
+        if (receiver.IsAny()) {
+            for (const runtime::Class* cls : classes_) {
+                add(cls);
+            }
+        } else {
+            for (const runtime::Class* cls : receiver.GetClasses()) {
+                add(cls);
+            }
+        }
+        return targets;
+    }
+
+    // Тип self - классы, в которых действует текущий метод
+    TypeSet SelfType() const {
+        TypeSet result;
+        for (const runtime::Class* cls : classes_) {
+            if (cls->GetMethod(method_->name) == method_) {
+                result.Merge(TypeSet::Instance(cls));
+            }
+        }
+        return result;
+    }
+
+    TypeSet ReadVariable(runtime::Symbol name) {
+        if (method_ == nullptr) {
+            return globals_[name];
+        }
+        TypeSet type = GetMethodInfo(*method_).variables[name];
+        if (name == SELF) {
+            type.Merge(SelfType());
+        }
+        return type;
+    }
+
+    void AssignVariable(runtime::Symbol name, const TypeSet& type) {
+        if (method_ == nullptr) {
+            Merge(globals_[name], type);
+        } else {
+            Merge(GetMethodInfo(*method_).variables[name], type);
+        }
+    }
+
+    void Merge(TypeSet& target, const TypeSet& type) {
+        changed_ = target.Merge(type) || changed_;
+    }
+
+    string Describe() {
+        ostringstream out;
+
+        auto print_variables = [&out](const auto& variables, const vector<runtime::Symbol>& skip,
+                                      const string& indent) {
+            map<string, string> sorted;
+            for (const auto& [name, type] : variables) {
+                if (find(skip.begin(), skip.end(), name) == skip.end()) {
+                    sorted.emplace(name.GetName(), type.ToString());
+                }
+            }
+            for (const auto& [name, type] : sorted) {
+                out << indent << name << ": "sv << type << '\n';
+            }
+        };
+
+        out << "Globals:\n"sv;
+        print_variables(globals_, {}, "  "s);
+        out << "Fields:\n"sv;
+        print_variables(fields_, {}, "  "s);
+        out << "Methods:\n"sv;
+        for (const runtime::Method* method : method_order_) {
+            MethodInfo& info = methods_.at(method);
+            out << "  "sv << (info.owner != nullptr ? info.owner->GetName() + "."s : ""s)
+                << method->name.GetName() << '(';
+            bool first = true;
+            for (runtime::Symbol param : method->formal_params) {
+                out << (first ? ""sv : ", "sv) << param.GetName() << ": "sv
+                    << info.variables[param].ToString();
+                first = false;
+            }
+            out << ") -> "sv << info.result.ToString() << '\n';
+
+            vector<runtime::Symbol> skip = method->formal_params;
+            skip.push_back(SELF);
+            print_variables(info.variables, skip, "    "s);
+        }
+        out << "Typed operations: "sv << result_.typed_operations << ", typed calls: "sv
+            << result_.typed_calls << '\n';
+        return out.str();
+    }
+
+    vector<const runtime::Class*> classes_;
+    unordered_map<const runtime::Method*, MethodInfo> methods_;
+    vector<const runtime::Method*> method_order_;
+    unordered_map<runtime::Symbol, TypeSet> globals_;
+    unordered_map<runtime::Symbol, TypeSet> fields_;
+
+    // Метод, тело которого обходится, либо nullptr для кода верхнего уровня
+    const runtime::Method* method_ = nullptr;
+    // Тип последнего вычисленного выражения
+    TypeSet type_;
+    bool changed_ = false;
+    bool annotate_ = false;
+    TypeInferenceResult result_;
+};
+
+}  // namespace
+
+TypeInferenceResult InferTypes(Statement& program) {
+    return TypeInference().Infer(program);
+}
+
+}  // namespace ast
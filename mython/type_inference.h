@@ -0,0 +1,32 @@
+#pragma once
+
+#include "statement.h"
+
+#include <string>
+
+namespace ast {
+
+// Результат вывода типов
+struct TypeInferenceResult {
+    // Арифметические операции и сравнения, типы операндов которых доказаны
+    size_t typed_operations = 0;
+    // Вызовы методов, класс объекта которых доказан
+    size_t typed_calls = 0;
+    // Выведенные типы глобальных переменных, полей, параметров, результатов
+    // и локальных переменных методов в текстовом виде
+    std::string description;
+};
+
+// Выводит типы выражений программы, полученной от ParseProgram, и методов объявленных в ней
+// классов. Вывод не учитывает порядок выполнения: тип переменной объединяет типы всех
+// присваиваемых ей значений, тип поля - типы значений, присваиваемых полю с таким именем
+// у любого объекта, тип параметра - типы аргументов всех вызовов, которые могут попасть
+// в метод. Параметры методов, вызываемых самим интерпретатором (__str__, __eq__ и т.п.),
+// могут иметь любой тип.
+// Операциям над значениями доказанных типов назначается вариант без проверки типов операндов,
+// а вызовам методов объекта доказанного класса - заранее найденный метод. Поэтому программа
+// после вывода типов должна выполняться целиком: вызов её методов извне с аргументами
+// других типов недопустим
+TypeInferenceResult InferTypes(Statement& program);
+
+}  // namespace ast
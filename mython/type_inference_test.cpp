@@ -0,0 +1,115 @@
+#include "program_test_utils.h"
+#include "test_runner.h"
+#include "type_inference.h"
+
+using namespace std;
+
+namespace ast {
+
+namespace {
+
+// Возвращает значение, присваиваемое index-й инструкцией программы
+Statement& AssignedValue(Statement& program, size_t index) {
+    auto& statements = dynamic_cast<Compound&>(program).Statements();
+    return *dynamic_cast<Assignment&>(*statements.at(index)).Value();
+}
+
+void TestOperationsOnProvenTypes() {
+    const string program = R"(
+x = 2
+y = x * 3 + 1
+s = "a" + "b"
+z = 1
+z = "c"
+w = z + z
+print y, s, w
+)"s;
+
+    auto tree = ParseFromString(program);
+    const auto result = InferTypes(*tree);
+
+    ASSERT(dynamic_cast<Add&>(AssignedValue(*tree, 1)).IsProven());
+    ASSERT(dynamic_cast<Add&>(AssignedValue(*tree, 2)).IsProven());
+    // Переменной z присваиваются значения разных типов
+    ASSERT(!dynamic_cast<Add&>(AssignedValue(*tree, 5)).IsProven());
+    ASSERT_EQUAL(result.typed_operations, 3U);
+
+    ASSERT_EQUAL(Run(*tree), "7 ab cc\n"s);
+}
+
+void TestMethodsAndFields() {
+    const string program = R"(
+class Point:
+  def __init__(x, y):
+    self.x = x
+    self.y = y
+
+  def norm():
+    return self.x * self.x + self.y * self.y
+
+class Shape:
+  def area():
+    return 0
+
+class Square(Shape):
+  def __init__(side):
+    self.side = side
+
+  def area():
+    return self.side * self.side
+
+p = Point(3, 4)
+n = p.norm()
+shapes = Shape()
+if n > 10:
+  shapes = Square(2)
+print n, shapes.area()
+)"s;
+
+    auto tree = ParseFromString(program);
+    const auto result = InferTypes(*tree);
+
+    // Вызов p.norm() связан с методом заранее, вызов shapes.area() - нет
+    auto& norm_call = dynamic_cast<MethodCall&>(AssignedValue(*tree, 4));
+    ASSERT(norm_call.GetProvenMethod() != nullptr);
+    ASSERT_EQUAL(result.typed_calls, 1U);
+
+    ASSERT(result.description.find("  p: Point\n"s) != string::npos);
+    ASSERT(result.description.find("  shapes: Shape | Square\n"s) != string::npos);
+    ASSERT(result.description.find("  x: Number\n"s) != string::npos);
+    ASSERT(result.description.find("Point.norm() -> Number\n"s) != string::npos);
+    ASSERT(result.description.find("Square.__init__(side: Number) -> None\n"s) != string::npos);
+
+    ASSERT_EQUAL(Run(*tree), "25 4\n"s);
+}
+
+void TestSpecialMethodParametersAreAny() {
+    const string program = R"(
+class Money:
+  def __init__(amount):
+    self.amount = amount
+
+  def __add__(other):
+    return self.amount + other
+
+m = Money(5)
+print m + 3, m + 0
+)"s;
+
+    auto tree = ParseFromString(program);
+    const auto result = InferTypes(*tree);
+
+    // Параметр __add__ может иметь любой тип, поэтому сложение в нём не доказано
+    ASSERT(result.description.find("Money.__add__(other: Any)"s) != string::npos);
+    ASSERT_EQUAL(Run(*tree), "8 5\n"s);
+}
+
+}  // namespace
+
+void RunTypeInferenceTests(TestRunner& tr) {
+    RUN_TEST(tr, ast::TestOperationsOnProvenTypes);
+    RUN_TEST(tr, ast::TestMethodsAndFields);
+    RUN_TEST(tr, ast::TestSpecialMethodParametersAreAny);
+}
+
+}  // namespace ast
@@ -0,0 +1,1031 @@
+#include "vm.h"
+
+#include <algorithm>
+#include <cassert>
+#include <optional>
+#include <sstream>
+#include <unordered_map>
+
+// GCC и Clang позволяют переходить по адресу метки. Обработчик каждой инструкции тогда
+// сам выбирает следующий обработчик, а не возвращается к общему switch
+#if defined(__GNUC__)
+#define MYTHON_VM_THREADED_DISPATCH
+#endif
+
+using namespace std;
+
+namespace vm {
+
+using runtime::Closure;
+using runtime::Context;
+using runtime::ObjectHolder;
+using runtime::ObjectType;
+
+namespace {
+
+const runtime::Symbol ADD_METHOD{"__add__"sv};
+const runtime::Symbol INIT_METHOD{"__init__"sv};
+
+// Значение регистра локальной переменной, которой ещё не присвоено значение
+class UnboundValue : public runtime::Object {
+public:
+    void Print(ostream& out, [[maybe_unused]] Context& context) override {
+        out << "<unbound>"sv;
+    }
+};
+
+runtime::Object& GetUnbound() {
+    static UnboundValue unbound;
+    return unbound;
+}
+
+// Компилятор дерева разбора в байткод. Один экземпляр компилирует код верхнего уровня
+// либо тело одного метода
+class Compiler : public ast::Visitor {
+public:
+    // Создаёт компилятор кода верхнего уровня
+    explicit Compiler(Machine& machine)
+        : machine_{machine} {
+    }
+
+    // Создаёт компилятор тела метода method, переменным которого парсер назначил слоты
+    Compiler(Machine& machine, const runtime::Method& method)
+        : machine_{machine}, in_method_{true} {
+        const auto frame_size = static_cast<uint32_t>(method.frame_size);
+        code_->param_count = static_cast<uint32_t>(method.formal_params.size());
+        code_->register_count = frame_size;
+        temp_top_ = frame_size;
+
+        bound_.assign(frame_size, false);
+        fill_n(bound_.begin(), code_->param_count + 1, true);
+    }
+
+    unique_ptr<Code> CompileBody(ast::Statement& body) {
+        CompileStatement(body);
+        Emit(OpCode::ReturnNone);
+
+        if (needs_unbound_init_) {
+            code_->unbound_begin = code_->param_count + 1;
+            code_->unbound_end = static_cast<uint32_t>(bound_.size());
+        }
+        return move(code_);
+    }
+
+    void Visit(ast::NumericConst& node) override {
+        VisitConst(node);
+    }
+
+    void Visit(ast::StringConst& node) override {
+        VisitConst(node);
+    }
+
+    void Visit(ast::BoolConst& node) override {
+        VisitConst(node);
+    }
+
+    void Visit(ast::VariableValue& node) override {
+        const auto& fields = node.GetFieldNames();
+        uint32_t object;
+
+        if (auto slot = node.GetSlot()) {
+            object = static_cast<uint32_t>(*slot);
+            if (!bound_.at(object)) {
+                Emit(OpCode::CheckBound, object, AddName(node.GetName()));
+                needs_unbound_init_ = true;
+            }
+            if (fields.empty()) {
+                result_ = object;
+                return;
+            }
+        } else {
+            object = Destination();
+            Emit(OpCode::LoadGlobal, object, AddName(node.GetName()));
+            if (fields.empty()) {
+                result_ = object;
+                return;
+            }
+        }
+
+        const uint32_t dst = target_ ? *target_ : (node.GetSlot() ? AllocateTemp() : object);
+        runtime::Symbol name = node.GetName();
+        for (runtime::Symbol field : fields) {
+            Emit(OpCode::GetField, dst, object, AddName(field), AddName(name));
+            object = dst;
+            name = field;
+        }
+        result_ = dst;
+    }
+
+    void Visit(ast::Assignment& node) override {
+        if (auto slot = node.GetSlot()) {
+            const auto dst = static_cast<uint32_t>(*slot);
+            CompileInto(*node.Value(), dst);
+            bound_.at(dst) = true;
+        } else {
+            const uint32_t value = CompileOperand(*node.Value());
+            Emit(OpCode::StoreGlobal, AddName(node.GetName()), value);
+        }
+    }
+
+    void Visit(ast::FieldAssignment& node) override {
+        const uint32_t object = CompileOperand(node.Object());
+        if (!IsSelf(object)) {
+            Emit(OpCode::CheckInstance, object, 1);
+        }
+        const uint32_t value = CompileOperand(*node.Value());
+        Emit(OpCode::SetField, object, AddName(node.GetFieldName()), value);
+    }
+
+    void Visit([[maybe_unused]] ast::None& node) override {
+        result_ = Destination();
+        Emit(OpCode::LoadNone, result_);
+    }
+
+    void Visit(ast::Print& node) override {
+        bool first = true;
+        for (auto& arg : node.Args()) {
+            if (!first) {
+                Emit(OpCode::PrintSpace);
+            }
+            const uint32_t mark = temp_top_;
+            Emit(OpCode::PrintItem, CompileOperand(*arg));
+            temp_top_ = mark;
+            first = false;
+        }
+        Emit(OpCode::PrintNewline);
+    }
+
+    void Visit(ast::MethodCall& node) override {
+        const uint32_t dst = Destination();
+        const uint32_t mark = temp_top_;
+
+        const uint32_t object = CompileOperand(*node.Object());
+        if (!IsSelf(object)) {
+            Emit(OpCode::CheckInstance, object, 0);
+        }
+        const uint32_t args = CompileArgs(node.Args());
+
+        CallSite site;
+        site.name = node.GetMethodName();
+        site.argument_count = static_cast<uint32_t>(node.Args().size());
+        Emit(OpCode::Call, dst, object, AddCallSite(move(site)), args);
+
+        temp_top_ = mark;
+        result_ = dst;
+    }
+
+    void Visit(ast::NewInstance& node) override {
+        const runtime::Class& cls = node.GetClass();
+        const runtime::Method* init = cls.GetMethod(INIT_METHOD, node.Args().size());
+
+        // Аргументы __init__ могут читать переменную, которой присваивается новый объект,
+        // поэтому объект создаётся во временном регистре
+        const uint32_t instance = init != nullptr && target_ ? AllocateTemp() : Destination();
+        const uint32_t mark = temp_top_;
+
+        Emit(OpCode::New, instance, AddClass(cls));
+        if (init != nullptr) {
+            const uint32_t args = CompileArgs(node.Args());
+            CallSite site;
+            site.name = INIT_METHOD;
+            site.argument_count = static_cast<uint32_t>(node.Args().size());
+            site.target.method = init;
+            Emit(OpCode::CallStatic, AllocateTemp(), instance, AddCallSite(move(site)), args);
+        }
+
+        temp_top_ = mark;
+        result_ = instance;
+    }
+
+    void Visit(ast::Stringify& node) override {
+        VisitUnary(OpCode::Stringify, node);
+    }
+
+    void Visit(ast::Add& node) override {
+        VisitBinary(OpCode::Add, node);
+    }
+
+    void Visit(ast::Sub& node) override {
+        VisitBinary(OpCode::Sub, node);
+    }
+
+    void Visit(ast::Mult& node) override {
+        VisitBinary(OpCode::Mult, node);
+    }
+
+    void Visit(ast::Div& node) override {
+        VisitBinary(OpCode::Div, node);
+    }
+
+    void Visit(ast::Or& node) override {
+        VisitLogical(OpCode::JumpIfTrue, node);
+    }
+
+    void Visit(ast::And& node) override {
+        VisitLogical(OpCode::JumpIfFalse, node);
+    }
+
+    void Visit(ast::Not& node) override {
+        VisitUnary(OpCode::Not, node);
+    }
+
+    void Visit(ast::Compound& node) override {
+        for (auto& statement : node.Statements()) {
+            // Инструкции после return никогда не выполняются
+            if (terminated_) {
+                break;
+            }
+            CompileStatement(*statement);
+        }
+    }
+
+    void Visit(ast::MethodBody& node) override {
+        CompileStatement(*node.Body());
+    }
+
+    void Visit(ast::Return& node) override {
+        const uint32_t value = CompileOperand(*node.Value());
+        auto call = dynamic_cast<ast::MethodCall*>(node.Value().get());
+        if (in_method_ && call != nullptr && call->IsTailCall()) {
+            code_->instructions.back().op = OpCode::TailCall;
+        }
+        Emit(OpCode::Return, value);
+        terminated_ = true;
+    }
+
+    void Visit(ast::ClassDefinition& node) override {
+        const uint32_t cls = AddConstant(node.GetClassHolder());
+
+        if (auto slot = node.GetSlot()) {
+            const auto dst = static_cast<uint32_t>(*slot);
+            Emit(OpCode::LoadConst, dst, cls);
+            bound_.at(dst) = true;
+        } else {
+            const uint32_t value = AllocateTemp();
+            Emit(OpCode::LoadConst, value, cls);
+            Emit(OpCode::StoreGlobal, AddName(node.GetClass().GetName()), value);
+        }
+
+        CompileMethods(node.GetClass());
+    }
+
+    void Visit(ast::IfElse& node) override {
+        const size_t jump_to_else = CompileConditionalJump(*node.Condition());
+
+        const vector<bool> bound_before = bound_;
+        CompileBranch(*node.IfBody());
+        const vector<bool> bound_if = move(bound_);
+        const bool terminated_if = terminated_;
+
+        bound_ = bound_before;
+        terminated_ = false;
+
+        if (node.ElseBody()) {
+            const size_t jump_to_end = Emit(OpCode::Jump);
+            PatchJump(jump_to_else);
+            CompileBranch(*node.ElseBody());
+            PatchJump(jump_to_end);
+        } else {
+            PatchJump(jump_to_else);
+        }
+
+        // Переменная получила значение после if, если она получила его в каждой ветке,
+        // которая не завершилась инструкцией return
+        if (terminated_if && !terminated_) {
+            return;
+        }
+        if (!terminated_if && terminated_) {
+            bound_ = bound_if;
+            terminated_ = false;
+            return;
+        }
+        for (size_t i = 0; i < bound_.size(); ++i) {
+            bound_[i] = bound_[i] && bound_if[i];
+        }
+        terminated_ = terminated_ && terminated_if;
+    }
+
+    void Visit(ast::Comparison& node) override {
+        auto op = node.GetOp();
+        if (!op) {
+            throw runtime_error("Comparison with a custom comparator can't be compiled"s);
+        }
+        VisitBinary(OpCode::Compare, node, static_cast<uint32_t>(*op));
+    }
+
+private:
+    template <typename T>
+    void VisitConst(ast::ValueStatement<T>& node) {
+        const uint32_t constant = AddConstant(node.GetHolder());
+        if (constant_allowed_ && !target_) {
+            result_ = constant | CONSTANT_OPERAND;
+            return;
+        }
+        result_ = Destination();
+        Emit(OpCode::LoadConst, result_, constant);
+    }
+
+    void VisitUnary(OpCode op, ast::UnaryOperation& node) {
+        const uint32_t dst = Destination();
+        const uint32_t mark = temp_top_;
+        Emit(op, dst, CompileOperand(*node.Argument()));
+        temp_top_ = mark;
+        result_ = dst;
+    }
+
+    void VisitBinary(OpCode op, ast::BinaryOperation& node, uint32_t extra = 0) {
+        const uint32_t dst = Destination();
+        const uint32_t mark = temp_top_;
+        const uint32_t lhs = CompileConstantOperand(*node.Lhs());
+        const uint32_t rhs = CompileConstantOperand(*node.Rhs());
+        Emit(op, dst, lhs, rhs, extra);
+        temp_top_ = mark;
+        result_ = dst;
+    }
+
+    // Компилирует переход к ещё не известному адресу, выполняемый, если condition ложно.
+    // Сравнение чисел в условии не создаёт промежуточного значения Bool
+    size_t CompileConditionalJump(ast::Statement& condition) {
+        const uint32_t mark = temp_top_;
+        size_t jump;
+
+        auto comparison = dynamic_cast<ast::Comparison*>(&condition);
+        if (comparison != nullptr && comparison->GetOp()) {
+            const uint32_t lhs = CompileConstantOperand(*comparison->Lhs());
+            const uint32_t rhs = CompileConstantOperand(*comparison->Rhs());
+            jump = Emit(OpCode::CompareJump, static_cast<uint32_t>(*comparison->GetOp()), lhs,
+                        rhs);
+        } else {
+            jump = Emit(OpCode::JumpIfFalse, CompileOperand(condition));
+        }
+
+        temp_top_ = mark;
+        return jump;
+    }
+
+    // Направляет переход, созданный инструкцией с номером index, к следующей инструкции
+    void PatchJump(size_t index) {
+        Instruction& jump = code_->instructions[index];
+        switch (jump.op) {
+            case OpCode::Jump:
+                jump.a = NextAddress();
+                break;
+            case OpCode::CompareJump:
+                jump.d = NextAddress();
+                break;
+            default:
+                jump.b = NextAddress();
+                break;
+        }
+    }
+
+    // Компилирует or (jump = JumpIfTrue) либо and (jump = JumpIfFalse).
+    // Промежуточный результат хранится во временном регистре: правый операнд может читать
+    // переменную, которой присваивается результат
+    void VisitLogical(OpCode jump, ast::BinaryOperation& node) {
+        const uint32_t value = AllocateTemp();
+        const uint32_t mark = temp_top_;
+
+        Emit(OpCode::Truth, value, CompileOperand(*node.Lhs()));
+        const size_t jump_to_end = Emit(jump, value);
+        temp_top_ = mark;
+        Emit(OpCode::Truth, value, CompileOperand(*node.Rhs()));
+        PatchJump(jump_to_end);
+
+        temp_top_ = mark;
+        if (target_) {
+            Emit(OpCode::Move, *target_, value);
+            result_ = *target_;
+        } else {
+            result_ = value;
+        }
+    }
+
+    void CompileBranch(ast::Statement& body) {
+        const uint32_t mark = temp_top_;
+        CompileStatement(body);
+        temp_top_ = mark;
+    }
+
+    // Компилирует тела методов класса, переменным которых парсер назначил слоты
+    void CompileMethods(runtime::Class& cls) {
+        for (runtime::Method& method : cls.Methods()) {
+            auto body = dynamic_cast<ast::Statement*>(method.body.get());
+            if (method.frame_size == 0 || body == nullptr) {
+                continue;
+            }
+            auto code = Compiler(machine_, method).CompileBody(*body);
+            method.body = make_unique<CompiledMethod>(move(method.body), move(code), machine_);
+        }
+    }
+
+    // Компилирует выражение, результат которого должен оказаться в регистре target,
+    // либо в любом регистре, если target не задан. Возвращает регистр с результатом
+    uint32_t Compile(ast::Statement& node, optional<uint32_t> target,
+                     bool constant_allowed = false) {
+        optional<uint32_t> saved_target = target_;
+        const bool saved_constant_allowed = constant_allowed_;
+        target_ = target;
+        constant_allowed_ = constant_allowed;
+        node.Accept(*this);
+        target_ = saved_target;
+        constant_allowed_ = saved_constant_allowed;
+        return result_;
+    }
+
+    uint32_t CompileOperand(ast::Statement& node) {
+        return Compile(node, nullopt);
+    }
+
+    // Компилирует операнд rk: константа не загружается в регистр
+    uint32_t CompileConstantOperand(ast::Statement& node) {
+        return Compile(node, nullopt, true);
+    }
+
+    void CompileInto(ast::Statement& node, uint32_t dst) {
+        const uint32_t mark = temp_top_;
+        const uint32_t result = Compile(node, dst);
+        if (result != dst) {
+            Emit(OpCode::Move, dst, result);
+        }
+        temp_top_ = mark;
+    }
+
+    void CompileStatement(ast::Statement& node) {
+        const uint32_t mark = temp_top_;
+        Compile(node, nullopt);
+        temp_top_ = mark;
+    }
+
+    // Вычисляет аргументы вызова в последовательных временных регистрах.
+    // Возвращает номер первого из них
+    uint32_t CompileArgs(vector<unique_ptr<ast::Statement>>& args) {
+        const uint32_t first = temp_top_;
+        for (auto& arg : args) {
+            const uint32_t reg = AllocateTemp();
+            CompileInto(*arg, reg);
+            temp_top_ = reg + 1;
+        }
+        return first;
+    }
+
+    // Возвращает регистр для результата выражения: заданный target_ либо новый временный
+    uint32_t Destination() {
+        return target_ ? *target_ : AllocateTemp();
+    }
+
+    uint32_t AllocateTemp() {
+        const uint32_t reg = temp_top_++;
+        code_->register_count = max(code_->register_count, temp_top_);
+        return reg;
+    }
+
+    // Регистр 0 метода всегда содержит self - экземпляр класса
+    [[nodiscard]] bool IsSelf(uint32_t reg) const {
+        return in_method_ && reg == 0;
+    }
+
+    size_t Emit(OpCode op, uint32_t a = 0, uint32_t b = 0, uint32_t c = 0, uint32_t d = 0) {
+        code_->instructions.push_back({op, a, b, c, d});
+        return code_->instructions.size() - 1;
+    }
+
+    [[nodiscard]] uint32_t NextAddress() const {
+        return static_cast<uint32_t>(code_->instructions.size());
+    }
+
+    uint32_t AddConstant(ObjectHolder value) {
+        code_->constants.push_back(move(value));
+        return static_cast<uint32_t>(code_->constants.size() - 1);
+    }
+
+    uint32_t AddName(runtime::Symbol name) {
+        auto [it, inserted] = name_indices_.emplace(name, code_->names.size());
+        if (inserted) {
+            code_->names.push_back(name);
+        }
+        return it->second;
+    }
+
+    uint32_t AddClass(const runtime::Class& cls) {
+        code_->classes.push_back(&cls);
+        return static_cast<uint32_t>(code_->classes.size() - 1);
+    }
+
+    uint32_t AddCallSite(CallSite site) {
+        code_->call_sites.push_back(move(site));
+        return static_cast<uint32_t>(code_->call_sites.size() - 1);
+    }
+
+    Machine& machine_;
+    unique_ptr<Code> code_ = make_unique<Code>();
+    unordered_map<runtime::Symbol, uint32_t> name_indices_;
+    bool in_method_ = false;
+
+    // Первый свободный временный регистр
+    uint32_t temp_top_ = 0;
+    // Регистр, в который следует поместить результат компилируемого выражения
+    optional<uint32_t> target_;
+    // Результат компилируемого выражения-константы может быть операндом rk
+    bool constant_allowed_ = false;
+    // Регистр (либо операнд rk), содержащий результат скомпилированного выражения
+    uint32_t result_ = 0;
+
+    // Переменные метода, которые гарантированно получили значение в текущей точке кода
+    vector<bool> bound_;
+    // Хотя бы одно чтение переменной требует проверки наличия значения
+    bool needs_unbound_init_ = false;
+    // Текущая точка кода недостижима: в ней уже выполнен return
+    bool terminated_ = false;
+};
+
+// Сравнивает операнды инструкции. Сравнение экземпляров классов может вызвать методы Mython,
+// поэтому операнды копируются
+bool CompareOperands(runtime::CompareOp op, const ObjectHolder& lhs, const ObjectHolder& rhs,
+                     Context& context) {
+    if (lhs.GetType() == ObjectType::Number && rhs.GetType() == ObjectType::Number) {
+        return runtime::ApplyCompareOp(op, lhs.AsNumber(), rhs.AsNumber());
+    }
+    return runtime::Compare(op, ObjectHolder(lhs), ObjectHolder(rhs), context);
+}
+
+const Code* GetCompiledCode(const runtime::Method& method, const Machine& machine) {
+    auto compiled = dynamic_cast<const CompiledMethod*>(method.body.get());
+    return compiled != nullptr && &compiled->GetMachine() == &machine ? &compiled->GetCode()
+                                                                      : nullptr;
+}
+
+}  // namespace
+
+CompiledMethod::CompiledMethod(unique_ptr<runtime::Executable> source, unique_ptr<Code> code,
+    Machine& machine)
+        : source_{move(source)}, code_{move(code)}, machine_{machine} {
+}
+
+ObjectHolder CompiledMethod::Execute([[maybe_unused]] Closure& closure, Context& context) {
+    return machine_.Invoke(*code_, context);
+}
+
+ObjectHolder Machine::Run(const Code& code, Closure& globals, Context& context) {
+    const size_t entry_depth = frames_.size();
+    PushFrame(code, 0);
+    return Execute(entry_depth, globals, context);
+}
+
+ObjectHolder Machine::Invoke(const Code& code, Context& context) {
+    const size_t entry_depth = frames_.size();
+    const size_t base = PushFrame(code, 0);
+
+    runtime::CallStack& stack = context.GetCallStack();
+    for (size_t i = 0; i <= code.param_count; ++i) {
+        registers_[base + i] = *stack.Slot(i);
+    }
+
+    Closure globals;
+    return Execute(entry_depth, globals, context);
+}
+
+size_t Machine::PushFrame(const Code& code, uint32_t result) {
+    if (frames_.size() >= MAX_CALL_DEPTH) {
+        throw runtime_error("Maximum call depth exceeded"s);
+    }
+
+    const size_t base =
+        frames_.empty() ? 0 : frames_.back().base + frames_.back().code->register_count;
+    const size_t end = base + code.register_count;
+    if (registers_.size() < end) {
+        registers_.resize(max(end, registers_.size() * 2));
+    }
+
+    if (jit_threshold_ != 0 && ++code.invocation_count == jit_threshold_) {
+        code.native_code = NativeCode::Compile(code);
+    }
+
+    for (size_t i = code.unbound_begin; i < code.unbound_end; ++i) {
+        registers_[base + i] = ObjectHolder::Share(GetUnbound());
+    }
+
+    frames_.push_back({&code, code.instructions.data(), base, result});
+    return base;
+}
+
+void Machine::Unwind(size_t entry_depth) noexcept {
+    while (frames_.size() > entry_depth) {
+        const Frame& frame = frames_.back();
+        for (size_t i = 0; i < frame.code->register_count; ++i) {
+            registers_[frame.base + i] = ObjectHolder();
+        }
+        frames_.pop_back();
+    }
+}
+
+#ifdef MYTHON_VM_THREADED_DISPATCH
+// Адреса меток и переход по ним - расширения GNU, о которых предупреждает -Wpedantic
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+#endif
+
+ObjectHolder Machine::Execute(size_t entry_depth, Closure& globals, Context& context) {
+    const runtime::Object* const unbound = &GetUnbound();
+    auto& cache_stats = ast::GetMethodCacheStats();
+
+    const Code* code = frames_.back().code;
+    const NativeCode* native = code->native_code.get();
+    const Instruction* pc = frames_.back().pc;
+    size_t base = frames_.back().base;
+    ObjectHolder* r = registers_.data() + base;
+
+    // Операции, способные вызвать методы Mython, могут перераспределить вектор регистров.
+    // После них указатель на регистры кадра загружается заново
+#define RELOAD_REGISTERS() (r = registers_.data() + base)
+#define RK(operand)                                                                     \
+    ((operand) & CONSTANT_OPERAND ? code->constants[(operand) ^ CONSTANT_OPERAND]     \
+                                  : r[(operand)])
+
+    // Машинный код выполняет инструкции до первой, которую должен выполнить интерпретатор
+#define VM_FETCH()                                                                     \
+    do {                                                                               \
+        if (native != nullptr) {                                                       \
+            const auto entry = static_cast<uint32_t>(pc - code->instructions.data());  \
+            pc = code->instructions.data() + native->Run(r, entry);                    \
+        }                                                                              \
+        ins = pc++;                                                                    \
+    } while (false)
+
+#ifdef MYTHON_VM_THREADED_DISPATCH
+    // Адреса обработчиков в порядке значений OpCode
+    static const void* const handlers[] = {
+        &&op_LoadConst, &&op_LoadNone, &&op_Move, &&op_CheckBound,
+        &&op_LoadGlobal, &&op_StoreGlobal, &&op_GetField, &&op_SetField,
+        &&op_CheckInstance, &&op_Add, &&op_Sub, &&op_Mult,
+        &&op_Div, &&op_Compare, &&op_Truth, &&op_Not,
+        &&op_Stringify, &&op_Jump, &&op_JumpIfFalse, &&op_JumpIfTrue,
+        &&op_CompareJump, &&op_Call, &&op_CallStatic, &&op_TailCall,
+        &&op_New, &&op_PrintSpace, &&op_PrintItem, &&op_PrintNewline,
+        &&op_Return, &&op_ReturnNone,
+    };
+    static_assert(size(handlers) == static_cast<size_t>(OpCode::ReturnNone) + 1);
+
+    // Первая инструкция выбирается через switch, следующие - переходом из обработчика
+    // предыдущей, что даёт предсказателю переходов отдельную точку ветвления на каждый
+    // обработчик
+#define VM_CASE(op) \
+    case OpCode::op: \
+    op_##op
+#define VM_NEXT()                                            \
+    do {                                                     \
+        VM_FETCH();                                          \
+        goto* handlers[static_cast<size_t>(ins->op)];        \
+    } while (false)
+#else
+#define VM_CASE(op) case OpCode::op
+#define VM_NEXT() continue
+#endif
+
+    const Instruction* ins = nullptr;
+    try {
+        for (;;) {
+            VM_FETCH();
+
+            switch (ins->op) {
+                VM_CASE(LoadConst):
+                    r[ins->a] = code->constants[ins->b];
+                    VM_NEXT();
+
+                VM_CASE(LoadNone):
+                    r[ins->a] = ObjectHolder::None();
+                    VM_NEXT();
+
+                VM_CASE(Move):
+                    r[ins->a] = r[ins->b];
+                    VM_NEXT();
+
+                VM_CASE(CheckBound):
+                    if (r[ins->a].GetHeapObject() == unbound) {
+                        throw runtime_error("Var "s + code->names[ins->b].GetName()
+                                            + " not found"s);
+                    }
+                    VM_NEXT();
+
+                VM_CASE(LoadGlobal): {
+                    auto it = globals.find(code->names[ins->b]);
+                    if (it == globals.end()) {
+                        throw runtime_error("Var "s + code->names[ins->b].GetName()
+                                            + " not found"s);
+                    }
+                    r[ins->a] = it->second;
+                    VM_NEXT();
+                }
+
+                VM_CASE(StoreGlobal):
+                    globals[code->names[ins->a]] = r[ins->b];
+                    VM_NEXT();
+
+                VM_CASE(GetField): {
+                    if (r[ins->b].GetType() != ObjectType::ClassInstance) {
+                        throw runtime_error("Var "s + code->names[ins->d].GetName()
+                                            + " is not class"s);
+                    }
+                    auto field = r[ins->b].As<runtime::ClassInstance>().GetField(
+                        code->names[ins->c]);
+                    if (field == nullptr) {
+                        throw runtime_error("Var "s + code->names[ins->c].GetName()
+                                            + " not found"s);
+                    }
+                    r[ins->a] = *field;
+                    VM_NEXT();
+                }
+
+                VM_CASE(SetField):
+                    r[ins->a].As<runtime::ClassInstance>().SetField(code->names[ins->b],
+                                                                   r[ins->c]);
+                    VM_NEXT();
+
+                VM_CASE(CheckInstance):
+                    if (r[ins->a].GetType() != ObjectType::ClassInstance) {
+                        throw runtime_error(ins->b == 0 ? "Obj is not class instance"s
+                                                       : "Object is not class"s);
+                    }
+                    VM_NEXT();
+
+                VM_CASE(Add): {
+                    const ObjectHolder& lhs = RK(ins->b);
+                    const ObjectHolder& rhs = RK(ins->c);
+                    switch (runtime::CombineTypes(lhs.GetType(), rhs.GetType())) {
+                        case runtime::CombineTypes(ObjectType::Number, ObjectType::Number):
+                            r[ins->a] = ObjectHolder::Own(
+                                runtime::Number(lhs.AsNumber() + rhs.AsNumber()));
+                            break;
+                        case runtime::CombineTypes(ObjectType::String, ObjectType::String):
+                            r[ins->a] = runtime::ConcatenateStrings(lhs, rhs);
+                            break;
+                        default: {
+                            if (lhs.GetType() != ObjectType::ClassInstance) {
+                                throw runtime_error(
+                                    "Can only add nums, strings, class instances with "s
+                                    + ADD_METHOD.GetName());
+                            }
+                            ObjectHolder result = lhs.As<runtime::ClassInstance>().Call(
+                                ADD_METHOD, {rhs}, context);
+                            RELOAD_REGISTERS();
+                            r[ins->a] = move(result);
+                            break;
+                        }
+                    }
+                    VM_NEXT();
+                }
+
+                VM_CASE(Sub):
+                VM_CASE(Mult):
+                VM_CASE(Div): {
+                    const ObjectHolder& lhs = RK(ins->b);
+                    const ObjectHolder& rhs = RK(ins->c);
+
+                    if (ins->op == OpCode::Div && rhs.GetType() == ObjectType::Number
+                        && rhs.AsNumber() == 0) {
+                        throw runtime_error("Division by zero"s);
+                    }
+                    if (lhs.GetType() != ObjectType::Number
+                        || rhs.GetType() != ObjectType::Number) {
+                        throw runtime_error(ins->op == OpCode::Sub    ? "Can sub only nums"s
+                                            : ins->op == OpCode::Mult ? "Can multiply only nums"s
+                                                                     : "Can divide only nums"s);
+                    }
+
+                    const int x = lhs.AsNumber();
+                    const int y = rhs.AsNumber();
+                    const int value = ins->op == OpCode::Sub    ? x - y
+                                      : ins->op == OpCode::Mult ? x * y
+                                                               : x / y;
+                    r[ins->a] = ObjectHolder::Own(runtime::Number(value));
+                    VM_NEXT();
+                }
+
+                VM_CASE(Compare): {
+                    const bool result = CompareOperands(static_cast<runtime::CompareOp>(ins->d),
+                                                        RK(ins->b), RK(ins->c), context);
+                    RELOAD_REGISTERS();
+                    r[ins->a] = ObjectHolder::Own(runtime::Bool(result));
+                    VM_NEXT();
+                }
+
+                VM_CASE(Truth):
+                    r[ins->a] = ObjectHolder::Own(runtime::Bool(runtime::IsTrue(r[ins->b])));
+                    VM_NEXT();
+
+                VM_CASE(Not):
+                    r[ins->a] = ObjectHolder::Own(runtime::Bool(!runtime::IsTrue(r[ins->b])));
+                    VM_NEXT();
+
+                VM_CASE(Stringify): {
+                    ostringstream out;
+                    if (const ObjectHolder value = r[ins->b]) {
+                        value.Print(out, context);
+                        RELOAD_REGISTERS();
+                    } else {
+                        out << "None"sv;
+                    }
+                    r[ins->a] = ObjectHolder::Own(runtime::String(out.str()));
+                    VM_NEXT();
+                }
+
+                VM_CASE(Jump):
+                    pc = code->instructions.data() + ins->a;
+                    VM_NEXT();
+
+                VM_CASE(JumpIfFalse):
+                    if (!runtime::IsTrue(r[ins->a])) {
+                        pc = code->instructions.data() + ins->b;
+                    }
+                    VM_NEXT();
+
+                VM_CASE(JumpIfTrue):
+                    if (runtime::IsTrue(r[ins->a])) {
+                        pc = code->instructions.data() + ins->b;
+                    }
+                    VM_NEXT();
+
+                VM_CASE(CompareJump):
+                    if (!CompareOperands(static_cast<runtime::CompareOp>(ins->a), RK(ins->b),
+                                         RK(ins->c), context)) {
+                        pc = code->instructions.data() + ins->d;
+                    }
+                    RELOAD_REGISTERS();
+                    VM_NEXT();
+
+                VM_CASE(Call):
+                VM_CASE(CallStatic):
+                VM_CASE(TailCall): {
+                    if (r[ins->b].GetType() != ObjectType::ClassInstance) {
+                        throw runtime_error("Obj is not class instance"s);
+                    }
+                    auto& instance = r[ins->b].As<runtime::ClassInstance>();
+                    const runtime::Class* cls = &instance.GetClass();
+                    CallSite& site = code->call_sites[ins->c];
+                    CallSite::CacheEntry entry;
+
+                    if (ins->op == OpCode::CallStatic) {
+                        if (site.target.cls == nullptr) {
+                            site.target.cls = cls;
+                            site.target.code = GetCompiledCode(*site.target.method, *this);
+                        }
+                        entry = site.target;
+                    } else {
+                        auto it = find_if(site.cache.begin(),
+                                          site.cache.begin() + site.cache_size,
+                                          [cls](const auto& e) {
+                                              return e.cls == cls;
+                                          });
+                        if (it != site.cache.begin() + site.cache_size) {
+                            ++cache_stats.hits;
+                            entry = *it;
+                        } else {
+                            entry.cls = cls;
+                            entry.method = cls->GetMethod(site.name, site.argument_count);
+                            if (entry.method == nullptr) {
+                                // Сообщение об ошибке формирует ClassInstance::Call
+                                instance.Call(site.name,
+                                              {r + ins->d, r + ins->d + site.argument_count},
+                                              context);
+                            }
+                            entry.code = GetCompiledCode(*entry.method, *this);
+
+                            if (site.cache_size == CallSite::CACHE_SIZE) {
+                                ++cache_stats.megamorphic;
+                            } else {
+                                ++cache_stats.misses;
+                                site.cache[site.cache_size++] = entry;
+                            }
+                        }
+                    }
+
+                    if (entry.code == nullptr) {
+                        ObjectHolder result = instance.Call(
+                            *entry.method, {r + ins->d, r + ins->d + site.argument_count},
+                            context);
+                        RELOAD_REGISTERS();
+                        r[ins->a] = move(result);
+                        VM_NEXT();
+                    }
+
+                    if (ins->op == OpCode::TailCall) {
+                        tail_args_.clear();
+                        tail_args_.push_back(r[ins->b]);
+                        for (uint32_t i = 0; i < site.argument_count; ++i) {
+                            tail_args_.push_back(move(r[ins->d + i]));
+                        }
+
+                        const uint32_t result_register = frames_.back().result;
+                        for (size_t i = 0; i < code->register_count; ++i) {
+                            r[i] = ObjectHolder();
+                        }
+                        frames_.pop_back();
+
+                        base = PushFrame(*entry.code, result_register);
+                        RELOAD_REGISTERS();
+                        for (size_t i = 0; i < tail_args_.size(); ++i) {
+                            r[i] = move(tail_args_[i]);
+                        }
+
+                        code = entry.code;
+                        native = code->native_code.get();
+                        pc = code->instructions.data();
+                        VM_NEXT();
+                    }
+
+                    frames_.back().pc = pc;
+                    const size_t callee_base = PushFrame(*entry.code, ins->a);
+                    RELOAD_REGISTERS();
+                    ObjectHolder* callee = registers_.data() + callee_base;
+                    callee[0] = r[ins->b];
+                    for (uint32_t i = 0; i < site.argument_count; ++i) {
+                        callee[i + 1] = move(r[ins->d + i]);
+                    }
+
+                    code = entry.code;
+                    native = code->native_code.get();
+                    pc = code->instructions.data();
+                    base = callee_base;
+                    r = callee;
+                    VM_NEXT();
+                }
+
+                VM_CASE(New):
+                    r[ins->a] = ObjectHolder::Own(runtime::ClassInstance(*code->classes[ins->b]));
+                    VM_NEXT();
+
+                VM_CASE(PrintSpace):
+                    context.GetOutputStream() << " "s;
+                    VM_NEXT();
+
+                VM_CASE(PrintItem): {
+                    auto& out = context.GetOutputStream();
+                    if (const ObjectHolder value = r[ins->a]) {
+                        value.Print(out, context);
+                        RELOAD_REGISTERS();
+                    } else {
+                        out << "None"s;
+                    }
+                    VM_NEXT();
+                }
+
+                VM_CASE(PrintNewline):
+                    context.GetOutputStream() << endl;
+                    VM_NEXT();
+
+                VM_CASE(Return):
+                VM_CASE(ReturnNone): {
+                    ObjectHolder result;
+                    if (ins->op == OpCode::Return) {
+                        result = move(r[ins->a]);
+                    }
+
+                    const uint32_t result_register = frames_.back().result;
+                    for (size_t i = 0; i < code->register_count; ++i) {
+                        r[i] = ObjectHolder();
+                    }
+                    frames_.pop_back();
+
+                    if (frames_.size() == entry_depth) {
+                        return result;
+                    }
+
+                    const Frame& caller = frames_.back();
+                    code = caller.code;
+                    native = code->native_code.get();
+                    pc = caller.pc;
+                    base = caller.base;
+                    RELOAD_REGISTERS();
+                    r[result_register] = move(result);
+                    VM_NEXT();
+                }
+            }
+        }
+    } catch (...) {
+        Unwind(entry_depth);
+        throw;
+    }
+
+#undef VM_NEXT
+#undef VM_CASE
+#undef VM_FETCH
+#undef RK
+#undef RELOAD_REGISTERS
+}
+
+#ifdef MYTHON_VM_THREADED_DISPATCH
+#pragma GCC diagnostic pop
+#endif
+
+ObjectHolder Program::Execute(Closure& closure, Context& context) {
+    return machine_->Run(*code_, closure, context);
+}
+
+unique_ptr<Program> Compile(unique_ptr<ast::Statement> program) {
+    auto result = unique_ptr<Program>(new Program());
+    result->code_ = Compiler(*result->machine_).CompileBody(*program);
+    result->source_ = move(program);
+    return result;
+}
+
+}  // namespace vm
@@ -0,0 +1,207 @@
+#pragma once
+
+#include "jit.h"
+#include "runtime.h"
+#include "statement.h"
+
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+namespace vm {
+
+// Код операции регистровой виртуальной машины.
+// В комментариях r[x] - регистр x текущего кадра, операнды инструкции - a, b, c, d.
+// rk[x] - регистр x либо, если в x установлен бит CONSTANT_OPERAND, константа
+// constants[x - CONSTANT_OPERAND].
+// Таблица обработчиков в Machine::Execute перечисляет коды в том же порядке
+enum class OpCode : std::uint8_t {
+    LoadConst,      // r[a] = constants[b]
+    LoadNone,       // r[a] = None
+    Move,           // r[a] = r[b]
+    CheckBound,     // если переменной r[a] не присвоено значение: ошибка "Var names[b] not found"
+    LoadGlobal,     // r[a] = globals[names[b]]
+    StoreGlobal,    // globals[names[a]] = r[b]
+    GetField,       // r[a] = r[b].names[c]; names[d] - имя r[b] для сообщения об ошибке
+    SetField,       // r[a].names[b] = r[c]
+    CheckInstance,  // если r[a] - не экземпляр класса: ошибка с текстом, выбираемым b
+    Add,            // r[a] = rk[b] + rk[c]
+    Sub,            // r[a] = rk[b] - rk[c]
+    Mult,           // r[a] = rk[b] * rk[c]
+    Div,            // r[a] = rk[b] / rk[c]
+    Compare,        // r[a] = Compare(CompareOp(d), rk[b], rk[c])
+    Truth,          // r[a] = Bool(IsTrue(r[b]))
+    Not,            // r[a] = Bool(!IsTrue(r[b]))
+    Stringify,      // r[a] = str(r[b])
+    Jump,           // переход к инструкции a
+    JumpIfFalse,    // если !IsTrue(r[a]), переход к инструкции b
+    JumpIfTrue,     // если IsTrue(r[a]), переход к инструкции b
+    CompareJump,    // если !Compare(CompareOp(a), rk[b], rk[c]), переход к инструкции d
+    Call,           // r[a] = r[b].call_sites[c].name(r[d], ..., r[d + argc - 1])
+    CallStatic,     // r[a] = r[b].call_sites[c].target(r[d], ...) - метод известен заранее
+    TailCall,       // то же, что Call, за которым следует Return a. Скомпилированный метод
+                    // выполняется в кадре вызывающего метода, заменяя его
+    New,            // r[a] = новый экземпляр класса classes[b]
+    PrintSpace,     // выводит пробел, разделяющий аргументы print
+    PrintItem,      // выводит r[a]
+    PrintNewline,   // завершает строку print
+    Return,         // возвращает r[a] из текущего кадра
+    ReturnNone,     // возвращает None из текущего кадра
+};
+
+// Признак операнда rk, ссылающегося на константу
+constexpr std::uint32_t CONSTANT_OPERAND = 1U << 31U;
+
+struct Instruction {
+    OpCode op;
+    std::uint32_t a = 0;
+    std::uint32_t b = 0;
+    std::uint32_t c = 0;
+    std::uint32_t d = 0;
+};
+
+struct Code;
+
+// Место вызова метода с инлайн-кэшем методов классов получателей
+struct CallSite {
+    static constexpr size_t CACHE_SIZE = 4;
+
+    struct CacheEntry {
+        const runtime::Class* cls = nullptr;
+        const runtime::Method* method = nullptr;
+        // Байткод метода либо nullptr, если метод не скомпилирован данной машиной
+        const Code* code = nullptr;
+    };
+
+    runtime::Symbol name;
+    std::uint32_t argument_count = 0;
+    // Для CallStatic - заранее найденный метод, для Call - не используется
+    CacheEntry target;
+    std::array<CacheEntry, CACHE_SIZE> cache;
+    size_t cache_size = 0;
+};
+
+// Байткод программы верхнего уровня или метода
+struct Code {
+    std::vector<Instruction> instructions;
+    std::vector<runtime::ObjectHolder> constants;
+    std::vector<runtime::Symbol> names;
+    std::vector<const runtime::Class*> classes;
+    // Инлайн-кэши заполняются во время выполнения
+    mutable std::vector<CallSite> call_sites;
+
+    // Число регистров кадра. У метода регистр 0 занимает self, за ним следуют параметры,
+    // локальные переменные (в слотах, назначенных парсером) и временные значения
+    std::uint32_t register_count = 0;
+    // Число параметров метода
+    std::uint32_t param_count = 0;
+    // Регистры локальных переменных [unbound_begin, unbound_end), которые при входе в метод
+    // помечаются как не получившие значения. Диапазон пуст, если каждое чтение переменной
+    // происходит после присваивания ей значения
+    std::uint32_t unbound_begin = 0;
+    std::uint32_t unbound_end = 0;
+
+    // Число выполнений кода и машинный код, создаваемый после достижения порога JIT-компиляции
+    mutable std::uint32_t invocation_count = 0;
+    mutable std::unique_ptr<NativeCode> native_code;
+};
+
+class Machine;
+
+// Тело метода, скомпилированное в байткод. Заменяет исходное тело метода класса
+class CompiledMethod : public runtime::Executable {
+public:
+    CompiledMethod(std::unique_ptr<runtime::Executable> source, std::unique_ptr<Code> code,
+                   Machine& machine);
+
+    // Выполняет байткод метода. Значения self и параметров берутся из кадра,
+    // подготовленного ClassInstance::Call в context.GetCallStack()
+    runtime::ObjectHolder Execute(runtime::Closure& closure, runtime::Context& context) override;
+
+    [[nodiscard]] const Code& GetCode() const {
+        return *code_;
+    }
+
+    [[nodiscard]] const Machine& GetMachine() const {
+        return machine_;
+    }
+
+private:
+    std::unique_ptr<runtime::Executable> source_;
+    std::unique_ptr<Code> code_;
+    Machine& machine_;
+};
+
+// Виртуальная машина, исполняющая байткод. Регистры всех активных кадров размещаются
+// в одном векторе, вызовы между скомпилированными методами не используют стек C++
+class Machine {
+public:
+    // Наибольшая глубина вложенности вызовов скомпилированных методов
+    static constexpr size_t MAX_CALL_DEPTH = 1'000'000;
+    // Число вызовов метода, после которого для него создаётся машинный код
+    static constexpr std::uint32_t DEFAULT_JIT_THRESHOLD = 100;
+
+    // Включает JIT-компиляцию методов, выполненных threshold раз
+    void EnableJit(std::uint32_t threshold = DEFAULT_JIT_THRESHOLD) {
+        jit_threshold_ = threshold;
+    }
+
+    // Выполняет код верхнего уровня, используя globals для хранения глобальных переменных
+    runtime::ObjectHolder Run(const Code& code, runtime::Closure& globals,
+                              runtime::Context& context);
+
+    // Выполняет код метода. Значения self и параметров копируются из текущего кадра
+    // context.GetCallStack()
+    runtime::ObjectHolder Invoke(const Code& code, runtime::Context& context);
+
+private:
+    struct Frame {
+        const Code* code;
+        const Instruction* pc;
+        size_t base;
+        // Регистр вызывающего кадра, получающий результат
+        std::uint32_t result;
+    };
+
+    // Размещает кадр для code над текущим кадром. Регистры кадра пусты
+    size_t PushFrame(const Code& code, std::uint32_t result);
+    // Исполняет кадры, начиная с верхнего, пока не завершится кадр с номером entry_depth
+    runtime::ObjectHolder Execute(size_t entry_depth, runtime::Closure& globals,
+                                  runtime::Context& context);
+    // Освобождает регистры и кадры выше entry_depth после исключения
+    void Unwind(size_t entry_depth) noexcept;
+
+    std::vector<runtime::ObjectHolder> registers_;
+    std::vector<Frame> frames_;
+    // self и аргументы вызова в хвостовой позиции на время замены кадра
+    std::vector<runtime::ObjectHolder> tail_args_;
+    // Порог JIT-компиляции, ноль - JIT-компиляция выключена
+    std::uint32_t jit_threshold_ = 0;
+};
+
+// Программа, скомпилированная в байткод
+class Program : public runtime::Executable {
+public:
+    runtime::ObjectHolder Execute(runtime::Closure& closure, runtime::Context& context) override;
+
+    // Включает JIT-компиляцию часто вызываемых методов программы в машинный код.
+    // На платформах, отличных от x86-64, методы продолжают выполняться интерпретатором
+    void EnableJit(std::uint32_t threshold = Machine::DEFAULT_JIT_THRESHOLD) {
+        machine_->EnableJit(threshold);
+    }
+
+private:
+    friend std::unique_ptr<Program> Compile(std::unique_ptr<ast::Statement> program);
+
+    std::unique_ptr<Machine> machine_ = std::make_unique<Machine>();
+    // Дерево разбора владеет классами программы и исходными телами методов
+    std::unique_ptr<ast::Statement> source_;
+    std::unique_ptr<Code> code_;
+};
+
+// Компилирует в байткод программу, полученную от ParseProgram, и методы объявленных в ней
+// классов. Тела методов классов заменяются на CompiledMethod
+std::unique_ptr<Program> Compile(std::unique_ptr<ast::Statement> program);
+
+}  // namespace vm
@@ -0,0 +1,326 @@
+#include "gc.h"
+#include "program_test_utils.h"
+#include "test_runner.h"
+#include "vm.h"
+
+using namespace std;
+
+namespace vm {
+
+namespace {
+
+unique_ptr<Program> CompileFromString(const string& program) {
+    return Compile(ParseFromString(program));
+}
+
+// Выполняет программу обходом дерева разбора и на виртуальной машине,
+// проверяет, что вывод совпадает, и возвращает его
+string RunOnBothBackends(const string& program) {
+    return RunAndCompareWithTree(program, CompileFromString);
+}
+
+void TestExpressions() {
+    const string program = R"(
+x = 4
+y = 5
+s = "hello, "
+print x + y, s + "world", x * y - 1, y / 2, x < y, not x, None
+print x > 3 and y < 3, x or y, 0 or "", str(x) + str(y), str(None)
+if x + y == 9:
+  z = 1
+else:
+  z = 2
+print z, x != y, s >= "hello", "a" <= "b"
+)"s;
+
+    ASSERT_EQUAL(RunOnBothBackends(program),
+                 "9 hello, world 19 2 True False None\n"
+                 "False True False 45 None\n"
+                 "1 True True True\n"s);
+}
+
+void TestClasses() {
+    const string program = R"(
+class Shape:
+  def __str__():
+    return "Shape"
+
+  def area():
+    return 0
+
+class Rect(Shape):
+  def __init__(w, h):
+    self.w = w
+    self.h = h
+
+  def area():
+    return self.w * self.h
+
+  def __str__():
+    return "Rect(" + str(self.w) + 'x' + str(self.h) + ')'
+
+  def __eq__(other):
+    return self.area() == other.area()
+
+  def __lt__(other):
+    return self.area() < other.area()
+
+  def __add__(other):
+    return self.area() + other.area()
+
+class Counter:
+  def __init__():
+    self.value = 0
+
+  def add(n):
+    total = self.value + n
+    self.value = total
+    return total
+
+  def fact(n):
+    if n < 2:
+      return 1
+    return n * self.fact(n - 1)
+
+  def swap(a, b):
+    a = b
+    b = a
+    return a - b
+
+shapes = Shape()
+r = Rect(2, 3)
+q = Rect(3, 2)
+c = Counter()
+print shapes, r, shapes.area(), r.area(), r + q
+print r == q, r < q, r >= q, r != q
+print c.add(1), c.add(2), c.value, c.fact(10), c.swap(1, 2)
+r.w = Counter()
+r.w.value = 7
+print r.w.value, r.w.add(3)
+)"s;
+
+    ASSERT_EQUAL(RunOnBothBackends(program),
+                 "Shape Rect(2x3) 0 6 12\nTrue False True False\n"
+                 "1 3 3 3628800 0\n7 10\n"s);
+}
+
+void TestErrors() {
+    const vector<string> programs = {
+        "print x\n"s,
+        "x = 1\nprint x.y\n"s,
+        "x = 1\nx.y()\n"s,
+        "print 1 / 0\n"s,
+        "print 1 - 'a'\n"s,
+        "print 1 < 'a'\n"s,
+        "class A:\n  def f():\n    return 1\na = A()\na.f(1)\n"s,
+        "class A:\n  def f():\n    if False:\n      x = 1\n    return x\na = A()\nprint a.f()\n"s,
+    };
+
+    for (const string& program : programs) {
+        runtime::DummyContext context;
+        runtime::Closure closure;
+        auto compiled = CompileFromString(program);
+        ASSERT_THROWS(compiled->Execute(closure, context), runtime_error);
+    }
+}
+
+void TestRecoversAfterError() {
+    const string program = R"(
+class Walker:
+  def walk(n, d):
+    if n == 0:
+      return 10 / d
+    return self.walk(n - 1, d)
+
+w = Walker()
+)"s;
+
+    runtime::DummyContext context;
+    runtime::Closure closure;
+    auto compiled = CompileFromString(program);
+    compiled->Execute(closure, context);
+
+    using runtime::Number;
+    using runtime::ObjectHolder;
+    auto& walker = closure.at("w"s).As<runtime::ClassInstance>();
+    ASSERT_THROWS(
+        walker.Call("walk"s, {ObjectHolder::Own(Number(5)), ObjectHolder::Own(Number(0))},
+                    context),
+        runtime_error);
+
+    auto result = walker.Call(
+        "walk"s, {ObjectHolder::Own(Number(5)), ObjectHolder::Own(Number(2))}, context);
+    ASSERT_EQUAL(result.As<Number>().GetValue(), 5);
+}
+
+void TestDeepRecursion() {
+    // Вызовы между скомпилированными методами не расходуют стек C++
+    const string program = R"(
+class Sum:
+  def calc(n):
+    if n == 0:
+      return 0
+    return 1 + self.calc(n - 1)
+
+s = Sum()
+print s.calc(200000)
+)"s;
+
+    runtime::DummyContext context;
+    runtime::Closure closure;
+    CompileFromString(program)->Execute(closure, context);
+
+    ASSERT_EQUAL(context.output.str(), "200000\n"s);
+}
+
+void TestTailCalls() {
+    // Глубина хвостовой рекурсии не ограничена ни стеком C++, ни числом кадров машины
+    const string program = R"(
+class Counter:
+  def count(n, acc):
+    if n == 0:
+      return acc
+    return self.count(n - 1, acc + 1)
+
+class Ping:
+  def ping(pong, n):
+    if n == 0:
+      return "done"
+    return pong.pong(self, n - 1)
+
+class Pong:
+  def pong(ping, n):
+    return ping.ping(self, n)
+
+c = Counter()
+p = Ping()
+print c.count(1500000, 0), p.ping(Pong(), 1500000)
+)"s;
+
+    ASSERT_EQUAL(RunOnBothBackends(program), "1500000 done\n"s);
+}
+
+void TestUnboundCheckKeepsNumbersInline() {
+    // Проверка того, что переменной, присвоенной внутри if, присвоено значение, не размещает
+    // это значение в куче
+    const string program = R"(
+class Walker:
+  def walk(n, acc):
+    if n > 0:
+      x = n
+    if n == 0:
+      return acc
+    return self.walk(n - 1, acc + x)
+
+w = Walker()
+print w.walk(20000, 0)
+)"s;
+
+    const auto& stats = runtime::GetAllocationStats();
+    const uint64_t before = stats.heap_objects;
+    Run(*ParseFromString(program));
+    const uint64_t tree_objects = stats.heap_objects - before;
+
+    runtime::DummyContext context;
+    runtime::Closure closure;
+    CompileFromString(program)->Execute(closure, context);
+    ASSERT_EQUAL(context.output.str(), "200010000\n"s);
+    ASSERT_EQUAL(stats.heap_objects - before - tree_objects, tree_objects);
+}
+
+void TestCyclesOutliveProgram() {
+    const string program = R"(
+class Node:
+  def link(other):
+    self.next = other
+    other.next = self
+
+a = Node()
+a.link(Node())
+print "linked"
+)"s;
+
+    const auto instance_index = static_cast<size_t>(runtime::ObjectType::ClassInstance);
+    const auto& stats = runtime::GetAllocationStats();
+    auto& collector = runtime::CycleCollector::Instance();
+    collector.Collect();
+    const uint64_t live = stats.live_objects[instance_index];
+
+    ASSERT_EQUAL(RunOnBothBackends(program), "linked\n"s);
+    if constexpr (!runtime::COLLECT_CYCLES) {
+        return;
+    }
+    collector.Collect();
+    ASSERT_EQUAL(stats.live_objects[instance_index], live);
+    ASSERT_EQUAL(collector.GetCandidateCount(), 0U);
+}
+
+void TestJit() {
+    // Методы становятся горячими после первого вызова. Операнды меняют тип, чтобы машинный код
+    // передавал интерпретатору инструкции, не прошедшие проверку
+    const string program = R"(
+class Calc:
+  def calc(a, b):
+    x = a + b
+    y = a * b - b
+    if x < y:
+      z = x / b
+    else:
+      z = y
+    return not x or z
+
+  def fib(n):
+    if n <= 1:
+      return n
+    return self.fib(n - 1) + self.fib(n - 2)
+
+  def div(a, b):
+    return a / b
+
+  def join(a, b):
+    return a + b
+
+c = Calc()
+print c.calc(1, 2), c.calc(5, 7), c.calc(0, 0 - 3), c.calc(5, 7)
+print c.fib(15), c.div(7, 2), c.div(0 - 7, 2), c.join(1, 2), c.join("a", "b"), c.join(3, 4)
+)"s;
+
+    const string expected = Run(*ParseFromString(program));
+
+    const JitStats before = GetJitStats();
+    auto compiled = CompileFromString(program);
+    compiled->EnableJit(1);
+    runtime::DummyContext context;
+    runtime::Closure closure;
+    compiled->Execute(closure, context);
+    ASSERT_EQUAL(context.output.str(), expected);
+
+    auto& calc = closure.at("c"s).As<runtime::ClassInstance>();
+    using runtime::Number;
+    using runtime::ObjectHolder;
+    ASSERT_THROWS(
+        calc.Call("div"s, {ObjectHolder::Own(Number(1)), ObjectHolder::Own(Number(0))}, context),
+        runtime_error);
+
+    if (NativeCode::IsSupported()) {
+        // Код верхнего уровня выполнен один раз и тоже достиг порога
+        ASSERT_EQUAL(GetJitStats().compiled_methods - before.compiled_methods, 5U);
+        ASSERT(GetJitStats().native_instructions > before.native_instructions);
+    }
+}
+
+}  // namespace
+
+void RunUnitTests(TestRunner& tr) {
+    RUN_TEST(tr, vm::TestExpressions);
+    RUN_TEST(tr, vm::TestClasses);
+    RUN_TEST(tr, vm::TestErrors);
+    RUN_TEST(tr, vm::TestRecoversAfterError);
+    RUN_TEST(tr, vm::TestDeepRecursion);
+    RUN_TEST(tr, vm::TestTailCalls);
+    RUN_TEST(tr, vm::TestUnboundCheckKeepsNumbersInline);
+    RUN_TEST(tr, vm::TestCyclesOutliveProgram);
+    RUN_TEST(tr, vm::TestJit);
+}
+
+}  // namespace vm